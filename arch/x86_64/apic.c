@@ -26,6 +26,7 @@
 apic_id_t bsp_id;
 apic_id_t local_apics[MAX_CORES];   /*!< IDs of local APICs */
 size_t local_apic_count;            /*!< Number of local APICs */
+unsigned char local_apic_indices[LOCAL_APIC_ID_COUNT]; /*!< CPU indices */
 void *local_apic_addr;              /*!< Address of CPU local APIC */
 apic_id_t ioapic_id;                /*!< ID of I/O APIC */
 void *ioapic_addr;                  /*!< Address of I/O APIC */
@@ -45,6 +46,7 @@ add_local_apic (const struct acpi_madt_local_apic *entry)
       && ((entry->flags & LOCAL_APIC_FLAG_ENABLED)
 	  || (entry->flags & LOCAL_APIC_FLAG_ONLINE_CAP)))
     {
+      local_apic_indices[entry->local_apic_id] = local_apic_count;
       local_apics[local_apic_count++] = entry->local_apic_id;
       printf ("ACPI: found local APIC (%#x)\n", entry->local_apic_id);
     }
@@ -239,6 +241,12 @@ acpi_parse_madt (const struct acpi_madt *madt)
       ioapic_entry (0x20 + i, bsp_id, APIC_MODE_FIXED, 0, 0);
   ioapic_irq_map[2] = 0; /* ISA IRQ2 doesn't exist */
 
+  /* Use the default local APIC address unless an override entry is found.
+     This is set before parsing entries since smp_cpu_index() reads the
+     local APIC as soon as more than one processor is registered. */
+  if (!local_apic_addr)
+    local_apic_addr = (void *) PHYS32_REL (LOCAL_APIC_DEFAULT_ADDR);
+
   /* Parse MADT entries */
   for (i = offsetof (struct acpi_madt, entries); i < madt->header.len;
        i += entry->len, ptr += entry->len,
@@ -261,9 +269,5 @@ acpi_parse_madt (const struct acpi_madt *madt)
 	  break;
 	}
     }
-
-  /* If no local APIC address was given, guess */
-  if (!local_apic_addr)
-    local_apic_addr = (void *) PHYS32_REL (LOCAL_APIC_DEFAULT_ADDR);
 #endif /* USE_APIC */
 }
@@ -45,6 +45,22 @@ set_int_vector (unsigned char num, void *addr, unsigned char privilege,
   idt_table[num].reserved = 0;
 }
 
+/*!
+ * Sets the interrupt stack table entry used by an interrupt vector. The
+ * processor switches to the stack in that entry of the task state segment
+ * when the interrupt occurs, even if the privilege level does not change.
+ *
+ * @param num the interrupt vector number
+ * @param ist the interrupt stack table entry, or zero to use the current
+ * stack
+ */
+
+void
+set_int_ist (unsigned char num, unsigned char ist)
+{
+  idt_table[num].ist = ist & 7;
+}
+
 /*!
  * Initializes the long mode interrupt descriptor table and remaps the 8259 PIC.
  */
@@ -54,6 +70,7 @@ init_idt (void)
 {
   /* Fill and load the IDT */
   fill_idt_vectors ();
+  set_int_vector (INT_PAGE_FAULT, int_page_fault_entry, 3, IDT_GATE_INT);
   set_int_vector (INT_SIGRETURN, int_sigreturn, 3, IDT_GATE_INT);
   idt_ptr.size = sizeof (idt_table) - 1;
   idt_ptr.addr = idt_table;
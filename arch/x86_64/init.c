@@ -57,6 +57,7 @@ arch_init (void)
   init_kernel_heap ();
   init_system_fd_table ();
   mark_resv_mem_alloc ();
+  init_zero_page ();
 
   /* Remap the 8259 PIC and disable it if using the APIC */
   pic_8259_remap ();
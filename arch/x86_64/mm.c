@@ -17,8 +17,11 @@
 /*! @file */
 
 #include <pml/alloc.h>
+#include <pml/interrupt.h>
+#include <pml/lock.h>
 #include <pml/memory.h>
 #include <pml/multiboot.h>
+#include <pml/swap.h>
 #include <errno.h>
 #include <string.h>
 
@@ -26,7 +29,8 @@ extern void *boot_stack;
 
 static uintptr_t kernel_stack_pdt[PAGE_STRUCT_ENTRIES] __page_align;
 static uintptr_t kernel_stack_pt[PAGE_STRUCT_ENTRIES] __page_align;
-static int mem_avail;
+static uint32_t page_free_lists[PAGE_MAX_ORDER + 1];
+static lock_t page_alloc_lock;
 
 uintptr_t kernel_pml4t[PAGE_STRUCT_ENTRIES];
 uintptr_t kernel_thread_local_pdpt[PAGE_STRUCT_ENTRIES];
@@ -36,6 +40,9 @@ uintptr_t phys_map_pdpt[PAGE_STRUCT_ENTRIES * 4];
 struct page_meta *phys_alloc_table;
 uintptr_t next_phys_addr;
 uintptr_t total_phys_mem;
+size_t phys_page_count;
+size_t phys_free_pages;
+struct page_cache page_caches[MAX_CORES];
 struct mem_map mmap;
 
 /*! 
@@ -101,71 +108,287 @@ vm_phys_addr (uintptr_t *pml4t, void *addr)
 }
 
 /*!
- * Maps the page at the virtual address to a physical address. The
- * virtual address must not be in a large page, and the physical address
- * does not need to be page-aligned.
+ * Makes a copy-on-write paging structure private to the address space
+ * containing the entry that points to it. The structure is copied only if
+ * another address space still holds a reference to it, otherwise it is
+ * reused in place. Either way, the entries in it become copy-on-write, so
+ * the sharing is resolved one level further down on the next write.
+ * Pages in a page table that has no other owner keep write access
+ * if they are also not shared, since copying them would be redundant.
  *
- * @param pml4t the address space to perform the mapping
- * @param phys_addr the physical address to be mapped
- * @param addr the virtual address to map the physical address to
- * @param flags extra page flags
+ * @param entry the paging structure entry marked copy-on-write
+ * @param pt whether the paging structure is a page table
  * @return zero on success
  */
 
 int
-vm_map_page (uintptr_t *pml4t, uintptr_t phys_addr, void *addr,
-	     unsigned int flags)
+vm_unshare_table (uintptr_t *entry, int pt)
+{
+  uintptr_t old = ALIGN_DOWN (*entry, PAGE_SIZE);
+  uintptr_t *table = (uintptr_t *) PHYS_REL (old);
+  int owned = page_ref_count (old) == 1;
+  size_t i;
+  if (!owned)
+    {
+      uintptr_t page = alloc_page ();
+      if (UNLIKELY (!page))
+	RETV_ERROR (ENOMEM, -1);
+      memcpy ((void *) PHYS_REL (page), table, PAGE_SIZE);
+      table = (uintptr_t *) PHYS_REL (page);
+      free_page (old);
+      *entry = page | (*entry & (PAGE_SIZE - 1));
+    }
+
+  for (i = 0; i < PAGE_STRUCT_ENTRIES; i++)
+    {
+      uintptr_t e = table[i];
+      if (!(e & PAGE_FLAG_PRESENT) || !(e & PAGE_FLAG_RW))
+	continue;
+
+      /* Pages of shared file mappings stay shared */
+      if (e & PAGE_FLAG_SHARED)
+	continue;
+      if (owned && (pt ? page_ref_count (e) == 1
+		    : (e & PAGE_FLAG_SIZE) && vm_large_page_owned (e)))
+	continue;
+      table[i] = (e & ~PAGE_FLAG_RW) | PAGE_FLAG_COW;
+    }
+  *entry = (*entry | PAGE_FLAG_RW) & ~PAGE_FLAG_COW;
+  return 0;
+}
+
+/*!
+ * Looks up the page directory table containing the entry for a virtual
+ * address, allocating any missing paging structures above it.
+ *
+ * @param pml4t the address space to walk
+ * @param v the virtual address
+ * @param flags extra page flags for newly allocated paging structures
+ * @return the page directory table, or NULL on failure
+ */
+
+static uintptr_t *
+vm_alloc_pdt (uintptr_t *pml4t, uintptr_t v, unsigned int flags)
 {
-  uintptr_t v = (uintptr_t) addr;
   unsigned int pml4e;
   unsigned int pdpe;
-  unsigned int pde;
-  unsigned int pte;
   uintptr_t *pdpt;
-  uintptr_t *pdt;
-  uintptr_t *pt;
 
+  flags &= ~PAGE_LEAF_FLAGS;
   pml4e = PML4T_INDEX (v);
   if (v >> 48 != !!(pml4e & 0x100) * 0xffff) /* Check sign extension */
-    RETV_ERROR (EFAULT, -1);
+    RETV_ERROR (EFAULT, NULL);
   if (!(pml4t[pml4e] & PAGE_FLAG_PRESENT))
     {
-      pml4t[pml4e] = alloc_page ();
+      pml4t[pml4e] = alloc_zeroed_page ();
       if (UNLIKELY (!pml4t[pml4e]))
-	return -1;
-      memset ((void *) PHYS_REL (pml4t[pml4e]), 0, PAGE_STRUCT_SIZE);
+	return NULL;
       pml4t[pml4e] |= PAGE_FLAG_PRESENT | PAGE_FLAG_RW | PAGE_FLAG_USER | flags;
     }
+  else if ((pml4t[pml4e] & PAGE_FLAG_COW)
+	   && vm_unshare_table (pml4t + pml4e, 0))
+    return NULL;
 
   pdpt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (pml4t[pml4e], PAGE_SIZE));
   pdpe = PDPT_INDEX (v);
   if (!(pdpt[pdpe] & PAGE_FLAG_PRESENT))
     {
-      pdpt[pdpe] = alloc_page ();
+      pdpt[pdpe] = alloc_zeroed_page ();
       if (UNLIKELY (!pdpt[pdpe]))
-	return -1;
-      memset ((void *) PHYS_REL (pdpt[pdpe]), 0, PAGE_STRUCT_SIZE);
+	return NULL;
       pdpt[pdpe] |= PAGE_FLAG_PRESENT | PAGE_FLAG_RW | PAGE_FLAG_USER | flags;
     }
   if (pdpt[pdpe] & PAGE_FLAG_SIZE)
-    RETV_ERROR (EINVAL, -1);
+    RETV_ERROR (EINVAL, NULL);
+  if ((pdpt[pdpe] & PAGE_FLAG_COW) && vm_unshare_table (pdpt + pdpe, 0))
+    return NULL;
+  return (uintptr_t *) PHYS_REL (ALIGN_DOWN (pdpt[pdpe], PAGE_SIZE));
+}
+
+/*!
+ * Looks up the page directory entry for a virtual address without
+ * allocating any paging structures.
+ *
+ * @param pml4t the address space to walk
+ * @param v the virtual address
+ * @return a pointer to the page directory entry, or NULL if no page
+ * directory table exists for the address
+ */
 
+static uintptr_t *
+vm_lookup_pde (uintptr_t *pml4t, uintptr_t v)
+{
+  unsigned int pml4e;
+  unsigned int pdpe;
+  uintptr_t *pdpt;
+  uintptr_t *pdt;
+
+  pml4e = PML4T_INDEX (v);
+  if (!(pml4t[pml4e] & PAGE_FLAG_PRESENT))
+    return NULL;
+  pdpt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (pml4t[pml4e], PAGE_SIZE));
+  pdpe = PDPT_INDEX (v);
+  if (!(pdpt[pdpe] & PAGE_FLAG_PRESENT) || (pdpt[pdpe] & PAGE_FLAG_SIZE))
+    return NULL;
   pdt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (pdpt[pdpe], PAGE_SIZE));
-  pde = PDT_INDEX (v);
-  if (!(pdt[pde] & PAGE_FLAG_PRESENT))
+  return pdt + PDT_INDEX (v);
+}
+
+/*!
+ * Determines the end of the part of a range that is covered by the same
+ * page table as its start.
+ *
+ * @param ptr the current address in the range
+ * @param end the end of the range
+ * @return the end of the part of the range
+ */
+
+static inline uintptr_t
+vm_range_next (uintptr_t ptr, uintptr_t end)
+{
+  uintptr_t next = ALIGN_DOWN (ptr, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE;
+  return next < end ? next : end;
+}
+
+/*!
+ * Looks up the page directory pointer table entry for a virtual address
+ * without allocating any paging structures. Copy-on-write paging
+ * structures down to the page directory table are unshared, since range
+ * operations modify the page directory table.
+ *
+ * @param pml4t the address space to walk
+ * @param v the virtual address
+ * @param pdpe pointer to store the page directory pointer table entry, which
+ * is NULL if no page directory table exists for the address
+ * @return zero on success
+ */
+
+static int
+vm_lookup_pdpe (uintptr_t *pml4t, uintptr_t v, uintptr_t **pdpe)
+{
+  unsigned int pml4e = PML4T_INDEX (v);
+  uintptr_t *pdpt;
+  *pdpe = NULL;
+  if (!(pml4t[pml4e] & PAGE_FLAG_PRESENT))
+    return 0;
+  if ((pml4t[pml4e] & PAGE_FLAG_COW) && vm_unshare_table (pml4t + pml4e, 0))
+    return -1;
+  pdpt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (pml4t[pml4e], PAGE_SIZE));
+  pdpt += PDPT_INDEX (v);
+  if (!(*pdpt & PAGE_FLAG_PRESENT) || (*pdpt & PAGE_FLAG_SIZE))
+    return 0;
+  if ((*pdpt & PAGE_FLAG_COW) && vm_unshare_table (pdpt, 0))
+    return -1;
+  *pdpe = pdpt;
+  return 0;
+}
+
+/*!
+ * Looks up the page table containing the entry for a virtual address,
+ * allocating any missing paging structures. A large page covering the
+ * address is split, and a copy-on-write page table is unshared.
+ *
+ * @param pml4t the address space to walk
+ * @param v the virtual address
+ * @param flags extra page flags for newly allocated paging structures
+ * @return the page table, or NULL on failure
+ */
+
+static uintptr_t *
+vm_alloc_pt (uintptr_t *pml4t, uintptr_t v, unsigned int flags)
+{
+  uintptr_t *pdt = vm_alloc_pdt (pml4t, v, flags);
+  uintptr_t *pde;
+  if (UNLIKELY (!pdt))
+    return NULL;
+  pde = pdt + PDT_INDEX (v);
+  if (!(*pde & PAGE_FLAG_PRESENT))
     {
-      pdt[pde] = alloc_page ();
-      if (UNLIKELY (!pdt[pde]))
-	return -1;
-      memset ((void *) PHYS_REL (pdt[pde]), 0, PAGE_STRUCT_SIZE);
-      pdt[pde] |= PAGE_FLAG_PRESENT | PAGE_FLAG_RW | PAGE_FLAG_USER | flags;
+      *pde = alloc_zeroed_page ();
+      if (UNLIKELY (!*pde))
+	return NULL;
+      *pde |= PAGE_FLAG_PRESENT | PAGE_FLAG_RW | PAGE_FLAG_USER
+	| (flags & ~PAGE_LEAF_FLAGS);
     }
-  if (pdt[pde] & PAGE_FLAG_SIZE)
-    RETV_ERROR (EINVAL, -1);
+  if (*pde & PAGE_FLAG_SIZE)
+    {
+      if (vm_split_large_page (pml4t, (void *) v))
+	return NULL;
+    }
+  else if ((*pde & PAGE_FLAG_COW) && vm_unshare_table (pde, 1))
+    return NULL;
+  return (uintptr_t *) PHYS_REL (ALIGN_DOWN (*pde, PAGE_SIZE));
+}
 
-  pt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (pdt[pde], PAGE_SIZE));
-  pte = PT_INDEX (v);
-  pt[pte] = ALIGN_DOWN (phys_addr, PAGE_SIZE) | PAGE_FLAG_PRESENT | flags;
+/*!
+ * Determines whether a paging structure contains no entries.
+ *
+ * @param table the paging structure
+ * @return nonzero if every entry is zero
+ */
+
+static int
+vm_table_empty (uintptr_t *table)
+{
+  size_t i;
+  for (i = 0; i < PAGE_STRUCT_ENTRIES; i++)
+    {
+      if (table[i])
+	return 0;
+    }
+  return 1;
+}
+
+/*!
+ * Invalidates the TLB entries in a range collected by range operations and
+ * empties the range. Each page is invalidated separately if the range is
+ * small, otherwise the whole TLB is flushed. Other CPUs sharing the range
+ * are sent the whole range at once.
+ *
+ * @param flush the range to invalidate
+ */
+
+void
+vm_flush_tlb (struct vm_flush *flush)
+{
+  uintptr_t ptr;
+  if (flush->start == flush->end)
+    return;
+  if (flush->end - flush->start > VM_FLUSH_MAX_PAGES * PAGE_SIZE)
+    vm_clear_tlb ();
+  else
+    {
+      for (ptr = flush->start; ptr < flush->end; ptr += PAGE_SIZE)
+	vm_invlpg ((void *) ptr);
+    }
+  if (vm_tlb_tracking)
+    vm_tlb_update (flush->start, flush->end);
+  flush->start = 0;
+  flush->end = 0;
+}
+
+/*!
+ * Maps the page at the virtual address to a physical address. If the
+ * virtual address is in a large page, the large page is split first. The
+ * physical address does not need to be page-aligned.
+ *
+ * @param pml4t the address space to perform the mapping
+ * @param phys_addr the physical address to be mapped
+ * @param addr the virtual address to map the physical address to
+ * @param flags extra page flags
+ * @return zero on success
+ */
+
+int
+vm_map_page (uintptr_t *pml4t, uintptr_t phys_addr, void *addr,
+	     unsigned int flags)
+{
+  uintptr_t v = (uintptr_t) addr;
+  uintptr_t *pt = vm_alloc_pt (pml4t, v, flags);
+  if (UNLIKELY (!pt))
+    return -1;
+  pt[PT_INDEX (v)] = ALIGN_DOWN (phys_addr, PAGE_SIZE) | PAGE_FLAG_PRESENT
+    | flags;
   return 0;
 }
 
@@ -196,6 +419,8 @@ vm_unmap_page (uintptr_t *pml4t, void *addr)
     RETV_ERROR (EFAULT, -1);
   if (!(pml4t[pml4e] & PAGE_FLAG_PRESENT))
     return 0;
+  if ((pml4t[pml4e] & PAGE_FLAG_COW) && vm_unshare_table (pml4t + pml4e, 0))
+    return -1;
 
   pdpt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (pml4t[pml4e], PAGE_SIZE));
   pdpe = PDPT_INDEX (v);
@@ -206,6 +431,8 @@ vm_unmap_page (uintptr_t *pml4t, void *addr)
       pdpt[pdpe] = 0;
       return 0;
     }
+  if ((pdpt[pdpe] & PAGE_FLAG_COW) && vm_unshare_table (pdpt + pdpe, 0))
+    return -1;
 
   pdt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (pdpt[pdpe], PAGE_SIZE));
   pde = PDT_INDEX (v);
@@ -216,6 +443,8 @@ vm_unmap_page (uintptr_t *pml4t, void *addr)
       pdt[pde] = 0;
       return 0;
     }
+  if ((pdt[pde] & PAGE_FLAG_COW) && vm_unshare_table (pdt + pde, 1))
+    return -1;
 
   pt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (pdt[pde], PAGE_SIZE));
   pte = PT_INDEX (v);
@@ -224,35 +453,998 @@ vm_unmap_page (uintptr_t *pml4t, void *addr)
 }
 
 /*!
- * Moves @ref next_phys_addr to the next accessible physical page, skipping
- * any memory holes specified in the Multiboot2 memory map.
+ * Maps a 2 MiB large page at the virtual address to a physical address.
+ * Both addresses are aligned down to the large page size. An existing page
+ * table covering the virtual address is replaced only if all of its entries
+ * are zero, otherwise the caller should map the range with 4 KiB pages.
+ *
+ * @param pml4t the address space to perform the mapping
+ * @param phys_addr the physical address of the large page
+ * @param addr the virtual address to map the large page to
+ * @param flags extra page flags
+ * @return zero on success
+ */
+
+int
+vm_map_large_page (uintptr_t *pml4t, uintptr_t phys_addr, void *addr,
+		   unsigned int flags)
+{
+  uintptr_t v = (uintptr_t) addr;
+  unsigned int pde;
+  uintptr_t *pdt;
+
+  pdt = vm_alloc_pdt (pml4t, v, flags);
+  if (UNLIKELY (!pdt))
+    return -1;
+  pde = PDT_INDEX (v);
+  if ((pdt[pde] & PAGE_FLAG_PRESENT) && !(pdt[pde] & PAGE_FLAG_SIZE))
+    {
+      /* Entries of pages that were swapped out are not present but still
+	 own a swap slot, so any nonzero entry keeps the page table */
+      if (!vm_table_empty ((uintptr_t *) PHYS_REL (ALIGN_DOWN (pdt[pde],
+							       PAGE_SIZE))))
+	RETV_ERROR (EEXIST, -1);
+      free_page (pdt[pde]);
+    }
+  pdt[pde] = ALIGN_DOWN (phys_addr, LARGE_PAGE_SIZE) | PAGE_FLAG_PRESENT
+    | PAGE_FLAG_SIZE | flags;
+  return 0;
+}
+
+/*!
+ * Splits a large page mapping into a page table of 4 KiB mappings with the
+ * same physical addresses and flags. Nothing is done if the virtual address
+ * is not mapped in a large page.
+ *
+ * @param pml4t the address space containing the mapping
+ * @param addr a virtual address in the large page
+ * @return zero on success
+ */
+
+int
+vm_split_large_page (uintptr_t *pml4t, void *addr)
+{
+  uintptr_t *pde = vm_lookup_pde (pml4t, (uintptr_t) addr);
+  uintptr_t page;
+  uintptr_t phys;
+  uintptr_t *pt;
+  unsigned int flags;
+  size_t i;
+  if (!pde || !(*pde & PAGE_FLAG_PRESENT) || !(*pde & PAGE_FLAG_SIZE))
+    return 0;
+
+  page = alloc_page ();
+  if (UNLIKELY (!page))
+    RETV_ERROR (ENOMEM, -1);
+  phys = ALIGN_DOWN (*pde, LARGE_PAGE_SIZE);
+  flags = *pde & (PAGE_SIZE - 1) & ~PAGE_FLAG_SIZE;
+  pt = (uintptr_t *) PHYS_REL (page);
+  for (i = 0; i < PAGE_STRUCT_ENTRIES; i++)
+    pt[i] = (phys + i * PAGE_SIZE) | flags;
+  split_page (phys, LARGE_PAGE_ORDER);
+  *pde = page | PAGE_FLAG_PRESENT | PAGE_FLAG_RW | PAGE_FLAG_USER;
+  vm_clear_page ((void *) ALIGN_DOWN ((uintptr_t) addr, LARGE_PAGE_SIZE));
+  return 0;
+}
+
+/*!
+ * Maps a range of virtual memory to physically contiguous memory. The
+ * paging structures are walked once for each page table covering the
+ * range. Existing mappings in the range are replaced without dropping
+ * references to them or invalidating the TLB.
+ *
+ * @param pml4t the address space to perform the mapping
+ * @param phys_addr the physical address to map the start of the range to
+ * @param addr the page-aligned virtual address of the range
+ * @param len the page-aligned length of the range
+ * @param flags extra page flags
+ * @return zero on success
+ */
+
+int
+vm_map_range (uintptr_t *pml4t, uintptr_t phys_addr, void *addr, size_t len,
+	      unsigned int flags)
+{
+  uintptr_t ptr = (uintptr_t) addr;
+  uintptr_t end = ptr + len;
+  phys_addr = ALIGN_DOWN (phys_addr, PAGE_SIZE);
+  while (ptr < end)
+    {
+      uintptr_t next = vm_range_next (ptr, end);
+      uintptr_t *pt = vm_alloc_pt (pml4t, ptr, flags);
+      if (UNLIKELY (!pt))
+	return -1;
+      for (; ptr < next; ptr += PAGE_SIZE, phys_addr += PAGE_SIZE)
+	pt[PT_INDEX (ptr)] = phys_addr | PAGE_FLAG_PRESENT | flags;
+    }
+  return 0;
+}
+
+/*!
+ * Unmaps a range of virtual memory and drops a reference to every page
+ * frame mapped in it. Large pages that are only partially contained in the
+ * range are split first. In the user-space half of the address space, page
+ * tables and page directory tables left empty are freed. Page directory
+ * pointer tables are kept, since every thread of a process has its own
+ * PML4T pointing to them. The TLB is not invalidated, instead the changed
+ * range is added to a range to invalidate later with vm_flush_tlb().
+ *
+ * @param pml4t the address space containing the range
+ * @param addr the page-aligned virtual address of the range
+ * @param len the page-aligned length of the range
+ * @param flush the range of virtual memory to invalidate in the TLB
+ * @return zero on success
+ */
+
+int
+vm_unmap_range (uintptr_t *pml4t, void *addr, size_t len,
+		struct vm_flush *flush)
+{
+  uintptr_t ptr = (uintptr_t) addr;
+  uintptr_t end = ptr + len;
+  int user = PML4T_INDEX (ptr) < PAGE_STRUCT_ENTRIES / 2;
+  while (ptr < end)
+    {
+      uintptr_t next_pdt = ALIGN_DOWN (ptr, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+      uintptr_t *pdpe;
+      uintptr_t *pdt;
+      int cleared = 0;
+      if (vm_lookup_pdpe (pml4t, ptr, &pdpe))
+	return -1;
+      if (!pdpe)
+	{
+	  /* Nothing is mapped in the rest of this page directory table */
+	  ptr = next_pdt;
+	  continue;
+	}
+      if (next_pdt > end)
+	next_pdt = end;
+
+      pdt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (*pdpe, PAGE_SIZE));
+      while (ptr < next_pdt)
+	{
+	  uintptr_t next = vm_range_next (ptr, next_pdt);
+	  uintptr_t *pde = pdt + PDT_INDEX (ptr);
+	  int whole = next - ptr == LARGE_PAGE_SIZE;
+	  int drop = whole && user;
+	  uintptr_t *pt;
+	  if (!(*pde & PAGE_FLAG_PRESENT))
+	    {
+	      ptr = next;
+	      continue;
+	    }
+	  vm_flush_add (flush, ptr, next);
+	  if (*pde & PAGE_FLAG_SIZE)
+	    {
+	      if (whole)
+		{
+		  free_pages (ALIGN_DOWN (*pde, LARGE_PAGE_SIZE),
+			      LARGE_PAGE_ORDER);
+		  *pde = 0;
+		  cleared = 1;
+		  ptr = next;
+		  continue;
+		}
+	      if (vm_split_large_page (pml4t, (void *) ptr))
+		return -1;
+	    }
+	  else if (!drop && (*pde & PAGE_FLAG_COW)
+		   && vm_unshare_table (pde, 1))
+	    return -1;
+
+	  /* A page table that is dropped whole may still be shared with
+	     another address space, so its entries are left intact */
+	  pt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (*pde, PAGE_SIZE));
+	  for (; ptr < next; ptr += PAGE_SIZE)
+	    {
+	      uintptr_t *pte = pt + PT_INDEX (ptr);
+	      if (*pte & PAGE_FLAG_PRESENT)
+		{
+		  vm_mark_dirty (*pte);
+		  free_page (*pte);
+		  if (!drop)
+		    *pte = 0;
+		}
+	      else if (PAGE_IS_SWAP (*pte))
+		{
+		  swap_free (SWAP_SLOT (*pte));
+		  if (!drop)
+		    *pte = 0;
+		}
+	    }
+	  if (drop || (user && vm_table_empty (pt)))
+	    {
+	      free_page (*pde);
+	      *pde = 0;
+	      cleared = 1;
+	    }
+	}
+
+      if (user && cleared && vm_table_empty (pdt))
+	{
+	  free_page (*pdpe);
+	  *pdpe = 0;
+	}
+    }
+  return 0;
+}
+
+/*!
+ * Computes a page table entry with new access permissions. Write access is
+ * granted through copy-on-write if the page frame is shared with another
+ * address space, and pages that become read-only are no longer
+ * copy-on-write, so writing to them faults.
+ *
+ * @param entry the page table entry or large page directory entry
+ * @param flags the new permission flags
+ * @return the new entry
+ */
+
+static uintptr_t
+vm_protect_entry (uintptr_t entry, unsigned int flags)
+{
+  uintptr_t new = (entry & ~(PAGE_FLAG_RW | PAGE_FLAG_USER | PAGE_FLAG_COW))
+    | (flags & PAGE_FLAG_USER);
+  if (!(flags & PAGE_FLAG_RW))
+    return new;
+  if (!(entry & PAGE_FLAG_SHARED)
+      && (ALIGN_DOWN (entry, PAGE_SIZE) == zero_page
+	  || page_ref_count (entry) > 1))
+    return new | PAGE_FLAG_COW;
+  return new | PAGE_FLAG_RW;
+}
+
+/*!
+ * Changes the access permissions of the pages mapped in a range of virtual
+ * memory. Large pages that are only partially contained in the range are
+ * split first. The TLB is not invalidated, instead the changed range is
+ * added to a range to invalidate later with vm_flush_tlb().
+ *
+ * @param pml4t the address space containing the range
+ * @param addr the page-aligned virtual address of the range
+ * @param len the page-aligned length of the range
+ * @param flags the new permission flags, which may contain
+ * @ref PAGE_FLAG_RW and @ref PAGE_FLAG_USER
+ * @param flush the range of virtual memory to invalidate in the TLB
+ * @return zero on success
+ */
+
+int
+vm_protect_range (uintptr_t *pml4t, void *addr, size_t len,
+		  unsigned int flags, struct vm_flush *flush)
+{
+  uintptr_t ptr = (uintptr_t) addr;
+  uintptr_t end = ptr + len;
+  while (ptr < end)
+    {
+      uintptr_t next_pdt = ALIGN_DOWN (ptr, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+      uintptr_t *pdpe;
+      uintptr_t *pdt;
+      if (vm_lookup_pdpe (pml4t, ptr, &pdpe))
+	return -1;
+      if (!pdpe)
+	{
+	  ptr = next_pdt;
+	  continue;
+	}
+      if (next_pdt > end)
+	next_pdt = end;
+
+      pdt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (*pdpe, PAGE_SIZE));
+      while (ptr < next_pdt)
+	{
+	  uintptr_t next = vm_range_next (ptr, next_pdt);
+	  uintptr_t *pde = pdt + PDT_INDEX (ptr);
+	  uintptr_t *pt;
+	  if (!(*pde & PAGE_FLAG_PRESENT))
+	    {
+	      ptr = next;
+	      continue;
+	    }
+	  vm_flush_add (flush, ptr, next);
+	  if (*pde & PAGE_FLAG_SIZE)
+	    {
+	      if (next - ptr == LARGE_PAGE_SIZE)
+		{
+		  *pde = vm_protect_entry (*pde, flags);
+		  ptr = next;
+		  continue;
+		}
+	      if (vm_split_large_page (pml4t, (void *) ptr))
+		return -1;
+	    }
+	  else if ((*pde & PAGE_FLAG_COW) && vm_unshare_table (pde, 1))
+	    return -1;
+
+	  pt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (*pde, PAGE_SIZE));
+	  for (; ptr < next; ptr += PAGE_SIZE)
+	    {
+	      uintptr_t *pte = pt + PT_INDEX (ptr);
+	      if (*pte & PAGE_FLAG_PRESENT)
+		*pte = vm_protect_entry (*pte, flags);
+	      else if (PAGE_IS_SWAP (*pte))
+		*pte = SWAP_ENTRY (SWAP_SLOT (*pte), flags & PAGE_FLAG_RW);
+	    }
+	}
+    }
+  return 0;
+}
+
+/*!
+ * Allocates zero-filled page frames and maps them to a range of virtual
+ * memory. Any part of the range that covers an aligned 2 MiB area is mapped
+ * with large pages if enough contiguous physical memory is available.
+ *
+ * @param pml4t the address space to perform the mapping
+ * @param addr the page-aligned virtual address of the range
+ * @param len the page-aligned length of the range
+ * @param flags extra page flags
+ * @return zero on success
+ */
+
+int
+vm_alloc_range (uintptr_t *pml4t, void *addr, size_t len, unsigned int flags)
+{
+  uintptr_t ptr = (uintptr_t) addr;
+  uintptr_t end = ptr + len;
+  while (ptr < end)
+    {
+      uintptr_t next = vm_range_next (ptr, end);
+      uintptr_t *pt;
+      uintptr_t page;
+      if (next - ptr == LARGE_PAGE_SIZE)
+	{
+	  page = alloc_pages (LARGE_PAGE_ORDER);
+	  if (page)
+	    {
+	      memset ((void *) PHYS_REL (page), 0, LARGE_PAGE_SIZE);
+	      if (!vm_map_large_page (pml4t, page, (void *) ptr, flags))
+		{
+		  ptr = next;
+		  continue;
+		}
+	      free_pages (page, LARGE_PAGE_ORDER);
+	    }
+	}
+
+      pt = vm_alloc_pt (pml4t, ptr, flags);
+      if (UNLIKELY (!pt))
+	goto err0;
+      for (; ptr < next; ptr += PAGE_SIZE)
+	{
+	  page = alloc_zeroed_page ();
+	  if (UNLIKELY (!page))
+	    goto err0;
+	  pt[PT_INDEX (ptr)] = page | PAGE_FLAG_PRESENT | flags;
+	}
+    }
+  return 0;
+
+ err0:
+  vm_free_range (pml4t, addr, ptr - (uintptr_t) addr);
+  RETV_ERROR (ENOMEM, -1);
+}
+
+/*!
+ * Unmaps a range of virtual memory and drops a reference to every page
+ * frame mapped in it, then invalidates the range in the TLB.
+ *
+ * @param pml4t the address space containing the range
+ * @param addr the page-aligned virtual address of the range
+ * @param len the page-aligned length of the range
+ * @return zero on success
+ */
+
+int
+vm_free_range (uintptr_t *pml4t, void *addr, size_t len)
+{
+  struct vm_flush flush = {0, 0};
+  int ret = vm_unmap_range (pml4t, addr, len, &flush);
+  vm_flush_tlb (&flush);
+  return ret;
+}
+
+/*!
+ * Moves the dirty bits of the pages of shared file mappings in a range of
+ * virtual memory to their page frames, so the next write to each page
+ * marks it dirty again. Pages not in shared file mappings are ignored.
+ *
+ * @param pml4t the address space containing the range
+ * @param addr the page-aligned virtual address of the range
+ * @param len the page-aligned length of the range
  */
 
 void
-vm_next_page (void)
+vm_collect_dirty (uintptr_t *pml4t, void *addr, size_t len)
 {
-  for (; mmap.curr < mmap.count - 1; mmap.curr++)
+  uintptr_t ptr = (uintptr_t) addr;
+  uintptr_t end = ptr + len;
+  struct vm_flush flush = {0, 0};
+  while (ptr < end)
     {
-      if (next_phys_addr >= mmap.regions[mmap.curr].base +
-	  mmap.regions[mmap.curr].len
-	  && next_phys_addr < mmap.regions[mmap.curr + 1].base)
+      uintptr_t *pde = vm_lookup_pde (pml4t, ptr);
+      uintptr_t next = ALIGN_DOWN (ptr, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE;
+      if (next > end)
+	next = end;
+      if (pde && (*pde & PAGE_FLAG_PRESENT) && !(*pde & PAGE_FLAG_SIZE))
 	{
-	  next_phys_addr = mmap.regions[mmap.curr + 1].base;
-	  return;
+	  uintptr_t *pt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (*pde, PAGE_SIZE));
+	  for (; ptr < next; ptr += PAGE_SIZE)
+	    {
+	      uintptr_t *pte = pt + PT_INDEX (ptr);
+	      if ((*pte & (PAGE_FLAG_SHARED | PAGE_FLAG_DIRTY))
+		  != (PAGE_FLAG_SHARED | PAGE_FLAG_DIRTY))
+		continue;
+	      vm_mark_dirty (__atomic_fetch_and (pte, ~PAGE_FLAG_DIRTY,
+						 __ATOMIC_ACQ_REL));
+	      vm_flush_add (&flush, ptr, ptr + PAGE_SIZE);
+	    }
 	}
+      ptr = next;
+    }
+  vm_flush_tlb (&flush);
+}
+
+/*!
+ * Moves the mappings in a range of virtual memory to another address
+ * without copying the mapped data. Page table entries are moved with all
+ * of their flags, including entries of pages in swap space. Large pages
+ * are moved whole if both addresses are aligned to the large page size,
+ * otherwise they are split first. Copy-on-write paging structures covering
+ * the source range are unshared before their entries are cleared. The
+ * destination range must not contain any mappings. The source range is
+ * invalidated in the TLB once all mappings are moved.
+ *
+ * @param pml4t the address space containing the range
+ * @param dest the page-aligned virtual address to move the mappings to
+ * @param src the page-aligned virtual address of the range
+ * @param len the page-aligned length of the range
+ * @return zero on success
+ */
+
+int
+vm_move_range (uintptr_t *pml4t, void *dest, void *src, size_t len)
+{
+  struct vm_flush flush = {0, 0};
+  uintptr_t from = (uintptr_t) src;
+  uintptr_t to = (uintptr_t) dest;
+  uintptr_t end = from + len;
+  int ret = -1;
+  while (from < end)
+    {
+      uintptr_t next_pdt = ALIGN_DOWN (from, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+      uintptr_t *pdpe;
+      uintptr_t *pdt;
+      if (vm_lookup_pdpe (pml4t, from, &pdpe))
+	goto end;
+      if (next_pdt > end)
+	next_pdt = end;
+      if (!pdpe)
+	{
+	  /* Nothing is mapped in the rest of this page directory table */
+	  to += next_pdt - from;
+	  from = next_pdt;
+	  continue;
+	}
+
+      pdt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (*pdpe, PAGE_SIZE));
+      while (from < next_pdt)
+	{
+	  uintptr_t next = vm_range_next (from, next_pdt);
+	  uintptr_t *pde = pdt + PDT_INDEX (from);
+	  uintptr_t *dest_pt = NULL;
+	  uintptr_t *pt;
+	  if (!(*pde & PAGE_FLAG_PRESENT))
+	    {
+	      to += next - from;
+	      from = next;
+	      continue;
+	    }
+	  vm_flush_add (&flush, from, next);
+	  if (*pde & PAGE_FLAG_SIZE)
+	    {
+	      /* If the destination already has a page table in use, the
+		 large page is split and moved in 4 KiB pages instead */
+	      if (next - from == LARGE_PAGE_SIZE
+		  && !(to & (LARGE_PAGE_SIZE - 1))
+		  && !vm_map_large_page (pml4t, *pde, (void *) to,
+					 *pde & (PAGE_SIZE - 1)
+					 & ~(PAGE_FLAG_PRESENT
+					     | PAGE_FLAG_SIZE)))
+		{
+		  *pde = 0;
+		  to += LARGE_PAGE_SIZE;
+		  from = next;
+		  continue;
+		}
+	      if (vm_split_large_page (pml4t, (void *) from))
+		goto end;
+	    }
+	  else if ((*pde & PAGE_FLAG_COW) && vm_unshare_table (pde, 1))
+	    goto end;
+
+	  pt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (*pde, PAGE_SIZE));
+	  for (; from < next; from += PAGE_SIZE, to += PAGE_SIZE)
+	    {
+	      uintptr_t *pte = pt + PT_INDEX (from);
+	      if (!(*pte & PAGE_FLAG_PRESENT) && !PAGE_IS_SWAP (*pte))
+		continue;
+
+	      /* The destination may cross into another page table */
+	      if (!dest_pt || !(to & (LARGE_PAGE_SIZE - 1)))
+		{
+		  dest_pt = vm_alloc_pt (pml4t, to, PAGE_FLAG_USER);
+		  if (UNLIKELY (!dest_pt))
+		    goto end;
+		}
+	      dest_pt[PT_INDEX (to)] = *pte;
+	      *pte = 0;
+	    }
+	}
+    }
+  ret = 0;
+
+ end:
+  vm_flush_tlb (&flush);
+  return ret;
+}
+
+/*!
+ * Shares the pages mapped in a range of virtual memory with another address
+ * space. Writable pages are made copy-on-write in both address spaces, so
+ * neither address space sees writes made by the other. Large pages are
+ * split first. The source address space must be the current one.
+ *
+ * @param dest the address space to map the pages into
+ * @param src the address space containing the range
+ * @param addr the page-aligned virtual address of the range
+ * @param len the page-aligned length of the range
+ * @return zero on success
+ */
+
+int
+vm_share_range (uintptr_t *dest, uintptr_t *src, void *addr, size_t len)
+{
+  uintptr_t ptr = (uintptr_t) addr;
+  uintptr_t end = ptr + len;
+  while (ptr < end)
+    {
+      uintptr_t *pde = vm_lookup_pde (src, ptr);
+      uintptr_t next = ALIGN_DOWN (ptr, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE;
+      uintptr_t *pt;
+      if (next > end)
+	next = end;
+      if (!pde || !(*pde & PAGE_FLAG_PRESENT))
+	{
+	  ptr = next;
+	  continue;
+	}
+      if ((*pde & PAGE_FLAG_SIZE) && vm_split_large_page (src, (void *) ptr))
+	return -1;
+
+      pt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (*pde, PAGE_SIZE));
+      for (; ptr < next; ptr += PAGE_SIZE)
+	{
+	  uintptr_t *pte = pt + PT_INDEX (ptr);
+	  if (!(*pte & PAGE_FLAG_PRESENT))
+	    continue;
+	  if (*pte & PAGE_FLAG_RW)
+	    {
+	      *pte = (*pte & ~PAGE_FLAG_RW) | PAGE_FLAG_COW;
+	      vm_clear_page ((void *) ptr);
+	    }
+	  ref_page (*pte);
+	  if (vm_map_page (dest, *pte, (void *) ptr,
+			   *pte & (PAGE_SIZE - 1) & ~PAGE_FLAG_PRESENT))
+	    {
+	      free_page (*pte);
+	      return -1;
+	    }
+	}
+    }
+  return 0;
+}
+
+/*!
+ * Copies the pages mapped in a range of virtual memory into newly allocated
+ * page frames mapped at the same addresses in another address space.
+ *
+ * @param dest the address space to map the copies into
+ * @param src the address space containing the range
+ * @param addr the page-aligned virtual address of the range
+ * @param len the page-aligned length of the range
+ * @param flags page flags of the copies
+ * @return zero on success
+ */
+
+int
+vm_copy_range (uintptr_t *dest, uintptr_t *src, void *addr, size_t len,
+	       unsigned int flags)
+{
+  uintptr_t ptr;
+  for (ptr = (uintptr_t) addr; ptr < (uintptr_t) addr + len; ptr += PAGE_SIZE)
+    {
+      uintptr_t phys = vm_phys_addr (src, (void *) ptr);
+      uintptr_t page;
+      if (!phys)
+	continue;
+      page = alloc_page ();
+      if (UNLIKELY (!page))
+	RETV_ERROR (ENOMEM, -1);
+      memcpy ((void *) PHYS_REL (page), (void *) PHYS_REL (phys), PAGE_SIZE);
+      if (vm_map_page (dest, page, (void *) ptr, flags))
+	{
+	  free_page (page);
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+/*!
+ * Inserts a free block at the head of the free list of its order.
+ *
+ * @param pfn the page frame number of the first page in the block
+ * @param order the order of the block
+ */
+
+static void
+buddy_list_add (uintptr_t pfn, unsigned int order)
+{
+  struct page_meta *page = phys_alloc_table + pfn;
+  page->order = order;
+  page->flags |= PAGE_META_FREE;
+  page->prev = 0;
+  page->next = page_free_lists[order];
+  if (page->next)
+    phys_alloc_table[page->next].prev = pfn;
+  page_free_lists[order] = pfn;
+}
+
+/*!
+ * Removes a free block from the free list of its order.
+ *
+ * @param pfn the page frame number of the first page in the block
+ * @param order the order of the block
+ */
+
+static void
+buddy_list_remove (uintptr_t pfn, unsigned int order)
+{
+  struct page_meta *page = phys_alloc_table + pfn;
+  if (page->prev)
+    phys_alloc_table[page->prev].next = page->next;
+  else
+    page_free_lists[order] = page->next;
+  if (page->next)
+    phys_alloc_table[page->next].prev = page->prev;
+  page->flags &= ~PAGE_META_FREE;
+  page->next = 0;
+  page->prev = 0;
+}
+
+/*!
+ * Returns a block of pages to the free lists, merging it with its buddy
+ * as long as the buddy is also free and of the same order. The caller must
+ * hold @ref page_alloc_lock.
+ *
+ * @param pfn the page frame number of the first page in the block
+ * @param order the order of the block
+ */
+
+static void
+buddy_free_block (uintptr_t pfn, unsigned int order)
+{
+  phys_free_pages += 1UL << order;
+  while (order < PAGE_MAX_ORDER)
+    {
+      uintptr_t buddy = pfn ^ (1UL << order);
+      struct page_meta *page;
+      if (buddy >= phys_page_count)
+	break;
+      page = phys_alloc_table + buddy;
+      if (!(page->flags & PAGE_META_FREE) || page->order != order)
+	break;
+      buddy_list_remove (buddy, order);
+      pfn &= ~(1UL << order);
+      order++;
+    }
+  buddy_list_add (pfn, order);
+}
+
+/*!
+ * Removes a block of the given order from the free lists, splitting a larger
+ * block if necessary. The caller must hold @ref page_alloc_lock.
+ *
+ * @param order the order of the block
+ * @return the page frame number of the first page in the block, or zero if
+ * no block is available
+ */
+
+static uintptr_t
+buddy_alloc_block (unsigned int order)
+{
+  unsigned int i;
+  uintptr_t pfn;
+  for (i = order; i <= PAGE_MAX_ORDER && !page_free_lists[i]; i++)
+    ;
+  if (UNLIKELY (i > PAGE_MAX_ORDER))
+    return 0;
+  pfn = page_free_lists[i];
+  buddy_list_remove (pfn, i);
+
+  /* Split the block, returning the upper halves to the free lists */
+  while (i > order)
+    {
+      i--;
+      buddy_list_add (pfn + (1UL << i), i);
+    }
+  phys_alloc_table[pfn].order = order;
+  phys_free_pages -= 1UL << order;
+  return pfn;
+}
+
+/*!
+ * Atomically decrements the reference count of a page frame if it is
+ * nonzero.
+ *
+ * @param page the page frame metadata
+ * @return nonzero if the last reference was dropped
+ */
+
+static int
+page_unref (struct page_meta *page)
+{
+  unsigned int count = __atomic_load_n (&page->count, __ATOMIC_RELAXED);
+  do
+    {
+      if (!count)
+	return 0;
+    }
+  while (!__atomic_compare_exchange_n (&page->count, &count, count - 1, 0,
+				       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  return count == 1;
+}
+
+/*!
+ * Takes a batch of page frames from the free lists and adds them to the
+ * cold end of a page cache. Interrupts must be disabled.
+ *
+ * @param cache the page cache of the current CPU
+ */
+
+static void
+page_cache_refill (struct page_cache *cache)
+{
+  size_t i;
+  spinlock_acquire (&page_alloc_lock);
+  for (i = 0; i < PAGE_CACHE_BATCH && cache->count < PAGE_CACHE_SIZE; i++)
+    {
+      uintptr_t pfn = buddy_alloc_block (0);
+      if (UNLIKELY (!pfn))
+	break;
+      cache->start = (cache->start + PAGE_CACHE_SIZE - 1) % PAGE_CACHE_SIZE;
+      cache->pages[cache->start] = pfn * PAGE_SIZE;
+      cache->count++;
+    }
+  spinlock_release (&page_alloc_lock);
+  if (i)
+    cache->refills++;
+}
+
+/*!
+ * Returns up to a given number of the coldest page frames in a page cache
+ * to the free lists. Interrupts must be disabled.
+ *
+ * @param cache the page cache of the current CPU
+ * @param count the maximum number of page frames to return
+ */
+
+static void
+page_cache_drain_batch (struct page_cache *cache, size_t count)
+{
+  size_t i;
+  spinlock_acquire (&page_alloc_lock);
+  for (i = 0; i < count && cache->count; i++)
+    {
+      buddy_free_block (cache->pages[cache->start] / PAGE_SIZE, 0);
+      cache->start = (cache->start + 1) % PAGE_CACHE_SIZE;
+      cache->count--;
     }
-  if (LIKELY (next_phys_addr < mmap.regions[mmap.count - 1].base +
-	      mmap.regions[mmap.count - 1].len))
+  spinlock_release (&page_alloc_lock);
+  if (i)
+    cache->drains++;
+}
+
+/*!
+ * Places an unreferenced page frame into the page cache of the current CPU,
+ * returning a batch of page frames to the free lists if the cache is full.
+ *
+ * @param addr the physical address of the page frame
+ * @param cold whether the page frame should be reused after all other
+ * cached page frames
+ */
+
+static void
+page_cache_free (uintptr_t addr, int cold)
+{
+  struct page_cache *cache;
+  unsigned long flags = int_save_disable ();
+  cache = page_caches + smp_cpu_index ();
+  if (cache->count == PAGE_CACHE_SIZE)
+    page_cache_drain_batch (cache, PAGE_CACHE_BATCH);
+  if (cold)
     {
-      mmap.curr = mmap.count - 1;
-      next_phys_addr += PAGE_SIZE;
+      cache->start = (cache->start + PAGE_CACHE_SIZE - 1) % PAGE_CACHE_SIZE;
+      cache->pages[cache->start] = addr;
     }
   else
-    mem_avail = 0;
+    cache->pages[(cache->start + cache->count) % PAGE_CACHE_SIZE] = addr;
+  cache->count++;
+  int_restore (flags);
+}
+
+/*!
+ * Returns all page frames in the page cache of the current CPU to the
+ * free lists. This allows cached page frames to be merged into larger
+ * blocks.
+ */
+
+void
+page_cache_drain (void)
+{
+  unsigned long flags = int_save_disable ();
+  struct page_cache *cache = page_caches + smp_cpu_index ();
+  page_cache_drain_batch (cache, cache->count);
+  int_restore (flags);
 }
 
 /*!
- * Allocates a page frame and returns its physical address.
+ * Allocates a physically contiguous block of 2<sup>order</sup> page frames.
+ * The block is aligned to its size. Only the first page frame of the block
+ * is reference counted.
+ *
+ * @param order the order of the block to allocate
+ * @return the physical address of the first page frame of the block, or 0
+ * if the allocation failed
+ */
+
+uintptr_t
+alloc_pages (unsigned int order)
+{
+  unsigned long flags;
+  uintptr_t pfn;
+  if (!order)
+    return alloc_page ();
+  if (UNLIKELY (order > PAGE_MAX_ORDER))
+    return 0;
+
+  /* Interrupts are disabled while the free lists are locked, as in the
+     page cache functions, so an interrupt handler allocating memory cannot
+     spin on the lock held by the code it interrupted */
+  flags = int_save_disable ();
+  spinlock_acquire (&page_alloc_lock);
+  pfn = buddy_alloc_block (order);
+  spinlock_release (&page_alloc_lock);
+  int_restore (flags);
+  if (UNLIKELY (!pfn))
+    {
+      /* Page frames held in the page cache might complete a block */
+      page_cache_drain ();
+      flags = int_save_disable ();
+      spinlock_acquire (&page_alloc_lock);
+      pfn = buddy_alloc_block (order);
+      spinlock_release (&page_alloc_lock);
+      int_restore (flags);
+      if (UNLIKELY (!pfn))
+	return 0;
+    }
+  phys_alloc_table[pfn].count = 1;
+  phys_alloc_table[pfn].flags &= ~(PAGE_META_DIRTY | PAGE_META_REFERENCED);
+  return pfn * PAGE_SIZE;
+}
+
+/*!
+ * Decrements the reference count of a block allocated with alloc_pages(),
+ * and returns the block to the allocator if no references remain. The
+ * address does not need to be page-aligned.
+ *
+ * @param addr the physical address of the first page frame of the block
+ * @param order the order of the block
+ */
+
+void
+free_pages (uintptr_t addr, unsigned int order)
+{
+  unsigned long flags;
+  uintptr_t pfn;
+  size_t i;
+  if (!addr)
+    return;
+  pfn = addr / PAGE_SIZE;
+  if (order && phys_alloc_table[pfn].order != order)
+    {
+      /* The block was split by split_page(), free each page frame */
+      for (i = 0; i < 1UL << order; i++)
+	free_pages ((pfn + i) * PAGE_SIZE, 0);
+      return;
+    }
+  if (!page_unref (phys_alloc_table + pfn))
+    return;
+  if (!order)
+    page_cache_free (pfn * PAGE_SIZE, 0);
+  else
+    {
+      flags = int_save_disable ();
+      spinlock_acquire (&page_alloc_lock);
+      buddy_free_block (pfn, order);
+      spinlock_release (&page_alloc_lock);
+      int_restore (flags);
+    }
+}
+
+/*!
+ * Increments the reference count of a block allocated with alloc_pages().
+ * If the block was split, every page frame in it is referenced.
+ *
+ * @param addr the physical address of the first page frame of the block
+ * @param order the order of the block
+ */
+
+void
+ref_pages (uintptr_t addr, unsigned int order)
+{
+  size_t i;
+  addr = ALIGN_DOWN (addr, PAGE_SIZE);
+  if (phys_alloc_table[addr / PAGE_SIZE].order == order)
+    ref_page (addr);
+  else
+    {
+      for (i = 0; i < 1UL << order; i++)
+	ref_page (addr + i * PAGE_SIZE);
+    }
+}
+
+/*!
+ * Splits an allocated block into individual page frames, each inheriting
+ * the reference count of the block. After this call each page frame must be
+ * freed separately. References held on the whole block with ref_pages()
+ * remain valid and are released from each page frame by free_pages().
+ * Nothing is done if the block was already split.
+ *
+ * @param addr the physical address of the first page frame of the block
+ * @param order the order of the block
+ */
+
+void
+split_page (uintptr_t addr, unsigned int order)
+{
+  struct page_meta *page;
+  unsigned long flags;
+  size_t i;
+  page = phys_alloc_table + addr / PAGE_SIZE;
+  flags = int_save_disable ();
+  spinlock_acquire (&page_alloc_lock);
+  if (page->order != order)
+    {
+      spinlock_release (&page_alloc_lock);
+      int_restore (flags);
+      return;
+    }
+  for (i = 1; i < 1UL << order; i++)
+    {
+      page[i].count = page->count;
+      page[i].order = 0;
+    }
+  page->order = 0;
+  spinlock_release (&page_alloc_lock);
+  int_restore (flags);
+}
+
+/*!
+ * Allocates a page frame and returns its physical address. The most
+ * recently freed page frame in the page cache of the current CPU is
+ * returned if one is available.
  *
  * @return the physical address of the new page frame, or 0 if the allocation
  * failed
@@ -261,19 +1453,24 @@ vm_next_page (void)
 uintptr_t
 alloc_page (void)
 {
-  while (mem_avail)
+  struct page_cache *cache;
+  uintptr_t addr = 0;
+  unsigned long flags = int_save_disable ();
+  cache = page_caches + smp_cpu_index ();
+  if (cache->count)
+    cache->hits++;
+  else
+    page_cache_refill (cache);
+  if (LIKELY (cache->count))
     {
-      struct page_meta *page = phys_alloc_table + next_phys_addr / PAGE_SIZE;
-      if (!page->count)
-	{
-	  uintptr_t addr = next_phys_addr;
-	  page->count++;
-	  vm_next_page ();
-	  return addr;
-	}
-      vm_next_page ();
+      cache->count--;
+      addr = cache->pages[(cache->start + cache->count) % PAGE_CACHE_SIZE];
+      phys_alloc_table[addr / PAGE_SIZE].count = 1;
+      phys_alloc_table[addr / PAGE_SIZE].flags &=
+	~(PAGE_META_DIRTY | PAGE_META_REFERENCED);
     }
-  return 0;
+  int_restore (flags);
+  return addr;
 }
 
 /*!
@@ -287,11 +1484,33 @@ void
 ref_page (uintptr_t addr)
 {
   struct page_meta *page;
+  unsigned int count;
   if (!addr)
     return;
   page = phys_alloc_table + addr / PAGE_SIZE;
-  if (page->count)
-    page->count++;
+  count = __atomic_load_n (&page->count, __ATOMIC_RELAXED);
+  do
+    {
+      if (!count)
+	return;
+    }
+  while (!__atomic_compare_exchange_n (&page->count, &count, count + 1, 0,
+				       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+}
+
+/*!
+ * Returns the number of references to the page frame containing a
+ * physical address. The address does not need to be page-aligned.
+ *
+ * @param addr the physical address
+ * @return the reference count, or zero if the page frame is not allocated
+ */
+
+unsigned int
+page_ref_count (uintptr_t addr)
+{
+  return __atomic_load_n (&phys_alloc_table[addr / PAGE_SIZE].count,
+			  __ATOMIC_ACQUIRE);
 }
 
 /*!
@@ -304,19 +1523,22 @@ ref_page (uintptr_t addr)
 void
 free_page (uintptr_t addr)
 {
-  struct page_meta *page;
-  if (!addr)
-    return;
-  addr = ALIGN_DOWN (addr, PAGE_SIZE);
-  page = phys_alloc_table + addr / PAGE_SIZE;
-  if (page->count)
-    page->count--;
-  if (!page->count && addr < next_phys_addr)
-    {
-      next_phys_addr = addr;
-      while (mmap.curr && mmap.regions[mmap.curr].base > next_phys_addr)
-	mmap.curr--;
-    }
+  free_pages (addr, 0);
+}
+
+/*!
+ * Frees a page frame whose contents are unlikely to be in the CPU cache.
+ * The page frame will be reused after all other page frames in the page
+ * cache of the current CPU.
+ *
+ * @param addr the physical address to free
+ */
+
+void
+free_page_cold (uintptr_t addr)
+{
+  if (addr && page_unref (phys_alloc_table + addr / PAGE_SIZE))
+    page_cache_free (ALIGN_DOWN (addr, PAGE_SIZE), 1);
 }
 
 /*!
@@ -350,7 +1572,8 @@ free_virtual_page (void *ptr)
 }
 
 /*!
- * Increments the reference count of all present pages in a page table.
+ * Increments the reference count of all present pages and swap slots in a
+ * page table.
  *
  * @param pt the page table
  */
@@ -363,12 +1586,14 @@ ref_pt (uintptr_t *pt)
     {
       if (pt[i] & PAGE_FLAG_PRESENT)
 	ref_page (pt[i]);
+      else if (PAGE_IS_SWAP (pt[i]))
+	swap_ref (SWAP_SLOT (pt[i]));
     }
 }
 
 /*!
- * Increments the reference count of all present page tables in a page
- * directory table.
+ * Increments the reference count of all present page tables and large
+ * pages in a page directory table.
  *
  * @param pdt the page directory table
  */
@@ -379,7 +1604,11 @@ ref_pdt (uintptr_t *pdt)
   size_t i;
   for (i = 0; i < PAGE_STRUCT_ENTRIES; i++)
     {
-      if ((pdt[i] & PAGE_FLAG_PRESENT) && !(pdt[i] & PAGE_FLAG_SIZE))
+      if (!(pdt[i] & PAGE_FLAG_PRESENT))
+	continue;
+      if (pdt[i] & PAGE_FLAG_SIZE)
+	ref_pages (ALIGN_DOWN (pdt[i], LARGE_PAGE_SIZE), LARGE_PAGE_ORDER);
+      else
 	{
 	  ref_page (pdt[i]);
 	  ref_pt ((uintptr_t *) PHYS_REL (ALIGN_DOWN (pdt[i], PAGE_SIZE)));
@@ -409,8 +1638,9 @@ ref_pdpt (uintptr_t *pdpt)
 }
 
 /*!
- * Frees all physical memory contained in a page table. The page table
- * itself is not freed.
+ * Frees all physical memory and swap slots contained in a page table. The
+ * page table itself is not freed. Since this is used to tear down address
+ * spaces, the page frames are freed as cold pages.
  *
  * @param pt the page table to free
  */
@@ -422,14 +1652,19 @@ free_pt (uintptr_t *pt)
   for (i = 0; i < PAGE_STRUCT_ENTRIES; i++)
     {
       if (pt[i] & PAGE_FLAG_PRESENT)
-	free_page (pt[i]);
+	{
+	  vm_mark_dirty (pt[i]);
+	  free_page_cold (pt[i]);
+	}
+      else if (PAGE_IS_SWAP (pt[i]))
+	swap_free (SWAP_SLOT (pt[i]));
     }
 }
 
 /*!
  * Frees all physical memory contained in a page directory table. The
- * page directory table itself is not freed, but any page tables it contains
- * are freed.
+ * page directory table itself is not freed, but any page tables and large
+ * pages it contains are freed.
  *
  * @param pdt the page directory table to free
  */
@@ -440,7 +1675,11 @@ free_pdt (uintptr_t *pdt)
   size_t i;
   for (i = 0; i < PAGE_STRUCT_ENTRIES; i++)
     {
-      if ((pdt[i] & PAGE_FLAG_PRESENT) && !(pdt[i] & PAGE_FLAG_SIZE))
+      if (!(pdt[i] & PAGE_FLAG_PRESENT))
+	continue;
+      if (pdt[i] & PAGE_FLAG_SIZE)
+	free_pages (ALIGN_DOWN (pdt[i], LARGE_PAGE_SIZE), LARGE_PAGE_ORDER);
+      else
 	{
 	  uintptr_t pt_phys = ALIGN_DOWN (pdt[i], PAGE_SIZE);
 	  uintptr_t *pt = (uintptr_t *) PHYS_REL (pt_phys);
@@ -534,58 +1773,77 @@ vm_init (void)
   /* Apply the new page structures */
   vm_set_cr3 ((uintptr_t) kernel_pml4t - KERNEL_VMA);
 
+  /* Size the page frame table to cover the highest usable address */
+  for (i = 0; i < mmap.count; i++)
+    {
+      uintptr_t end = mmap.regions[i].base + mmap.regions[i].len;
+      if (end > PHYS_ADDR_LIMIT)
+	end = PHYS_ADDR_LIMIT;
+      if (end / PAGE_SIZE > phys_page_count)
+	phys_page_count = end / PAGE_SIZE;
+    }
   next_phys_addr = ALIGN_UP (KERNEL_END, PAGE_SIZE);
-  mem_avail = 1;
   phys_alloc_table = (struct page_meta *) next_phys_addr;
   next_phys_addr -= KERNEL_VMA;
-  next_phys_addr += total_phys_mem / PAGE_SIZE * sizeof (struct page_meta);
+  next_phys_addr += phys_page_count * sizeof (struct page_meta);
   next_phys_addr = ALIGN_UP (next_phys_addr, PAGE_SIZE);
 }
 
+/*!
+ * Initializes the physical page frame allocator. All page frames below
+ * @ref next_phys_addr and all page frames outside of the system memory map
+ * are marked as reserved, and the remaining memory is added to the free lists
+ * in the largest aligned blocks possible.
+ */
+
 void
 mark_resv_mem_alloc (void)
 {
   size_t i;
-  for (i = 0; i < next_phys_addr / PAGE_SIZE; i++)
+  memset (phys_alloc_table, 0, phys_page_count * sizeof (struct page_meta));
+  for (i = 0; i < phys_page_count; i++)
     phys_alloc_table[i].count = 1;
-  memset (phys_alloc_table + i, 0,
-	  (total_phys_mem - next_phys_addr) / PAGE_SIZE);
+
+  for (i = 0; i < mmap.count; i++)
+    {
+      uintptr_t start = ALIGN_UP (mmap.regions[i].base, PAGE_SIZE) / PAGE_SIZE;
+      uintptr_t end = ALIGN_DOWN (mmap.regions[i].base + mmap.regions[i].len,
+				  PAGE_SIZE) / PAGE_SIZE;
+      if (start < next_phys_addr / PAGE_SIZE)
+	start = next_phys_addr / PAGE_SIZE;
+      if (end > phys_page_count)
+	end = phys_page_count;
+      while (start < end)
+	{
+	  unsigned int order = 0;
+	  size_t j;
+	  while (order < PAGE_MAX_ORDER && !(start & ((2UL << order) - 1))
+		 && start + (2UL << order) <= end)
+	    order++;
+	  for (j = 0; j < 1UL << order; j++)
+	    phys_alloc_table[start + j].count = 0;
+	  buddy_free_block (start, order);
+	  start += 1UL << order;
+	}
+    }
 }
 
 int
 sys_brk (void *addr)
 {
-  void *i;
+  void *end = ALIGN_UP (addr, PAGE_SIZE);
   if (addr < THIS_PROCESS->brk.base)
     RETV_ERROR (ENOMEM, -1);
   else if (addr > THIS_PROCESS->brk.base + THIS_PROCESS->brk.max)
     RETV_ERROR (ENOMEM, -1);
-  else if (addr < THIS_PROCESS->brk.curr)
+  else if (end < THIS_PROCESS->brk.curr)
     {
-      for (i = ALIGN_UP (addr, PAGE_SIZE); i < THIS_PROCESS->brk.curr;
-	   i += PAGE_SIZE)
-	{
-	  uintptr_t phys_addr = physical_addr (addr);
-	  if (phys_addr)
-	    free_page (phys_addr);
-	  vm_unmap_page (THIS_THREAD->args.pml4t, addr);
-	}
-      THIS_PROCESS->brk.curr = ALIGN_UP (addr, PAGE_SIZE);
-    }
-  else
-    {
-      for (i = THIS_PROCESS->brk.curr; i < ALIGN_UP (addr, PAGE_SIZE);
-	   i += PAGE_SIZE)
-	{
-	  uintptr_t phys_addr = alloc_page ();
-	  if (!phys_addr)
-	    RETV_ERROR (ENOMEM, -1);
-	  if (vm_map_page (THIS_THREAD->args.pml4t, phys_addr, i,
-			   PAGE_FLAG_RW | PAGE_FLAG_USER))
-	    RETV_ERROR (ENOMEM, -1);
-	}
-      THIS_PROCESS->brk.curr = ALIGN_UP (addr, PAGE_SIZE);
+      if (vm_free_range (THIS_THREAD->args.pml4t, end,
+			 THIS_PROCESS->brk.curr - end))
+	return -1;
     }
+  /* Pages above the old break are mapped on first access */
+  THIS_PROCESS->brk.curr = end;
   return 0;
 }
 
@@ -21,6 +21,8 @@
 #include <pml/memory.h>
 #include <pml/panic.h>
 #include <pml/process.h>
+#include <pml/swap.h>
+#include <errno.h>
 #include <string.h>
 
 static char *present_msg[] = {"non-present page", "protection violation"};
@@ -30,8 +32,70 @@ static char *reserved_msg[] = {"", ", reserved write"};
 static char *inst_msg[] = {"", ", instruction fetch"};
 
 /*!
- * Handles a page fault. This function will perform necessary copying-on-writes
- * and deliver a fatal kernel panic if the exception cannot be handled.
+ * Restores write access to the copy-on-write pages around a resolved
+ * copy-on-write fault that no other address space maps anymore. Pages
+ * that are still shared are left to be copied when they are written to.
+ *
+ * @param pt the page table containing the faulting page
+ * @param addr the faulting virtual address
+ */
+
+static void
+cow_fault_around (uintptr_t *pt, uintptr_t addr)
+{
+  unsigned int start = ALIGN_DOWN (PT_INDEX (addr), MMAP_FAULT_AROUND_PAGES);
+  unsigned int i;
+  for (i = start; i < start + MMAP_FAULT_AROUND_PAGES; i++)
+    {
+      if ((pt[i] & (PAGE_FLAG_PRESENT | PAGE_FLAG_COW))
+	  != (PAGE_FLAG_PRESENT | PAGE_FLAG_COW)
+	  || ALIGN_DOWN (pt[i], PAGE_SIZE) == zero_page
+	  || page_ref_count (pt[i]) != 1)
+	continue;
+      pt[i] = (pt[i] | PAGE_FLAG_RW) & ~PAGE_FLAG_COW;
+      vm_clear_page ((void *) (ALIGN_DOWN (addr, LARGE_PAGE_SIZE)
+			       + i * PAGE_SIZE));
+    }
+}
+
+/*!
+ * Reads a page that was moved to swap space back into memory and maps it
+ * in place of its swap entry. The swap slot is freed once no other address
+ * space refers to it.
+ *
+ * @param pte the page table entry referring to the swap slot
+ * @param addr the faulting virtual address
+ * @return zero on success
+ */
+
+static int
+swap_fault (uintptr_t *pte, uintptr_t addr)
+{
+  size_t slot = SWAP_SLOT (*pte);
+  uintptr_t page = alloc_page ();
+  if (UNLIKELY (!page))
+    RETV_ERROR (ENOMEM, -1);
+  if (swap_read (slot, (void *) PHYS_REL (page)))
+    {
+      free_page (page);
+      return -1;
+    }
+  *pte = page | PAGE_FLAG_PRESENT | PAGE_FLAG_USER
+    | (*pte & PAGE_FLAG_SWAP_RW ? PAGE_FLAG_RW : 0);
+  swap_free (slot);
+  vm_clear_page ((void *) ALIGN_DOWN (addr, PAGE_SIZE));
+  reclaim_stats.swapped_in++;
+  return 0;
+}
+
+/*!
+ * Handles a page fault. This function will perform necessary copying-on-writes,
+ * including splitting pages merged by the page merging scanner, map pages of
+ * anonymous memory on first access, read pages back from swap space, and
+ * deliver a fatal kernel panic if the exception cannot be handled. If memory
+ * runs out, pages are reclaimed and the access is retried. Page faults in
+ * supervisor mode on user-space addresses are handled the same way as user
+ * mode page faults.
  *
  * @todo implement signal throwing
  * @param err the error code pushed by the page fault exception
@@ -52,16 +116,29 @@ int_page_fault (unsigned long err, uintptr_t inst_addr)
   uintptr_t *pdt;
   uintptr_t *pt;
   siginfo_t info;
-  size_t i;
+  int lock;
   __asm__ volatile ("mov %%cr2, %0" : "=r" (addr));
   __asm__ volatile ("mov %%cr3, %0" : "=r" (cr3));
 
+  lock = thread_switch_lock;
+
+  /* Map pages of thread stacks on first access. The address space is taken
+     from CR3 since a thread being cloned may fault on its own stack. */
+  if (!(err & PAGE_ERR_PRESENT)
+      && !thread_stack_fault ((uintptr_t *) PHYS_REL (ALIGN_DOWN (cr3,
+								   PAGE_SIZE)),
+			      addr))
+    return;
+
   /* Assume page faults on the kernel thread are fatal */
   if (!THIS_PROCESS->pid)
     goto fatal;
 
-  /* Check for copy-on-write */
-  if (err & PAGE_ERR_USER)
+  /* Check for copy-on-write or demand paging */
+  if ((err & PAGE_ERR_USER) || addr < USER_MEM_TOP_VMA
+      || (addr >= (uintptr_t) THIS_THREAD->args.stack_base
+	  && addr < (uintptr_t) THIS_THREAD->args.stack_base
+	  + THIS_THREAD->args.stack_size))
     {
       thread_switch_lock = 1;
       pml4t = THIS_THREAD->args.pml4t;
@@ -69,103 +146,140 @@ int_page_fault (unsigned long err, uintptr_t inst_addr)
       if (addr >> 48 != !!(pml4e & 0x100) * 0xffff) /* Check sign extension */
 	goto signal;
       if (!(pml4t[pml4e] & PAGE_FLAG_PRESENT))
+	goto demand;
+      if ((pml4t[pml4e] & PAGE_FLAG_COW)
+	  && vm_unshare_table (pml4t + pml4e, 0))
 	goto signal;
-      if (pml4t[pml4e] & PAGE_FLAG_COW)
-	{
-	  uintptr_t page = alloc_page ();
-	  uintptr_t *np = (uintptr_t *) PHYS_REL (page);
-	  uintptr_t *cp =
-	    (uintptr_t *) PHYS_REL (ALIGN_DOWN (pml4t[pml4e], PAGE_SIZE));
-	  if (UNLIKELY (!page))
-	    goto signal;
-	  memset (np, 0, PAGE_SIZE);
-	  for (i = 0; i < PAGE_STRUCT_ENTRIES; i++)
-	    {
-	      if (cp[i] & PAGE_FLAG_PRESENT)
-		{
-		  np[i] = cp[i] | PAGE_FLAG_COW;
-		  np[i] &= ~PAGE_FLAG_RW;
-		}
-	    }
-	  free_page (pml4t[pml4e]);
-	  pml4t[pml4e] = page | PAGE_FLAG_RW | (pml4t[pml4e] & (PAGE_SIZE - 1));
-	  pml4t[pml4e] &= ~PAGE_FLAG_COW;
-	}
 
       pdpt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (pml4t[pml4e], PAGE_SIZE));
       pdpe = PDPT_INDEX (addr);
-      if ((pdpt[pdpe] & PAGE_FLAG_SIZE) || !(pdpt[pdpe] & PAGE_FLAG_PRESENT))
+      if (!(pdpt[pdpe] & PAGE_FLAG_PRESENT))
+	goto demand;
+      if (pdpt[pdpe] & PAGE_FLAG_SIZE)
+	goto signal;
+      if ((pdpt[pdpe] & PAGE_FLAG_COW) && vm_unshare_table (pdpt + pdpe, 0))
 	goto signal;
-      if (pdpt[pdpe] & PAGE_FLAG_COW)
-	{
-	  uintptr_t page = alloc_page ();
-	  uintptr_t *np = (uintptr_t *) PHYS_REL (page);
-	  uintptr_t *cp =
-	    (uintptr_t *) PHYS_REL (ALIGN_DOWN (pdpt[pdpe], PAGE_SIZE));
-	  if (UNLIKELY (!page))
-	    goto signal;
-	  memset (np, 0, PAGE_SIZE);
-	  for (i = 0; i < PAGE_STRUCT_ENTRIES; i++)
-	    {
-	      if (cp[i] & PAGE_FLAG_PRESENT)
-		{
-		  np[i] = cp[i] | PAGE_FLAG_COW;
-		  np[i] &= ~PAGE_FLAG_RW;
-		}
-	    }
-	  free_page (pdpt[pdpe]);
-	  pdpt[pdpe] = page | PAGE_FLAG_RW | (pdpt[pdpe] & (PAGE_SIZE - 1));
-	  pdpt[pdpe] &= ~PAGE_FLAG_COW;
-	}
 
       pdt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (pdpt[pdpe], PAGE_SIZE));
       pde = PDT_INDEX (addr);
-      if ((pdt[pde] & PAGE_FLAG_SIZE) || !(pdt[pde] & PAGE_FLAG_PRESENT))
-	goto signal;
-      if (pdt[pde] & PAGE_FLAG_COW)
+      if (!(pdt[pde] & PAGE_FLAG_PRESENT))
+	goto demand;
+      if (pdt[pde] & PAGE_FLAG_SIZE)
 	{
-	  uintptr_t page = alloc_page ();
-	  uintptr_t *np = (uintptr_t *) PHYS_REL (page);
-	  uintptr_t *cp =
-	    (uintptr_t *) PHYS_REL (ALIGN_DOWN (pdt[pde], PAGE_SIZE));
-	  if (UNLIKELY (!page))
+	  uintptr_t page;
+	  if (!(pdt[pde] & PAGE_FLAG_COW))
 	    goto signal;
-	  memset (np, 0, PAGE_SIZE);
-	  for (i = 0; i < PAGE_STRUCT_ENTRIES; i++)
+	  if (vm_large_page_owned (pdt[pde]))
+	    {
+	      /* No other address space maps any part of the large page */
+	      pdt[pde] = (pdt[pde] | PAGE_FLAG_RW) & ~PAGE_FLAG_COW;
+	      vm_clear_page ((void *) ALIGN_DOWN (addr, LARGE_PAGE_SIZE));
+	      thread_switch_lock = lock;
+	      return;
+	    }
+	  page = alloc_pages (LARGE_PAGE_ORDER);
+	  if (page)
 	    {
-	      if (cp[i] & PAGE_FLAG_PRESENT)
-		{
-		  np[i] = cp[i] | PAGE_FLAG_COW;
-		  np[i] &= ~PAGE_FLAG_RW;
-		}
+	      memcpy ((void *) PHYS_REL (page),
+		      (void *) PHYS_REL (ALIGN_DOWN (pdt[pde], LARGE_PAGE_SIZE)),
+		      LARGE_PAGE_SIZE);
+	      free_pages (ALIGN_DOWN (pdt[pde], LARGE_PAGE_SIZE),
+			  LARGE_PAGE_ORDER);
+	      pdt[pde] = page | PAGE_FLAG_RW | (pdt[pde] & (PAGE_SIZE - 1));
+	      pdt[pde] &= ~PAGE_FLAG_COW;
+	      vm_clear_page ((void *) ALIGN_DOWN (addr, LARGE_PAGE_SIZE));
+	      thread_switch_lock = lock;
+	      return;
 	    }
-	  free_page (pdt[pde]);
-	  pdt[pde] = page | PAGE_FLAG_RW | (pdt[pde] & (PAGE_SIZE - 1));
-	  pdt[pde] &= ~PAGE_FLAG_COW;
+
+	  /* No contiguous memory left, only copy the faulting page */
+	  if (vm_split_large_page (pml4t, (void *) addr))
+	    goto signal;
 	}
+      else if ((pdt[pde] & PAGE_FLAG_COW) && vm_unshare_table (pdt + pde, 1))
+	goto signal;
 
       pt = (uintptr_t *) PHYS_REL (ALIGN_DOWN (pdt[pde], PAGE_SIZE));
       pte = PT_INDEX (addr);
+      if (PAGE_IS_SWAP (pt[pte]))
+	{
+	  if (swap_fault (pt + pte, addr))
+	    goto nomem;
+	  thread_switch_lock = lock;
+	  return;
+	}
       if (!(pt[pte] & PAGE_FLAG_PRESENT))
-	goto signal;
+	goto demand;
       if (pt[pte] & PAGE_FLAG_COW)
 	{
-	  uintptr_t page = alloc_page ();
+	  uintptr_t old = ALIGN_DOWN (pt[pte], PAGE_SIZE);
+	  uintptr_t page;
+	  if (old != zero_page && page_ref_count (old) == 1)
+	    {
+	      /* This address space is the only remaining owner of the page,
+		 so it can be written to without copying */
+	      pt[pte] = (pt[pte] | PAGE_FLAG_RW) & ~PAGE_FLAG_COW;
+	      vm_clear_page ((void *) ALIGN_DOWN (addr, PAGE_SIZE));
+	      cow_fault_around (pt, addr);
+	      thread_switch_lock = lock;
+	      return;
+	    }
+	  if (old == zero_page)
+	    page = alloc_zeroed_page ();
+	  else
+	    {
+	      page = alloc_page ();
+	      if (page)
+		memcpy ((void *) PHYS_REL (page), (void *) PHYS_REL (old),
+			PAGE_SIZE);
+	    }
 	  if (UNLIKELY (!page))
-	    goto signal;
-	  memcpy ((void *) PHYS_REL (page),
-		  (void *) PHYS_REL (ALIGN_DOWN (pt[pte], PAGE_SIZE)),
-		  PAGE_SIZE);
+	    goto nomem;
 	  free_page (pt[pte]);
 	  pt[pte] = page | PAGE_FLAG_RW | (pt[pte] & (PAGE_SIZE - 1));
 	  pt[pte] &= ~PAGE_FLAG_COW;
 	  vm_clear_page ((void *) ALIGN_DOWN (addr, PAGE_SIZE));
-	  thread_switch_lock = 0;
+	  cow_fault_around (pt, addr);
+	  thread_switch_lock = lock;
 	  return;
 	}
+
+      /* Copying the paging structures above a shared page may have been
+	 enough to allow the access */
+      if (((pt[pte] & PAGE_FLAG_RW) || !(err & PAGE_ERR_WRITE))
+	  && !(err & PAGE_ERR_RESERVED))
+	{
+	  if (!(err & PAGE_ERR_USER) || (pt[pte] & PAGE_FLAG_USER))
+	    {
+	      vm_clear_page ((void *) ALIGN_DOWN (addr, PAGE_SIZE));
+	      thread_switch_lock = lock;
+	      return;
+	    }
+	}
+    }
+  goto signal;
+
+ demand:
+  /* Map memory that has not been accessed yet. The paging structures
+     above the missing entry have already been copied if they were shared. */
+  if (!(err & PAGE_ERR_PRESENT) && !mmap_fault ((void *) addr,
+						 err & PAGE_ERR_WRITE))
+    {
+      thread_switch_lock = lock;
+      return;
+    }
+
+ nomem:
+  /* Retry the access if memory is low and some of it could be freed */
+  if (phys_free_pages < RECLAIM_LOW_PAGES && reclaim_pages (RECLAIM_BATCH))
+    {
+      reclaim_stats.direct++;
+      thread_switch_lock = lock;
+      return;
     }
 
  signal:
+  thread_switch_lock = lock;
   info.si_signo = SIGSEGV;
   info.si_code = err & PAGE_ERR_PRESENT ? SEGV_ACCERR : SEGV_MAPERR;
   info.si_errno = 0;
@@ -0,0 +1,202 @@
+/* pcid.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/cpuid.h>
+#include <pml/ctlreg.h>
+#include <pml/interrupt.h>
+#include <pml/memory.h>
+#include <pml/process.h>
+#include <cpuid.h>
+
+/*!
+ * Thread whose translations are currently cached under each PCID in the
+ * TLB of each CPU
+ */
+
+static struct thread *pcid_owners[MAX_CORES][PCID_COUNT];
+static unsigned int next_pcid = 1;
+static int invpcid_enabled;
+
+/*!
+ * Generation of the mappings shared by every address space in the kernel
+ * half. It is incremented whenever one of those mappings is invalidated.
+ */
+
+static unsigned long kernel_tlb_gen;
+
+/*! Nonzero if address spaces are tagged with process-context identifiers */
+int vm_pcid_enabled;
+
+/*!
+ * Invalidates all TLB entries tagged with a PCID, not including global
+ * entries.
+ *
+ * @param pcid the PCID to invalidate
+ */
+
+static inline void
+invpcid_single (unsigned long pcid)
+{
+  struct
+  {
+    uint64_t pcid;
+    uint64_t addr;
+  } desc = {pcid, 0};
+  __asm__ volatile ("invpcid %0, %1" :: "m" (desc), "r" (1UL) : "memory");
+}
+
+/*!
+ * Enables process-context identifiers if the processor supports them. Each
+ * thread is then assigned a PCID, and switching between threads no longer
+ * flushes the TLB entries of the thread being switched to. This function
+ * must be called while the PCID field of CR3 is zero.
+ */
+
+void
+vm_init_pcid (void)
+{
+  unsigned int eax;
+  unsigned int ebx;
+  unsigned int ecx;
+  unsigned int edx;
+  uintptr_t cr4;
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx) || !(ecx & CPUID_PCID))
+    return;
+  if (__get_cpuid_max (0, NULL) >= 7)
+    {
+      __cpuid_count (7, 0, eax, ebx, ecx, edx);
+      invpcid_enabled = !!(ebx & CPUID_INVPCID);
+    }
+  __asm__ volatile ("mov %%cr4, %0" : "=r" (cr4));
+  __asm__ volatile ("mov %0, %%cr4" :: "r" (cr4 | CR4_PCIDE) : "memory");
+  vm_pcid_enabled = 1;
+}
+
+/*!
+ * Assigns a PCID to a new thread. PCIDs are handed out in rotation, so
+ * they may be shared by several threads. A thread whose PCID was used by
+ * another thread since it last ran has its TLB entries flushed when it is
+ * switched to. PCID zero is never assigned, since it is used when a PML4T
+ * is loaded temporarily.
+ *
+ * @return the PCID
+ */
+
+unsigned int
+vm_alloc_pcid (void)
+{
+  unsigned int pcid = next_pcid;
+  if (++next_pcid == PCID_COUNT)
+    next_pcid = 1;
+  return pcid;
+}
+
+/*!
+ * Discards the TLB entries cached for a thread on every CPU, so they are
+ * flushed when the thread is next switched to. This is done when a thread's
+ * address space is changed by another thread, and when a thread is
+ * destroyed, so a thread allocated at the same address is not mistaken for
+ * it.
+ *
+ * @param thread the thread
+ */
+
+void
+vm_pcid_invalidate (struct thread *thread)
+{
+  unsigned int cpu;
+  for (cpu = 0; cpu < MAX_CORES; cpu++)
+    {
+      if (pcid_owners[cpu][thread->pcid] == thread)
+	pcid_owners[cpu][thread->pcid] = NULL;
+    }
+}
+
+/*!
+ * Computes the value to load into CR3 to switch to the current thread.
+ * The no-flush bit is set if the TLB entries tagged with the thread's PCID
+ * on the current CPU are still valid, which is the case if no other thread
+ * has used the PCID on this CPU and no mapping visible to the thread has
+ * changed since it last ran here. Interrupts must be disabled.
+ *
+ * @return the value of CR3 for the current thread
+ */
+
+uintptr_t
+vm_pcid_cr3 (void)
+{
+  struct thread *thread = THIS_THREAD;
+  uintptr_t cr3 = (uintptr_t) thread->args.pml4t - KERNEL_VMA;
+  struct thread **owner;
+  unsigned int cpu;
+  if (!vm_pcid_enabled)
+    return cr3;
+
+  cpu = smp_cpu_index ();
+  owner = pcid_owners[cpu] + thread->pcid;
+  cr3 |= thread->pcid;
+  if (*owner == thread && thread->tlb_gen[cpu] == THIS_PROCESS->tlb_gen
+      && thread->kernel_tlb_gen[cpu] == kernel_tlb_gen)
+    cr3 |= CR3_NO_FLUSH;
+  *owner = thread;
+  thread->tlb_gen[cpu] = THIS_PROCESS->tlb_gen;
+  thread->kernel_tlb_gen[cpu] = kernel_tlb_gen;
+  return cr3;
+}
+
+/*!
+ * Records that a mapping was invalidated in the TLB of the current thread
+ * on the current CPU. Other threads that share the mapping, and this
+ * thread on other CPUs, have their TLB entries flushed the next time they
+ * are switched to. User-space mappings are shared with the
+ * other threads of the process, and with the process that created it by
+ * vfork. Kernel-space mappings outside the thread-local region are shared
+ * with every thread.
+ *
+ * @param addr the virtual address of the mapping
+ */
+
+void
+vm_pcid_update (uintptr_t addr)
+{
+  if (addr < USER_MEM_TOP_VMA)
+    {
+      struct thread *parent = THIS_PROCESS->vfork_parent;
+      if (parent && parent->process)
+	parent->process->tlb_gen++;
+      THIS_THREAD->tlb_gen[smp_cpu_index ()] = ++THIS_PROCESS->tlb_gen;
+    }
+  else if (PML4T_INDEX (addr) != PML4T_INDEX (THREAD_LOCAL_BASE_VMA))
+    THIS_THREAD->kernel_tlb_gen[smp_cpu_index ()] = ++kernel_tlb_gen;
+}
+
+/*!
+ * Invalidates all non-global TLB entries of the current thread. Only the
+ * entries tagged with the thread's PCID are affected.
+ */
+
+void
+vm_pcid_flush (void)
+{
+  uintptr_t cr3;
+  __asm__ volatile ("mov %%cr3, %0" : "=r" (cr3));
+  if (invpcid_enabled)
+    invpcid_single (cr3 & CR3_PCID_MASK);
+  else
+    vm_set_cr3 (cr3);
+}
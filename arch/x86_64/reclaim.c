@@ -0,0 +1,595 @@
+/* reclaim.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/alloc.h>
+#include <pml/memory.h>
+#include <pml/process.h>
+#include <pml/swap.h>
+#include <pml/vfs.h>
+#include <pml/hash.h>
+#include <pml/map.h>
+#include <pml/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*! Size of the address range covered by a PML4T entry */
+#define PML4E_SIZE						\
+  ((uintptr_t) HUGE_PAGE_SIZE * PAGE_STRUCT_ENTRIES)
+
+/*!
+ * State of the reclaim or page merging scanner while it scans the address
+ * space of a process. Page frames unmapped by the scanner are only freed
+ * after their TLB entries have been invalidated.
+ */
+
+struct reclaim
+{
+  struct process *process;      /*!< Process being scanned */
+  uintptr_t *pml4t;             /*!< Address space of the process */
+  struct mmap *region;          /*!< Region being scanned, NULL for brk */
+  struct vm_flush flush;        /*!< Range of unmapped pages */
+  uintptr_t pages[RECLAIM_BATCH]; /*!< Page frames waiting to be freed */
+  size_t count;                 /*!< Number of page frames waiting */
+  size_t freed;                 /*!< Number of page frames reclaimed */
+
+  /*! Function called for each page table entry in the address space */
+  void (*scan) (struct reclaim *rc, uintptr_t *pte, uintptr_t addr,
+		int shared);
+  size_t skip;                  /*!< Number of mergeable pages to skip */
+  size_t budget;                /*!< Number of mergeable pages left to hash */
+};
+
+/*! Counters of the reclaim scanner */
+struct reclaim_stats reclaim_stats;
+
+/*! Counters of the page merging scanner */
+struct merge_stats merge_stats;
+
+/*! Whether any memory region has been made mergeable with madvise() */
+int merge_active;
+
+/*! Index in the process queue of the next process to scan */
+static size_t reclaim_hand;
+
+/*! Index in the process queue of the next process to scan for merging */
+static size_t merge_hand;
+
+/*! Time the current pass of the page merging scanner started */
+static time_t merge_pass_time;
+
+/*! Stable page frames used in place of identical pages, by content hash */
+static struct hashmap *merge_stable;
+
+/*! Content hash of page frames on the previous scan, by page frame */
+static struct hashmap *merge_checksums;
+
+/*!
+ * Invalidates the TLB entries of the pages unmapped by the scanner and
+ * drops the references to their page frames.
+ *
+ * @param rc the scanner state
+ */
+
+static void
+reclaim_flush (struct reclaim *rc)
+{
+  size_t i;
+  vm_tlb_flush_process (rc->process, &rc->flush);
+  for (i = 0; i < rc->count; i++)
+    free_page (rc->pages[i]);
+  rc->count = 0;
+}
+
+/*!
+ * Removes a page from the address space being scanned. The reference to the
+ * page frame is dropped after the TLB entry for the page is invalidated.
+ *
+ * @param rc the scanner state
+ * @param pte the page table entry
+ * @param addr the virtual address of the page
+ * @param entry the new page table entry
+ * @return the old page table entry
+ */
+
+static uintptr_t
+reclaim_unmap (struct reclaim *rc, uintptr_t *pte, uintptr_t addr,
+	       uintptr_t entry)
+{
+  uintptr_t old = __atomic_exchange_n (pte, entry, __ATOMIC_ACQ_REL);
+  vm_flush_add (&rc->flush, addr, addr + PAGE_SIZE);
+  rc->pages[rc->count++] = ALIGN_DOWN (old, PAGE_SIZE);
+  if (rc->count == RECLAIM_BATCH)
+    reclaim_flush (rc);
+  return old;
+}
+
+/*!
+ * Examines a page mapped in the address space being scanned. A page that
+ * was accessed since the last scan has its accessed bit cleared and is
+ * kept. Otherwise, it is unmapped if it can be brought back on the next
+ * page fault: pages of file mappings are still in the page cache, the zero
+ * page is mapped again, and anonymous pages are compressed or written to
+ * swap space.
+ *
+ * @param rc the scanner state
+ * @param pte the page table entry
+ * @param addr the virtual address of the page
+ * @param shared whether the page table is shared with another address space
+ */
+
+static void
+reclaim_page (struct reclaim *rc, uintptr_t *pte, uintptr_t addr, int shared)
+{
+  uintptr_t entry = *pte;
+  uintptr_t page = ALIGN_DOWN (entry, PAGE_SIZE);
+  if (!(entry & PAGE_FLAG_PRESENT))
+    return;
+  reclaim_stats.scanned++;
+
+  /* The TLB entry is not invalidated, so a page still cached in the TLB
+     may stay unaccessed until it is evicted from the TLB */
+  if (entry & PAGE_FLAG_ACCESS)
+    {
+      __atomic_fetch_and (pte, ~PAGE_FLAG_ACCESS, __ATOMIC_RELAXED);
+      reclaim_stats.aged++;
+      return;
+    }
+
+  /* Entries in shared page tables belong to every address space sharing
+     them, but only one reference is held for this address space */
+  if (shared)
+    return;
+
+  if (rc->region && rc->region->file)
+    {
+      struct vnode *vp = rc->region->file->vnode;
+      size_t index = (rc->region->offset + addr - rc->region->base)
+	/ PAGE_SIZE;
+
+      /* Private copies of pages of the file are not unmapped */
+      if (!vp->pages || (uintptr_t) hashmap_lookup (vp->pages, index) != page)
+	return;
+      entry = reclaim_unmap (rc, pte, addr, 0);
+      vm_mark_dirty (entry);
+      if (phys_alloc_table[page / PAGE_SIZE].flags & PAGE_META_DIRTY)
+	vnode_queue_writeback (vp, index * PAGE_SIZE, PAGE_SIZE);
+      reclaim_stats.file_unmapped++;
+    }
+  else if (page == zero_page)
+    reclaim_unmap (rc, pte, addr, 0);
+  else if (page_ref_count (page) == 1)
+    {
+      size_t slot = swap_out ((void *) PHYS_REL (page));
+      if (!slot)
+	return;
+      reclaim_unmap (rc, pte, addr,
+		     SWAP_ENTRY (slot,
+				 entry & (PAGE_FLAG_RW | PAGE_FLAG_COW)));
+      reclaim_stats.swapped_out++;
+      rc->freed++;
+    }
+}
+
+/*!
+ * Looks up the page table covering an address in the address space being
+ * scanned. Large pages are never reclaimed.
+ *
+ * @param rc the scanner state
+ * @param v the virtual address
+ * @param next pointer to store the end of the area with no page table, if
+ * no page table is found
+ * @param shared pointer to store whether the page table is reachable from
+ * another address space
+ * @return the page table, or NULL if none exists
+ */
+
+static uintptr_t *
+reclaim_lookup_pt (struct reclaim *rc, uintptr_t v, uintptr_t *next,
+		   int *shared)
+{
+  uintptr_t entry = rc->pml4t[PML4T_INDEX (v)];
+  uintptr_t *table;
+  if (!(entry & PAGE_FLAG_PRESENT))
+    {
+      *next = ALIGN_DOWN (v, PML4E_SIZE) + PML4E_SIZE;
+      return NULL;
+    }
+  *shared = page_ref_count (entry) > 1;
+
+  table = (uintptr_t *) PHYS_REL (ALIGN_DOWN (entry, PAGE_SIZE));
+  entry = table[PDPT_INDEX (v)];
+  if (!(entry & PAGE_FLAG_PRESENT) || (entry & PAGE_FLAG_SIZE))
+    {
+      *next = ALIGN_DOWN (v, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+      return NULL;
+    }
+  *shared |= page_ref_count (entry) > 1;
+
+  table = (uintptr_t *) PHYS_REL (ALIGN_DOWN (entry, PAGE_SIZE));
+  entry = table[PDT_INDEX (v)];
+  *next = ALIGN_DOWN (v, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE;
+  if (!(entry & PAGE_FLAG_PRESENT) || (entry & PAGE_FLAG_SIZE))
+    return NULL;
+  *shared |= page_ref_count (entry) > 1;
+  return (uintptr_t *) PHYS_REL (ALIGN_DOWN (entry, PAGE_SIZE));
+}
+
+/*!
+ * Scans the pages mapped in a range of the address space being scanned.
+ *
+ * @param rc the scanner state
+ * @param ptr the page-aligned start of the range
+ * @param end the page-aligned end of the range
+ */
+
+static void
+reclaim_range (struct reclaim *rc, uintptr_t ptr, uintptr_t end)
+{
+  while (ptr < end)
+    {
+      uintptr_t next;
+      int shared = 0;
+      uintptr_t *pt = reclaim_lookup_pt (rc, ptr, &next, &shared);
+      if (next > end || next < ptr)
+	next = end;
+      if (pt)
+	{
+	  for (; ptr < next; ptr += PAGE_SIZE)
+	    rc->scan (rc, pt + PT_INDEX (ptr), ptr, shared);
+	}
+      ptr = next;
+    }
+}
+
+/*!
+ * Scans the pages of all memory regions in a subtree of the memory region
+ * tree of the process being scanned.
+ *
+ * @param rc the scanner state
+ * @param node the root of the subtree
+ */
+
+static void
+reclaim_regions (struct reclaim *rc, struct mmap *node)
+{
+  if (!node)
+    return;
+  reclaim_regions (rc, node->left);
+  rc->region = node;
+  reclaim_range (rc, node->base, node->base + node->len);
+  reclaim_regions (rc, node->right);
+}
+
+/*!
+ * Determines whether a process is suspended after creating a process with
+ * vfork. Its address space is borrowed by the new process, so it is
+ * scanned as part of that process instead.
+ *
+ * @param process the process
+ * @return nonzero if the address space of the process is borrowed
+ */
+
+static int
+reclaim_borrowed (struct process *process)
+{
+  size_t i;
+  for (i = 1; i < process_queue.len; i++)
+    {
+      struct thread *parent = process_queue.queue[i]->vfork_parent;
+      if (parent && parent->process == process)
+	return 1;
+    }
+  return 0;
+}
+
+/*!
+ * Scans the anonymous memory, file mappings and program data segment of a
+ * process with the scan function of the scanner state.
+ *
+ * @param rc the scanner state
+ * @param process the process
+ * @return zero if the process was scanned, or -1 if its address space cannot
+ * be scanned
+ */
+
+static int
+reclaim_scan (struct reclaim *rc, struct process *process)
+{
+  if (!process->threads.len || reclaim_borrowed (process))
+    return -1;
+  rc->process = process;
+  rc->pml4t = process->threads.queue[0]->args.pml4t;
+  rc->flush.start = 0;
+  rc->flush.end = 0;
+  rc->count = 0;
+  rc->freed = 0;
+  reclaim_regions (rc, process->mmaps.root);
+  rc->region = NULL;
+  reclaim_range (rc, ALIGN_DOWN ((uintptr_t) process->brk.base, PAGE_SIZE),
+		 ALIGN_UP ((uintptr_t) process->brk.curr, PAGE_SIZE));
+  reclaim_flush (rc);
+  return 0;
+}
+
+/*!
+ * Scans the address space of a process for pages to reclaim.
+ *
+ * @param process the process
+ * @return the number of page frames reclaimed
+ */
+
+static size_t
+reclaim_process (struct process *process)
+{
+  struct reclaim rc;
+  rc.scan = reclaim_page;
+  if (reclaim_scan (&rc, process))
+    return 0;
+  return rc.freed;
+}
+
+/*!
+ * Frees page frames that have not been used recently. Clean pages of the
+ * page cache are freed first, then the address spaces of processes are
+ * scanned in turn, continuing from where the previous call stopped. Each
+ * address space is scanned as a clock: an accessed page is given a second
+ * chance, and is reclaimed if it is still unaccessed on the next scan.
+ * Up to two scans of every process are done before giving up.
+ *
+ * @param target the number of page frames to free
+ * @return the number of page frames freed
+ */
+
+size_t
+reclaim_pages (size_t target)
+{
+  size_t freed = 0;
+  size_t i;
+  int lock = thread_switch_lock;
+  thread_switch_lock = 1;
+  for (i = 0; i < 2 * process_queue.len && freed < target; i++)
+    {
+      if (!(i % process_queue.len))
+	freed += vnode_shrink_cache (target - freed);
+      if (freed >= target)
+	break;
+      if (++reclaim_hand >= process_queue.len)
+	reclaim_hand = 1;
+      if (reclaim_hand < process_queue.len)
+	freed += reclaim_process (process_queue.queue[reclaim_hand]);
+    }
+  thread_switch_lock = lock;
+  return freed;
+}
+
+/*!
+ * Reclaims page frames while free memory is low. This function is called
+ * by the kernel process while it has nothing else to do.
+ */
+
+void
+reclaim_background (void)
+{
+  if (phys_free_pages >= RECLAIM_LOW_PAGES)
+    return;
+  while (phys_free_pages < RECLAIM_HIGH_PAGES)
+    {
+      if (!reclaim_pages (RECLAIM_BATCH))
+	break;
+    }
+}
+
+/*!
+ * Examines a page mapped in the address space being scanned for merging.
+ * A page with the same contents as a stable page frame is replaced by a
+ * copy-on-write mapping of the stable page frame. Otherwise, a page whose
+ * contents did not change since the previous scan becomes a stable page
+ * frame itself and is made copy-on-write, so pages of other address spaces
+ * can be merged with it. Writes to merged pages are handled by the
+ * copy-on-write page fault path.
+ *
+ * @param rc the scanner state
+ * @param pte the page table entry
+ * @param addr the virtual address of the page
+ * @param shared whether the page table is shared with another address space
+ */
+
+static void
+merge_page (struct reclaim *rc, uintptr_t *pte, uintptr_t addr, int shared)
+{
+  uintptr_t entry = *pte;
+  uintptr_t page = ALIGN_DOWN (entry, PAGE_SIZE);
+  uintptr_t stable;
+  hash_t hash;
+  if (!(entry & PAGE_FLAG_PRESENT) || (entry & PAGE_FLAG_SHARED) || shared
+      || page == zero_page)
+    return;
+
+  /* Only private anonymous memory is merged */
+  if (rc->region)
+    {
+      if (rc->region->file || (rc->region->flags & MAP_SHARED)
+	  || !(rc->region->mergeable || boot_options.merge))
+	return;
+    }
+  else if (!boot_options.merge)
+    return;
+
+  /* Skip the pages hashed by previous calls */
+  if (rc->skip)
+    {
+      rc->skip--;
+      return;
+    }
+  if (!rc->budget)
+    return;
+  rc->budget--;
+  merge_stats.scanned++;
+
+  hash = siphash ((void *) PHYS_REL (page), PAGE_SIZE, 0);
+  stable = (uintptr_t) hashmap_lookup (merge_stable, hash);
+  if (stable == page)
+    return;
+  if (stable)
+    {
+      uintptr_t flags = entry & (PAGE_SIZE - 1)
+	& ~(PAGE_FLAG_RW | PAGE_FLAG_DIRTY);
+      if (entry & PAGE_FLAG_RW)
+	flags |= PAGE_FLAG_COW;
+
+      /* Different contents with the same hash are never merged */
+      if (memcmp ((void *) PHYS_REL (page), (void *) PHYS_REL (stable),
+		  PAGE_SIZE))
+	return;
+      ref_page (stable);
+      reclaim_unmap (rc, pte, addr, stable | flags);
+      merge_stats.merged++;
+      merge_stats.saved++;
+      rc->freed++;
+      return;
+    }
+
+  /* Pages that are written often would be copied again soon after being
+     merged, so a page only becomes stable if it did not change since the
+     previous scan */
+  if ((uintptr_t) hashmap_lookup (merge_checksums, page) != (hash | 1))
+    {
+      hashmap_insert (merge_checksums, page, (void *) (hash | 1));
+      return;
+    }
+  if (hashmap_insert (merge_stable, hash, (void *) page))
+    return;
+  hashmap_remove (merge_checksums, page);
+  ref_page (page);
+  if (entry & PAGE_FLAG_RW)
+    {
+      __atomic_fetch_xor (pte, PAGE_FLAG_RW | PAGE_FLAG_COW, __ATOMIC_ACQ_REL);
+      vm_flush_add (&rc->flush, addr, addr + PAGE_SIZE);
+    }
+  merge_stats.shared++;
+}
+
+/*!
+ * Collects stable page frames that are no longer mapped by any address
+ * space, and counts the pages saved by merging.
+ *
+ * @param key the content hash of the stable page frame
+ * @param value the stable page frame
+ * @param data the array of unused stable page frames
+ */
+
+static void
+merge_prune_page (unsigned long key, void *value, void *data)
+{
+  uintptr_t *unused = data;
+  unsigned int count = page_ref_count ((uintptr_t) value);
+  if (count > 2)
+    merge_stats.saved += count - 2;
+  else if (count == 1 && unused[0] < RECLAIM_BATCH)
+    unused[++unused[0]] = key;
+}
+
+/*!
+ * Frees stable page frames whose only reference is held by the page
+ * merging scanner, and recounts the stable page frames in use.
+ */
+
+static void
+merge_prune (void)
+{
+  uintptr_t unused[RECLAIM_BATCH + 1];
+  size_t i;
+  do
+    {
+      unused[0] = 0;
+      merge_stats.saved = 0;
+      hashmap_iterate (merge_stable, merge_prune_page, unused);
+      for (i = 1; i <= unused[0]; i++)
+	{
+	  free_page ((uintptr_t) hashmap_lookup (merge_stable, unused[i]));
+	  hashmap_remove (merge_stable, unused[i]);
+	}
+    }
+  while (unused[0] == RECLAIM_BATCH);
+  merge_stats.shared = merge_stable->object_count;
+
+  /* Forget hashes of pages that were freed or changed since the pass */
+  if (merge_checksums->object_count > phys_page_count / 8)
+    {
+      hashmap_free (merge_checksums, NULL);
+      merge_checksums = hashmap_create ();
+    }
+}
+
+/*!
+ * Scans anonymous memory that may be merged for pages with identical
+ * contents. Memory regions are made mergeable with the @ref MADV_MERGEABLE
+ * advice, or all private anonymous memory is mergeable if the @p merge
+ * boot option is given. Each call hashes up to @ref MERGE_SCAN_PAGES pages
+ * of one process, continuing from where the previous call stopped, and a
+ * pass over all processes is started at most once per second. This
+ * function is called by the kernel process while it has nothing else to do.
+ */
+
+void
+merge_background (void)
+{
+  static pid_t pid;
+  static size_t skip;
+  struct reclaim rc;
+  int lock;
+  if (!merge_active && !boot_options.merge)
+    return;
+  if (!merge_stable)
+    merge_stable = hashmap_create ();
+  if (!merge_checksums)
+    merge_checksums = hashmap_create ();
+  if (UNLIKELY (!merge_stable || !merge_checksums))
+    return;
+
+  /* Move to the next process once the current process was scanned
+     completely or has exited */
+  if (!pid || merge_hand >= process_queue.len
+      || process_queue.queue[merge_hand]->pid != pid)
+    {
+      if (++merge_hand >= process_queue.len)
+	{
+	  if (real_time == merge_pass_time)
+	    return;
+	  merge_pass_time = real_time;
+	  merge_prune ();
+	  merge_hand = 1;
+	  if (merge_hand >= process_queue.len)
+	    return;
+	}
+      pid = process_queue.queue[merge_hand]->pid;
+      skip = 0;
+    }
+
+  lock = thread_switch_lock;
+  thread_switch_lock = 1;
+  rc.scan = merge_page;
+  rc.skip = skip;
+  rc.budget = MERGE_SCAN_PAGES;
+  if (reclaim_scan (&rc, process_queue.queue[merge_hand]) || rc.budget)
+    pid = 0;
+  else
+    skip += MERGE_SCAN_PAGES;
+  thread_switch_lock = lock;
+}
@@ -17,6 +17,7 @@
 /*! @file */
 
 #include <pml/alloc.h>
+#include <pml/interrupt.h>
 #include <pml/memory.h>
 #include <pml/panic.h>
 #include <pml/tty.h>
@@ -26,6 +27,10 @@
 static struct thread kernel_thread;
 static struct process kernel_process;
 
+/*! Object cache for threads */
+static struct kmem_cache thread_cache =
+  KMEM_CACHE_INIT ("thread", sizeof (struct thread), NULL);
+
 /*!
  * Initializes the scheduler and sets up the kernel process and main thread.
  * Thread-local kernel data structures for the kernel thread are also
@@ -41,6 +46,7 @@ sched_init (void)
   kernel_thread.args.stack_size = KERNEL_STACK_SIZE;
   kernel_thread.state = THREAD_STATE_RUNNING;
   kernel_thread.error = 0;
+  kernel_thread.pcid = vm_alloc_pcid ();
   kernel_process.threads.queue = malloc (sizeof (struct thread *));
   kernel_process.threads.queue[0] = &kernel_thread;
   kernel_process.threads.len = 1;
@@ -50,6 +56,13 @@ sched_init (void)
   process_queue.len = 1;
   if (thread_alloc_tl_kernel_data (&kernel_thread))
     panic ("Failed to allocate kernel thread data structures");
+
+  /* Every thread now has a page fault stack */
+  set_int_ist (INT_PAGE_FAULT, PAGE_FAULT_IST);
+
+  /* Tag each thread's TLB entries so switching threads keeps them */
+  vm_init_pcid ();
+  vm_tlb_tracking = 1;
 }
 
 /*!
@@ -103,12 +116,14 @@ thread_save_stack (struct thread *thread, void *stack)
  *
  * @todo support process priorities
  * @param stack pointer to store new thread stack address
- * @param pml4t_phys pointer to store new thread PML4T physical address
+ * @param pml4t_phys pointer to store the value of CR3 for the new thread
  */
 
 void
 thread_switch (void **stack, uintptr_t *pml4t_phys)
 {
+  struct process *prev = THIS_PROCESS;
+
   /* Switch to the next unblocked thread in the current process */
   do
     {
@@ -123,7 +138,9 @@ thread_switch (void **stack, uintptr_t *pml4t_phys)
     }
   while (THIS_THREAD->state != THREAD_STATE_RUNNING);
   current_tty = tty_get_from_sid (THIS_PROCESS->sid);
-  thread_get_args (THIS_THREAD, pml4t_phys, stack);
+  thread_get_args (THIS_THREAD, NULL, stack);
+  vm_tlb_switch (prev, THIS_PROCESS);
+  *pml4t_phys = vm_pcid_cr3 ();
 }
 
 /*!
@@ -138,7 +155,7 @@ thread_switch (void **stack, uintptr_t *pml4t_phys)
 struct thread *
 thread_create (struct thread_args *args)
 {
-  struct thread *thread = calloc (1, sizeof (struct thread));
+  struct thread *thread = kmem_cache_zalloc (&thread_cache);
   if (UNLIKELY (!thread))
     return NULL;
   thread->tid = alloc_pid ();
@@ -147,15 +164,18 @@ thread_create (struct thread_args *args)
   thread->process = NULL;
   memcpy (&thread->args, args, sizeof (struct thread_args));
   thread->state = THREAD_STATE_RUNNING;
+  thread->pcid = vm_alloc_pcid ();
   return thread;
 
  err0:
-  free (thread);
+  kmem_cache_free (&thread_cache, thread);
   return NULL;
 }
 
 /*!
- * Allocates thread-local kernel data structures.
+ * Allocates thread-local kernel data structures. This includes the stack
+ * used to handle page faults, which is always fully mapped since it is
+ * used to handle faults on the other stacks.
  *
  * @param thread the thread to allocate on
  * @return zero on success
@@ -166,6 +186,7 @@ thread_alloc_tl_kernel_data (struct thread *thread)
 {
   uintptr_t siginfo_page = alloc_page ();
   uintptr_t st_page = physical_addr (signal_trampoline);
+  size_t i;
   if (UNLIKELY (!siginfo_page))
     RETV_ERROR (ENOMEM, -1);
   if (vm_map_page (thread->args.pml4t, siginfo_page, (void *) SIGINFO_VMA,
@@ -174,6 +195,88 @@ thread_alloc_tl_kernel_data (struct thread *thread)
   vm_map_page (thread->args.pml4t, st_page, (void *) SIGNAL_TRAMPOLINE_VMA,
 	       PAGE_FLAG_USER);
   ref_page (st_page);
+  for (i = PAGE_SIZE; i <= PAGE_FAULT_STACK_SIZE; i += PAGE_SIZE)
+    {
+      uintptr_t page = alloc_page ();
+      if (UNLIKELY (!page))
+	RETV_ERROR (ENOMEM, -1);
+      if (vm_map_page (thread->args.pml4t, page,
+		       (void *) (PAGE_FAULT_STACK_TOP_VMA - i), PAGE_FLAG_RW))
+	{
+	  free_page (page);
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+/*!
+ * Maps a zero-filled page on the first access to a page of one of the
+ * stacks of a thread. Only the pages of a stack that have been used are
+ * mapped. The pages below each stack are never mapped, so they act as
+ * guard pages against stack overflows.
+ *
+ * @param pml4t the address space the page fault occurred in, which may
+ * belong to a thread that is still being created
+ * @param addr the faulting virtual address
+ * @return zero if the page was mapped
+ */
+
+int
+thread_stack_fault (uintptr_t *pml4t, uintptr_t addr)
+{
+  uintptr_t stack_base = (uintptr_t) THIS_THREAD->args.stack_base;
+  uintptr_t page;
+  if ((addr < stack_base || addr >= stack_base + THIS_THREAD->args.stack_size)
+      && (addr < INTERRUPT_STACK_TOP_VMA - KERNEL_STACK_SIZE
+	  || addr >= INTERRUPT_STACK_TOP_VMA)
+      && (addr < SYSCALL_STACK_TOP_VMA - KERNEL_STACK_SIZE
+	  || addr >= SYSCALL_STACK_TOP_VMA))
+    return -1;
+  page = alloc_zeroed_page ();
+  if (UNLIKELY (!page))
+    RETV_ERROR (ENOMEM, -1);
+  if (vm_map_page (pml4t, page, (void *) ALIGN_DOWN (addr, PAGE_SIZE),
+		   PAGE_FLAG_RW | PAGE_FLAG_USER))
+    {
+      free_page (page);
+      return -1;
+    }
+  return 0;
+}
+
+/*!
+ * Creates the stack of a cloned thread at the same address as a stack of
+ * the current thread. Only the pages of the stack above the current stack
+ * pointer are copied, since the rest of the stack is not in use. The top
+ * page of the stack is always mapped, and the rest of the pages are mapped
+ * on first access.
+ *
+ * @param pml4t the address space of the cloned thread
+ * @param top the virtual address of the top of the stack
+ * @param size the size of the stack
+ * @return zero on success
+ */
+
+static int
+thread_clone_stack (uintptr_t *pml4t, uintptr_t top, size_t size)
+{
+  uintptr_t sp = (uintptr_t) __builtin_frame_address (0);
+  uintptr_t page;
+  if (sp > top - size && sp < top)
+    return vm_copy_range (pml4t, THIS_THREAD->args.pml4t,
+			  (void *) ALIGN_DOWN (sp, PAGE_SIZE),
+			  top - ALIGN_DOWN (sp, PAGE_SIZE),
+			  PAGE_FLAG_RW | PAGE_FLAG_USER);
+  page = alloc_zeroed_page ();
+  if (UNLIKELY (!page))
+    RETV_ERROR (ENOMEM, -1);
+  if (vm_map_page (pml4t, page, (void *) (top - PAGE_SIZE),
+		   PAGE_FLAG_RW | PAGE_FLAG_USER))
+    {
+      free_page (page);
+      return -1;
+    }
   return 0;
 }
 
@@ -190,6 +293,7 @@ thread_free (struct thread *thread)
 {
   unsigned int pml4e = PML4T_INDEX (THREAD_LOCAL_BASE_VMA);
   free_pid (thread->tid);
+  vm_pcid_invalidate (thread);
   if (thread->args.pml4t[pml4e] & PAGE_FLAG_PRESENT)
     {
       uintptr_t tlp_phys = ALIGN_DOWN (thread->args.pml4t[pml4e], PAGE_SIZE);
@@ -198,7 +302,7 @@ thread_free (struct thread *thread)
       free_page (tlp_phys);
     }
   free_virtual_page (thread->args.pml4t);
-  free (thread);
+  kmem_cache_free (&thread_cache, thread);
 }
 
 /*!
@@ -234,6 +338,9 @@ thread_attach_process (struct process *process, struct thread *thread)
  * Clones a thread by creating another copy of the thread with the same
  * address space but a separate stack. An additional stack for kernel-mode
  * code is also created. The new thread will not be attached to a process.
+ * If the user-mode address space is not copied, the paging structures are
+ * borrowed without taking references, so they must be returned to the
+ * original thread before the cloned thread is freed.
  *
  * @param thread the thread to clone
  * @param copy whether to copy the user-mode address space
@@ -243,10 +350,9 @@ thread_attach_process (struct process *process, struct thread *thread)
 struct thread *
 thread_clone (struct thread *thread, int copy)
 {
-  struct thread *t = calloc (1, sizeof (struct thread));
+  struct thread *t = kmem_cache_zalloc (&thread_cache);
   uintptr_t *pml4t;
   uintptr_t *tlp;
-  void *addr;
   size_t i;
   if (UNLIKELY (!t))
     return NULL;
@@ -261,6 +367,7 @@ thread_clone (struct thread *thread, int copy)
   t->process = NULL;
   t->state = THREAD_STATE_RUNNING;
   t->error = thread->error;
+  t->pcid = vm_alloc_pcid ();
   t->args.pml4t = pml4t;
   t->args.stack = thread->args.stack;
   t->args.stack_base = thread->args.stack_base;
@@ -276,74 +383,41 @@ thread_clone (struct thread *thread, int copy)
     {
       for (i = 0; i < PAGE_STRUCT_ENTRIES / 2; i++)
 	{
-	  /* Mark allocated pages as copy-on-write */
+	  /* Mark allocated pages as copy-on-write and add another
+	     reference to all user pages */
 	  if (thread->args.pml4t[i] & PAGE_FLAG_PRESENT)
 	    {
 	      thread->args.pml4t[i] &= ~PAGE_FLAG_RW;
 	      thread->args.pml4t[i] |= PAGE_FLAG_COW;
+	      ref_page (thread->args.pml4t[i]);
+	      ref_pdpt ((uintptr_t *)
+			PHYS_REL (ALIGN_DOWN (thread->args.pml4t[i],
+					      PAGE_SIZE)));
 	    }
 	}
     }
-  for (i = 0; i < PAGE_STRUCT_ENTRIES / 2; i++)
-    {
-      /* Add another reference to all user pages */
-      if (thread->args.pml4t[i] & PAGE_FLAG_PRESENT)
-	{
-	  ref_page (thread->args.pml4t[i]);
-	  ref_pdpt ((uintptr_t *) PHYS_REL (ALIGN_DOWN (thread->args.pml4t[i],
-							PAGE_SIZE)));
-	}
-    }
 
   memcpy (pml4t, thread->args.pml4t, PAGE_STRUCT_SIZE);
   pml4t[PML4T_INDEX (THREAD_LOCAL_BASE_VMA)] = ((uintptr_t) tlp - KERNEL_VMA)
     | PAGE_FLAG_PRESENT | PAGE_FLAG_RW | PAGE_FLAG_USER;
-  for (addr = thread->args.stack_base;
-       addr < thread->args.stack_base + thread->args.stack_size;
-       addr += PAGE_SIZE)
-    {
-      uintptr_t page = alloc_page ();
-      if (UNLIKELY (!page))
-	goto err3;
-      memcpy ((void *) PHYS_REL (page),
-	      (void *) PHYS_REL (vm_phys_addr (thread->args.pml4t, addr)),
-	      PAGE_SIZE);
-      if (vm_map_page (pml4t, page, addr, PAGE_FLAG_RW | PAGE_FLAG_USER))
-	{
-	  free_page (page);
-	  goto err3;
-	}
-    }
-  for (i = 0; i < KERNEL_STACK_SIZE; i += PAGE_SIZE)
-    {
-      uintptr_t page = alloc_page ();
-      addr = (void *) (INTERRUPT_STACK_TOP_VMA - PAGE_SIZE - i);
-      if (UNLIKELY (!page))
-	goto err3;
-      memcpy ((void *) PHYS_REL (page),
-	      (void *) PHYS_REL (vm_phys_addr (thread->args.pml4t, addr)),
-	      PAGE_SIZE);
-      if (vm_map_page (pml4t, page, addr, PAGE_FLAG_RW | PAGE_FLAG_USER))
-	{
-	  free_page (page);
-	  goto err3;
-	}
-    }
-  for (i = 0; i < KERNEL_STACK_SIZE; i += PAGE_SIZE)
+
+  /* Share the process stack as copy-on-write. The kernel thread's stack
+     is part of the kernel image, so only the part in use is copied. */
+  if (thread->process)
     {
-      uintptr_t page = alloc_page ();
-      addr = (void *) (SYSCALL_STACK_TOP_VMA - PAGE_SIZE - i);
-      if (UNLIKELY (!page))
+      if (vm_share_range (pml4t, thread->args.pml4t, thread->args.stack_base,
+			  thread->args.stack_size))
 	goto err3;
-      memcpy ((void *) PHYS_REL (page),
-	      (void *) PHYS_REL (vm_phys_addr (thread->args.pml4t, addr)),
-	      PAGE_SIZE);
-      if (vm_map_page (pml4t, page, addr, PAGE_FLAG_RW | PAGE_FLAG_USER))
-	{
-	  free_page (page);
-	  goto err3;
-	}
     }
+  else if (thread_clone_stack (pml4t, (uintptr_t) thread->args.stack_base
+			       + thread->args.stack_size,
+			       thread->args.stack_size))
+    goto err3;
+
+  /* Kernel-mode stacks are mapped as they are used */
+  if (thread_clone_stack (pml4t, INTERRUPT_STACK_TOP_VMA, KERNEL_STACK_SIZE)
+      || thread_clone_stack (pml4t, SYSCALL_STACK_TOP_VMA, KERNEL_STACK_SIZE))
+    goto err3;
 
   if (thread_alloc_tl_kernel_data (t))
     goto err3;
@@ -356,7 +430,7 @@ thread_clone (struct thread *thread, int copy)
  err1:
   free_virtual_page (pml4t);
  err0:
-  free (t);
+  kmem_cache_free (&thread_cache, t);
   return NULL;
 }
 
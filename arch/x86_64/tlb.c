@@ -0,0 +1,252 @@
+/* tlb.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/interrupt.h>
+#include <pml/lock.h>
+#include <pml/memory.h>
+#include <pml/process.h>
+
+#ifdef ENABLE_SMP
+
+static lock_t shootdown_lock;
+
+/*! Range to invalidate requested by the CPU holding the shootdown lock */
+static struct vm_flush shootdown_range;
+
+/*! Number of CPUs that have not yet invalidated the requested range */
+static volatile unsigned int shootdown_pending;
+
+/*! Set for each CPU that was sent the requested range */
+static volatile int shootdown_requested[MAX_CORES];
+
+/*! Mask of CPUs that have run a thread since boot */
+static volatile unsigned long sched_cpus;
+
+#endif
+
+/*!
+ * Nonzero once the scheduler has started. Invalidating a mapping after that
+ * may require invalidating it in the TLBs of other threads and CPUs.
+ */
+
+int vm_tlb_tracking;
+
+#ifdef ENABLE_SMP
+
+/*!
+ * Invalidates the range requested by another CPU in the TLB of the current
+ * CPU, if there is one, and acknowledges the request. The request is taken
+ * atomically, since it may be polled while interrupts are enabled and
+ * the interprocessor interrupt for it can arrive at any time.
+ *
+ * @param cpu the index of the current CPU
+ */
+
+static void
+shootdown_handle (unsigned int cpu)
+{
+  uintptr_t ptr;
+  if (!__atomic_exchange_n (&shootdown_requested[cpu], 0, __ATOMIC_ACQUIRE))
+    return;
+  if (shootdown_range.end - shootdown_range.start
+      > VM_FLUSH_MAX_PAGES * PAGE_SIZE)
+    vm_clear_tlb ();
+  else
+    {
+      for (ptr = shootdown_range.start; ptr < shootdown_range.end;
+	   ptr += PAGE_SIZE)
+	vm_invlpg ((void *) ptr);
+    }
+  __atomic_sub_fetch (&shootdown_pending, 1, __ATOMIC_RELEASE);
+}
+
+/*!
+ * Sends a range to invalidate to a set of CPUs and waits until all of them
+ * have invalidated it. Each CPU receives a single interprocessor interrupt,
+ * and invalidates the whole TLB if the range is large. While waiting for
+ * another CPU's shootdown to finish, requests sent to this CPU are
+ * handled, so two CPUs can shoot down each other with interrupts disabled.
+ * Target CPUs spinning on a lock held by this CPU handle the request from
+ * spinlock_acquire(), so this may be called with spinlocks held.
+ *
+ * @param mask the mask of CPUs to send the range to
+ * @param cpu the index of the current CPU
+ * @param start the start of the range
+ * @param end the end of the range
+ */
+
+static void
+shootdown (unsigned long mask, unsigned int cpu, uintptr_t start,
+	   uintptr_t end)
+{
+  unsigned int i;
+  while (__atomic_test_and_set (&shootdown_lock, __ATOMIC_ACQUIRE))
+    shootdown_handle (cpu);
+
+  shootdown_range.start = start;
+  shootdown_range.end = end;
+  for (i = 0; i < local_apic_count; i++)
+    {
+      if (!(mask & (1UL << i)))
+	continue;
+      __atomic_add_fetch (&shootdown_pending, 1, __ATOMIC_RELAXED);
+      __atomic_store_n (&shootdown_requested[i], 1, __ATOMIC_RELEASE);
+      local_apic_int (INT_TLB_SHOOTDOWN, local_apics[i], APIC_MODE_FIXED, 0,
+		      0);
+    }
+  while (__atomic_load_n (&shootdown_pending, __ATOMIC_ACQUIRE))
+    ;
+  __atomic_clear (&shootdown_lock, __ATOMIC_RELEASE);
+}
+
+#endif
+
+/*!
+ * Records that the current CPU switched to running a thread of another
+ * process. The mask of CPUs running each process determines which CPUs
+ * must be interrupted when one of its mappings changes. CPUs that stopped
+ * running the process do not need to be interrupted, since their TLB
+ * entries of the process are flushed before they run it again.
+ *
+ * @param prev the process of the previous thread
+ * @param next the process of the next thread
+ */
+
+void
+vm_tlb_switch (struct process *prev, struct process *next)
+{
+#ifdef ENABLE_SMP
+  unsigned long bit;
+  if (prev == next)
+    return;
+  bit = 1UL << smp_cpu_index ();
+  __atomic_and_fetch (&prev->cpus, ~bit, __ATOMIC_SEQ_CST);
+  __atomic_or_fetch (&next->cpus, bit, __ATOMIC_SEQ_CST);
+  if (!(sched_cpus & bit))
+    __atomic_or_fetch (&sched_cpus, bit, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/*!
+ * Invalidates a range of virtual memory in the TLBs of all threads and
+ * CPUs sharing it, after it has been invalidated in the current TLB.
+ * Threads that are not running flush their TLB entries when they are next
+ * switched to. CPUs running a thread that shares the range are sent the
+ * range in one batch. This may be called with spinlocks held.
+ *
+ * @param start the start of the range
+ * @param end the end of the range
+ */
+
+void
+vm_tlb_update (uintptr_t start, uintptr_t end)
+{
+#ifdef ENABLE_SMP
+  unsigned long mask;
+  unsigned int cpu;
+#endif
+  if (vm_pcid_enabled)
+    vm_pcid_update (start);
+
+#ifdef ENABLE_SMP
+  if (start < USER_MEM_TOP_VMA)
+    {
+      struct thread *parent = THIS_PROCESS->vfork_parent;
+      mask = THIS_PROCESS->cpus;
+      if (parent && parent->process)
+	mask |= parent->process->cpus;
+    }
+  else if (PML4T_INDEX (start) == PML4T_INDEX (THREAD_LOCAL_BASE_VMA))
+    return;
+  else
+    mask = sched_cpus;
+
+  /* The current CPU is always in the mask */
+  if (!(mask & (mask - 1)))
+    return;
+  cpu = smp_cpu_index ();
+  mask &= ~(1UL << cpu);
+  if (mask)
+    shootdown (mask, cpu, start, end);
+#endif
+}
+
+/*!
+ * Handles a TLB shootdown sent to the current CPU, if there is one. This is
+ * called while spinning on a lock, so a CPU with interrupts disabled still
+ * acknowledges shootdowns from the CPU holding the lock.
+ */
+
+void
+vm_tlb_poll (void)
+{
+#ifdef ENABLE_SMP
+  if (shootdown_pending)
+    shootdown_handle (smp_cpu_index ());
+#endif
+}
+
+/*!
+ * Invalidates a range of virtual memory changed in the address space of
+ * any process, and empties the range. The current process is handled like
+ * vm_flush_tlb(). Threads of another process flush their TLB entries when
+ * they are next switched to, and CPUs running one of them are sent the
+ * range.
+ *
+ * @param process the process whose address space was changed
+ * @param flush the range to invalidate
+ */
+
+void
+vm_tlb_flush_process (struct process *process, struct vm_flush *flush)
+{
+#ifdef ENABLE_SMP
+  unsigned long mask;
+  unsigned int cpu;
+#endif
+  if (process == THIS_PROCESS)
+    {
+      vm_flush_tlb (flush);
+      return;
+    }
+  if (flush->start == flush->end)
+    return;
+  __atomic_add_fetch (&process->tlb_gen, 1, __ATOMIC_SEQ_CST);
+
+#ifdef ENABLE_SMP
+  cpu = smp_cpu_index ();
+  mask = process->cpus & ~(1UL << cpu);
+  if (mask)
+    shootdown (mask, cpu, flush->start, flush->end);
+#endif
+  flush->start = 0;
+  flush->end = 0;
+}
+
+/*!
+ * Handles a request from another CPU to invalidate a range in the TLB.
+ */
+
+void
+int_tlb_shootdown (void)
+{
+#ifdef ENABLE_SMP
+  shootdown_handle (smp_cpu_index ());
+  local_apic_eoi ();
+#endif
+}
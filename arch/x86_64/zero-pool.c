@@ -0,0 +1,126 @@
+/* zero-pool.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/alloc.h>
+#include <pml/interrupt.h>
+#include <pml/lock.h>
+#include <pml/memory.h>
+#include <pml/panic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static lock_t zero_pool_lock;
+
+/*! Pool of page frames that have already been zeroed */
+struct zero_pool zero_pool;
+
+/*!
+ * Physical address of a page frame that is always filled with zeros. It is
+ * mapped read-only into anonymous memory that has been read but never
+ * written to.
+ */
+
+uintptr_t zero_page;
+
+/*!
+ * Allocates a page frame filled with zeros. A page frame is taken from the
+ * pre-zeroed page pool if possible, otherwise a new page frame is allocated
+ * and zeroed before returning.
+ *
+ * @return the physical address of the new page frame, or 0 if the allocation
+ * failed
+ */
+
+uintptr_t
+alloc_zeroed_page (void)
+{
+  uintptr_t page = 0;
+  unsigned long flags = int_save_disable ();
+  spinlock_acquire (&zero_pool_lock);
+  if (zero_pool.count)
+    {
+      page = zero_pool.pages[--zero_pool.count];
+      zero_pool.hits++;
+    }
+  else
+    zero_pool.misses++;
+  spinlock_release (&zero_pool_lock);
+  int_restore (flags);
+  if (page)
+    return page;
+
+  page = alloc_page ();
+  if (UNLIKELY (!page))
+    return 0;
+  memset ((void *) PHYS_REL (page), 0, PAGE_SIZE);
+  return page;
+}
+
+/*!
+ * Zeroes a batch of free page frames and adds them to the pre-zeroed page
+ * pool. This function is called by the kernel process while it has nothing
+ * else to do. The pool is not refilled while free memory is low, since the
+ * page frames in it are unavailable to other allocations.
+ */
+
+void
+zero_pool_refill (void)
+{
+  size_t i;
+  for (i = 0; i < ZERO_POOL_BATCH; i++)
+    {
+      unsigned long flags;
+      uintptr_t page;
+      if (zero_pool.count >= ZERO_POOL_SIZE
+	  || phys_free_pages < ZERO_POOL_MIN_FREE)
+	break;
+      page = alloc_page ();
+      if (UNLIKELY (!page))
+	break;
+      clear_page_nt ((void *) PHYS_REL (page));
+
+      flags = int_save_disable ();
+      spinlock_acquire (&zero_pool_lock);
+      if (zero_pool.count < ZERO_POOL_SIZE)
+	{
+	  zero_pool.pages[zero_pool.count++] = page;
+	  zero_pool.refills++;
+	  page = 0;
+	}
+      spinlock_release (&zero_pool_lock);
+      int_restore (flags);
+      if (page)
+	{
+	  free_page (page);
+	  break;
+	}
+    }
+}
+
+/*!
+ * Allocates the shared zero page. The page frame keeps an extra reference
+ * so it is never freed when unmapped from an address space.
+ */
+
+void
+init_zero_page (void)
+{
+  zero_page = alloc_zeroed_page ();
+  if (UNLIKELY (!zero_page))
+    panic ("Failed to allocate zero page");
+}
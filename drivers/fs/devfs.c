@@ -16,6 +16,7 @@
 
 /*! @file */
 
+#include <pml/alloc.h>
 #include <pml/ata.h>
 #include <pml/devfs.h>
 #include <pml/device.h>
@@ -78,6 +79,10 @@ devfs_lookup (struct vnode **result, struct vnode *dir, const char *name)
     return -1;
   if (!strcmp (name, "fd"))
     vp->ino = DEVFS_FD_INO;
+  else if (!strcmp (name, "meminfo"))
+    vp->ino = DEVFS_MEMINFO_INO;
+  else if (!strcmp (name, "heapinfo"))
+    vp->ino = DEVFS_HEAPINFO_INO;
   else
     {
       struct device *device = strmap_lookup (device_name_map, name);
@@ -109,8 +114,13 @@ ssize_t
 devfs_read (struct vnode *vp, void *buffer, size_t len, off_t offset)
 {
   static lock_t lock;
-  struct device *device = hashmap_lookup (device_num_map, vp->rdev);
+  struct device *device;
   int block = !(vp->flags & VN_FLAG_NO_BLOCK);
+  if (vp->ino == DEVFS_MEMINFO_INO)
+    return meminfo_read (buffer, len, offset);
+  if (vp->ino == DEVFS_HEAPINFO_INO)
+    return heapinfo_read (buffer, len, offset);
+  device = hashmap_lookup (device_num_map, vp->rdev);
   if (!device)
     RETV_ERROR (ENOENT, -1);
   if (device->type == DEVICE_TYPE_BLOCK)
@@ -214,6 +224,18 @@ devfs_readdir (struct vnode *dir, struct dirent *dirent, off_t offset)
 	    strcpy (dirent->d_name, "fd");
 	    return DEVFS_SPECIAL_INO + 1;
 	  case DEVFS_SPECIAL_INO + 1:
+	    dirent->d_ino = DEVFS_MEMINFO_INO;
+	    dirent->d_type = DT_REG;
+	    dirent->d_namlen = 7;
+	    strcpy (dirent->d_name, "meminfo");
+	    return DEVFS_SPECIAL_INO + 2;
+	  case DEVFS_SPECIAL_INO + 2:
+	    dirent->d_ino = DEVFS_HEAPINFO_INO;
+	    dirent->d_type = DT_REG;
+	    dirent->d_namlen = 8;
+	    strcpy (dirent->d_name, "heapinfo");
+	    return DEVFS_SPECIAL_INO + 3;
+	  case DEVFS_SPECIAL_INO + 3:
 	    return 0;
 	  case 0:
 	    for (i = 0; i < device_num_map->bucket_count; i++)
@@ -322,6 +344,15 @@ devfs_fill (struct vnode *vp)
       vp->blocks = 0;
       vp->blksize = PAGE_SIZE;
       break;
+    case DEVFS_MEMINFO_INO:
+    case DEVFS_HEAPINFO_INO:
+      vp->mode = DEVFS_INFO_FILE_MODE;
+      vp->nlink = 1;
+      vp->rdev = 0;
+      vp->size = 0;
+      vp->blocks = 0;
+      vp->blksize = PAGE_SIZE;
+      break;
     default:
       if (!(vp->ino >> 32))
 	{
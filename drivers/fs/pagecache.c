@@ -0,0 +1,548 @@
+/* pagecache.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/alloc.h>
+#include <pml/interrupt.h>
+#include <pml/lock.h>
+#include <pml/memory.h>
+#include <pml/vfs.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*!
+ * Represents a range of a file with dirty cached pages waiting to be written
+ * back by the background flusher.
+ */
+
+struct writeback
+{
+  struct vnode *vp;             /*!< Vnode of the file */
+  off_t offset;                 /*!< Offset in the file of the range */
+  size_t len;                   /*!< Number of bytes in the range */
+  struct writeback *next;       /*!< Next queued range */
+};
+
+/*!
+ * State of a pass over the page caches of all vnodes to free pages that
+ * have not been used recently.
+ */
+
+struct cache_shrink
+{
+  size_t evict[RECLAIM_BATCH];  /*!< Indices of pages to free in a vnode */
+  size_t count;                 /*!< Number of pages to free in a vnode */
+  size_t freed;                 /*!< Number of pages freed so far */
+  size_t target;                /*!< Number of pages to free */
+};
+
+static struct writeback *writeback_queue;
+static lock_t writeback_lock;
+
+/*!
+ * Determines the number of bytes of file data stored in a cached page.
+ *
+ * @param vp the vnode
+ * @param index the index of the page in the file
+ * @return the number of bytes, which is zero if the page is past the end
+ * of the file
+ */
+
+static size_t
+vnode_page_len (struct vnode *vp, size_t index)
+{
+  size_t offset = index * PAGE_SIZE;
+  if (offset >= vp->size)
+    return 0;
+  return vp->size - offset < PAGE_SIZE ? vp->size - offset : PAGE_SIZE;
+}
+
+/*!
+ * Marks a cached page as recently used, so the next pass of the page cache
+ * shrinker does not free it.
+ *
+ * @param page the physical address of the page frame
+ */
+
+static inline void
+vnode_touch_page (uintptr_t page)
+{
+  __atomic_fetch_or (&phys_alloc_table[page / PAGE_SIZE].flags,
+		     PAGE_META_REFERENCED, __ATOMIC_RELAXED);
+}
+
+/*!
+ * Writes a cached page back to its file if it is marked dirty.
+ *
+ * @param vp the vnode
+ * @param index the index of the page in the file
+ * @param page the physical address of the page frame
+ * @return zero on success
+ */
+
+static int
+vnode_write_page (struct vnode *vp, size_t index, uintptr_t page)
+{
+  struct page_meta *meta = phys_alloc_table + page / PAGE_SIZE;
+  size_t len = vnode_page_len (vp, index);
+  if (!(__atomic_fetch_and (&meta->flags, ~PAGE_META_DIRTY, __ATOMIC_ACQ_REL)
+	& PAGE_META_DIRTY))
+    return 0;
+  if (!len)
+    return 0;
+  if (vp->ops->write (vp, (void *) PHYS_REL (page), len,
+		      index * PAGE_SIZE) < 0)
+    {
+      /* Keep the page dirty so writing it can be retried */
+      __atomic_fetch_or (&meta->flags, PAGE_META_DIRTY, __ATOMIC_ACQ_REL);
+      return -1;
+    }
+  return 0;
+}
+
+/*!
+ * Callback function for writing back and freeing the page cache of a vnode
+ * that is being deallocated.
+ *
+ * @param key the index of the page in the file
+ * @param value the physical address of the page frame
+ * @param data the vnode
+ */
+
+static void
+vnode_release_page (unsigned long key, void *value, void *data)
+{
+  struct vnode *vp = data;
+  if (vp->ops->write)
+    vnode_write_page (vp, key, (uintptr_t) value);
+  free_page ((uintptr_t) value);
+}
+
+/*!
+ * Looks up a page of file data in the page cache of a vnode. If the page
+ * is not cached, it is read from the file and added to the page cache.
+ * The page cache holds one reference to the page frame, so callers mapping
+ * the page frame into an address space must add their own reference.
+ *
+ * @param vp the vnode
+ * @param index the index of the page in the file
+ * @return the physical address of the page frame, or 0 on failure
+ */
+
+uintptr_t
+vnode_get_page (struct vnode *vp, size_t index)
+{
+  uintptr_t page;
+  size_t len;
+  if (!vp->ops->read)
+    RETV_ERROR (ENOTSUP, 0);
+  if (!vp->pages)
+    {
+      vp->pages = hashmap_create ();
+      if (UNLIKELY (!vp->pages))
+	return 0;
+    }
+  page = (uintptr_t) hashmap_lookup (vp->pages, index);
+  if (page)
+    {
+      vnode_touch_page (page);
+      return page;
+    }
+
+  len = vnode_page_len (vp, index);
+  if (!len)
+    RETV_ERROR (ENXIO, 0);
+  page = alloc_zeroed_page ();
+  if (UNLIKELY (!page))
+    RETV_ERROR (ENOMEM, 0);
+  if (vp->ops->read (vp, (void *) PHYS_REL (page), len,
+		     index * PAGE_SIZE) < 0
+      || hashmap_insert (vp->pages, index, (void *) page))
+    {
+      free_page (page);
+      return 0;
+    }
+  vnode_touch_page (page);
+  return page;
+}
+
+/*!
+ * Reads file data through the page cache of a vnode. Data in cached pages
+ * is copied from the page cache, since it may be newer than the data in
+ * the file. The rest of the data is read from the file directly.
+ *
+ * @param vp the vnode
+ * @param buffer the buffer to store the data read
+ * @param len the number of bytes to read
+ * @param offset the offset in the file to start reading from
+ * @return the number of bytes read, or -1 on failure
+ */
+
+ssize_t
+vnode_read_pages (struct vnode *vp, void *buffer, size_t len, off_t offset)
+{
+  char *ptr = buffer;
+  size_t start = offset;
+  size_t end;
+  size_t uncached = start;
+  if (start >= vp->size)
+    return 0;
+  end = vp->size - start < len ? vp->size : start + len;
+
+  while (start < end)
+    {
+      size_t next = ALIGN_DOWN (start, PAGE_SIZE) + PAGE_SIZE;
+      uintptr_t page =
+	(uintptr_t) hashmap_lookup (vp->pages, start / PAGE_SIZE);
+      if (next > end)
+	next = end;
+      if (page)
+	{
+	  /* Read the uncached data before this page from the file */
+	  if (uncached < start
+	      && vp->ops->read (vp, ptr + uncached - offset, start - uncached,
+				uncached) < 0)
+	    return -1;
+	  memcpy (ptr + start - offset,
+		  (void *) (PHYS_REL (page) + (start & (PAGE_SIZE - 1))),
+		  next - start);
+	  uncached = next;
+	}
+      start = next;
+    }
+  if (uncached < end
+      && vp->ops->read (vp, ptr + uncached - offset, end - uncached,
+			uncached) < 0)
+    return -1;
+  return end - offset;
+}
+
+/*!
+ * Copies data written to a file into any cached pages it overlaps, so
+ * memory mappings of the file see the new data.
+ *
+ * @param vp the vnode
+ * @param buffer the data that was written
+ * @param len the number of bytes written
+ * @param offset the offset in the file the data was written to
+ */
+
+void
+vnode_update_pages (struct vnode *vp, const void *buffer, size_t len,
+		    off_t offset)
+{
+  const char *ptr = buffer;
+  size_t start = offset;
+  size_t end = start + len;
+  while (start < end)
+    {
+      size_t next = ALIGN_DOWN (start, PAGE_SIZE) + PAGE_SIZE;
+      uintptr_t page =
+	(uintptr_t) hashmap_lookup (vp->pages, start / PAGE_SIZE);
+      if (next > end)
+	next = end;
+      if (page)
+	memcpy ((void *) (PHYS_REL (page) + (start & (PAGE_SIZE - 1))),
+		ptr + start - offset, next - start);
+      start = next;
+    }
+}
+
+/*!
+ * Writes the cached pages of a file that are marked dirty back to the
+ * file. Only pages overlapping the given range of the file are written.
+ *
+ * @param vp the vnode
+ * @param offset the offset in the file of the start of the range
+ * @param len the number of bytes in the range
+ * @return zero on success
+ */
+
+int
+vnode_write_pages (struct vnode *vp, off_t offset, size_t len)
+{
+  size_t index;
+  size_t end;
+  int ret = 0;
+  if (!vp->pages || !vp->ops->write)
+    return 0;
+  end = ALIGN_UP (offset + len, PAGE_SIZE) / PAGE_SIZE;
+  for (index = offset / PAGE_SIZE; index < end; index++)
+    {
+      uintptr_t page = (uintptr_t) hashmap_lookup (vp->pages, index);
+      if (page && vnode_write_page (vp, index, page))
+	ret = -1;
+    }
+  return ret;
+}
+
+/*!
+ * Removes cached pages past the end of a file after it has been truncated.
+ * The part of the last page past the end of the file is cleared.
+ *
+ * @param vp the vnode
+ * @param old_size the size of the file before it was truncated
+ */
+
+void
+vnode_truncate_pages (struct vnode *vp, size_t old_size)
+{
+  size_t index = ALIGN_UP (vp->size, PAGE_SIZE) / PAGE_SIZE;
+  size_t end = ALIGN_UP (old_size, PAGE_SIZE) / PAGE_SIZE;
+  uintptr_t page;
+  if (vp->size & (PAGE_SIZE - 1))
+    {
+      page = (uintptr_t) hashmap_lookup (vp->pages, vp->size / PAGE_SIZE);
+      if (page)
+	memset ((void *) (PHYS_REL (page) + (vp->size & (PAGE_SIZE - 1))), 0,
+		PAGE_SIZE - (vp->size & (PAGE_SIZE - 1)));
+    }
+  for (; index < end; index++)
+    {
+      page = (uintptr_t) hashmap_lookup (vp->pages, index);
+      if (page)
+	{
+	  hashmap_remove (vp->pages, index);
+	  free_page (page);
+	}
+    }
+}
+
+/*!
+ * Writes back all dirty pages in the page cache of a vnode and frees the
+ * page cache. Page frames still mapped into an address space remain
+ * allocated until they are unmapped.
+ *
+ * @param vp the vnode
+ */
+
+void
+vnode_free_pages (struct vnode *vp)
+{
+  if (!vp->pages)
+    return;
+  hashmap_iterate (vp->pages, vnode_release_page, vp);
+  hashmap_free (vp->pages, NULL);
+  vp->pages = NULL;
+}
+
+/*!
+ * Reads pages of a file into its page cache ahead of their use. Reading
+ * stops at the end of the file or at the first page that fails to be read.
+ *
+ * @param vp the vnode
+ * @param offset the offset in the file of the start of the range
+ * @param len the number of bytes in the range
+ */
+
+void
+vnode_readahead (struct vnode *vp, off_t offset, size_t len)
+{
+  size_t index;
+  size_t end = ALIGN_UP (offset + len, PAGE_SIZE) / PAGE_SIZE;
+  for (index = offset / PAGE_SIZE; index < end; index++)
+    {
+      if (!vnode_get_page (vp, index))
+	break;
+    }
+}
+
+/*!
+ * Removes cached pages of a file that are no longer needed. Only clean
+ * pages fully inside the range that are not mapped into any address space
+ * are removed.
+ *
+ * @param vp the vnode
+ * @param offset the offset in the file of the start of the range
+ * @param len the number of bytes in the range
+ */
+
+void
+vnode_drop_pages (struct vnode *vp, off_t offset, size_t len)
+{
+  size_t index = ALIGN_UP (offset, PAGE_SIZE) / PAGE_SIZE;
+  size_t end = (offset + len) / PAGE_SIZE;
+  if (!vp->pages)
+    return;
+  for (; index < end; index++)
+    {
+      uintptr_t page = (uintptr_t) hashmap_lookup (vp->pages, index);
+      struct page_meta *meta;
+      if (!page)
+	continue;
+      meta = phys_alloc_table + page / PAGE_SIZE;
+      if (meta->count == 1 && !(meta->flags & PAGE_META_DIRTY))
+	{
+	  hashmap_remove (vp->pages, index);
+	  free_page (page);
+	}
+    }
+}
+
+/*!
+ * Callback function for choosing the cached pages of a vnode to free. Clean
+ * pages not mapped into any address space are chosen if they were not used
+ * since the last pass, and the rest of the unmapped pages are marked unused.
+ *
+ * @param key the index of the page in the file
+ * @param value the physical address of the page frame
+ * @param data the state of the shrinker pass
+ */
+
+static void
+vnode_age_page (unsigned long key, void *value, void *data)
+{
+  struct cache_shrink *shrink = data;
+  struct page_meta *meta = phys_alloc_table + (uintptr_t) value / PAGE_SIZE;
+  if (shrink->count >= RECLAIM_BATCH
+      || shrink->freed + shrink->count >= shrink->target
+      || meta->count != 1 || (meta->flags & PAGE_META_DIRTY))
+    return;
+  if (__atomic_fetch_and (&meta->flags, ~PAGE_META_REFERENCED,
+			  __ATOMIC_RELAXED) & PAGE_META_REFERENCED)
+    return;
+  shrink->evict[shrink->count++] = key;
+}
+
+/*!
+ * Callback function for freeing unused pages in the page cache of a vnode.
+ *
+ * @param key the inode number of the vnode
+ * @param value the vnode
+ * @param data the state of the shrinker pass
+ */
+
+static void
+vnode_shrink_pages (unsigned long key, void *value, void *data)
+{
+  struct cache_shrink *shrink = data;
+  struct vnode *vp = value;
+  size_t i;
+  if (!vp->pages || shrink->freed >= shrink->target)
+    return;
+  shrink->count = 0;
+  hashmap_iterate (vp->pages, vnode_age_page, shrink);
+  for (i = 0; i < shrink->count; i++)
+    {
+      uintptr_t page =
+	(uintptr_t) hashmap_lookup (vp->pages, shrink->evict[i]);
+      hashmap_remove (vp->pages, shrink->evict[i]);
+      free_page (page);
+    }
+  shrink->freed += shrink->count;
+}
+
+/*!
+ * Frees clean pages of the page caches of all files that are not mapped
+ * into any address space. The page caches are aged like a clock: a page
+ * used since the previous pass is given a second chance, and is only
+ * freed if it is still unused on the next pass.
+ *
+ * @param target the number of page frames to free
+ * @return the number of page frames freed
+ */
+
+size_t
+vnode_shrink_cache (size_t target)
+{
+  struct cache_shrink shrink;
+  size_t i;
+  shrink.freed = 0;
+  shrink.target = target;
+  for (i = 0; i < mount_count && shrink.freed < target; i++)
+    hashmap_iterate (mount_table[i]->vcache, vnode_shrink_pages, &shrink);
+  reclaim_stats.cache_evicted += shrink.freed;
+  return shrink.freed;
+}
+
+/*!
+ * Queues a range of a file to have its dirty cached pages written back by
+ * the background flusher. If the file is already queued, the queued range
+ * is extended to cover the new range. A reference to the vnode is held
+ * until the pages are written.
+ *
+ * @param vp the vnode
+ * @param offset the offset in the file of the start of the range
+ * @param len the number of bytes in the range
+ * @return zero on success
+ */
+
+int
+vnode_queue_writeback (struct vnode *vp, off_t offset, size_t len)
+{
+  struct writeback *wb = malloc (sizeof (struct writeback));
+  struct writeback *curr;
+  unsigned long flags;
+  if (UNLIKELY (!wb))
+    RETV_ERROR (ENOMEM, -1);
+
+  flags = int_save_disable ();
+  spinlock_acquire (&writeback_lock);
+  for (curr = writeback_queue; curr; curr = curr->next)
+    {
+      if (curr->vp == vp)
+	{
+	  off_t end = curr->offset + curr->len > offset + len
+	    ? curr->offset + curr->len : offset + len;
+	  if (offset < curr->offset)
+	    curr->offset = offset;
+	  curr->len = end - curr->offset;
+	  break;
+	}
+    }
+  if (!curr)
+    {
+      REF_ASSIGN (wb->vp, vp);
+      wb->offset = offset;
+      wb->len = len;
+      wb->next = writeback_queue;
+      writeback_queue = wb;
+      wb = NULL;
+    }
+  spinlock_release (&writeback_lock);
+  int_restore (flags);
+  free (wb);
+  return 0;
+}
+
+/*!
+ * Writes back the dirty cached pages of all file ranges queued with
+ * vnode_queue_writeback(). This function is called by the kernel process
+ * while it has nothing else to do.
+ */
+
+void
+vnode_flush_writeback (void)
+{
+  while (1)
+    {
+      struct writeback *wb;
+      unsigned long flags = int_save_disable ();
+      spinlock_acquire (&writeback_lock);
+      wb = writeback_queue;
+      if (wb)
+	writeback_queue = wb->next;
+      spinlock_release (&writeback_lock);
+      int_restore (flags);
+      if (!wb)
+	break;
+      vnode_write_pages (wb->vp, wb->offset, wb->len);
+      UNREF_OBJECT (wb->vp);
+      free (wb);
+    }
+}
@@ -205,7 +205,10 @@ pipe_dealloc (struct vnode *vp)
       void *addr;
       spinlock_acquire (&pipe_lock);
       for (i = 0, addr = pipe->buffer; i < PIPE_PAGES; i++, addr += PAGE_SIZE)
-	vm_unmap_page (THIS_THREAD->args.pml4t, addr);
+	{
+	  vm_unmap_page (THIS_THREAD->args.pml4t, addr);
+	  vm_clear_page (addr);
+	}
       if ((uintptr_t) pipe->buffer < pipe_addr)
 	pipe_addr = (uintptr_t) pipe->buffer;
       spinlock_release (&pipe_lock);
@@ -321,6 +321,8 @@ sys_read (int fd, void *buffer, size_t len)
   ssize_t ret;
   if (!file)
     return -1;
+  if (file->advice == POSIX_FADV_SEQUENTIAL && S_ISREG (file->vnode->mode))
+    vnode_readahead (file->vnode, file->offset, len + VNODE_READAHEAD_SIZE);
   ret = vfs_read (file->vnode, buffer, len, file->offset);
   if (ret == -1)
     return -1;
@@ -371,6 +373,43 @@ sys_lseek (int fd, off_t offset, int whence)
   return offset;
 }
 
+int
+sys_posix_fadvise (int fd, off_t offset, off_t len, int advice)
+{
+  struct fd *file = file_fd (fd);
+  struct vnode *vp;
+  if (!file)
+    return -1;
+  vp = file->vnode;
+  if (S_ISFIFO (vp->mode))
+    RETV_ERROR (ESPIPE, -1);
+  if (offset < 0 || len < 0)
+    RETV_ERROR (EINVAL, -1);
+  if (!len)
+    len = (size_t) offset < vp->size ? vp->size - offset : 0;
+
+  switch (advice)
+    {
+    case POSIX_FADV_NORMAL:
+    case POSIX_FADV_RANDOM:
+    case POSIX_FADV_SEQUENTIAL:
+    case POSIX_FADV_NOREUSE:
+      file->advice = advice;
+      return 0;
+    case POSIX_FADV_WILLNEED:
+      if (S_ISREG (vp->mode))
+	vnode_readahead (vp, offset, len);
+      return 0;
+    case POSIX_FADV_DONTNEED:
+      if (vnode_write_pages (vp, offset, len))
+	return -1;
+      vnode_drop_pages (vp, offset, len);
+      return 0;
+    default:
+      RETV_ERROR (EINVAL, -1);
+    }
+}
+
 int
 sys_stat (const char *path, struct stat *st)
 {
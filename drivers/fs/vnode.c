@@ -20,6 +20,10 @@
 #include <pml/vfs.h>
 #include <errno.h>
 
+/*! Object cache for vnodes */
+struct kmem_cache vnode_cache =
+  KMEM_CACHE_INIT ("vnode", sizeof (struct vnode), NULL);
+
 /*!
  * Allocates an empty vnode.
  *
@@ -30,7 +34,7 @@ struct vnode *
 vnode_alloc (void)
 {
   struct vnode *vp;
-  ALLOC_OBJECT (vp, vfs_dealloc);
+  ALLOC_OBJECT_CACHE (vp, &vnode_cache, vfs_dealloc);
   if (UNLIKELY (!vp))
     return NULL;
   vp->children = strmap_create ();
@@ -94,10 +94,11 @@ vfs_read (struct vnode *vp, void *buffer, size_t len, off_t offset)
     RETV_ERROR (EISDIR, -1);
   if (!len)
     return 0;
-  if (vp->ops->read)
-    return vp->ops->read (vp, buffer, len, offset);
-  else
+  if (!vp->ops->read)
     RETV_ERROR (ENOTSUP, -1);
+  if (vp->pages)
+    return vnode_read_pages (vp, buffer, len, offset);
+  return vp->ops->read (vp, buffer, len, offset);
 }
 
 /*!
@@ -113,16 +114,19 @@ vfs_read (struct vnode *vp, void *buffer, size_t len, off_t offset)
 ssize_t
 vfs_write (struct vnode *vp, const void *buffer, size_t len, off_t offset)
 {
+  ssize_t ret;
   if (!vfs_can_read (vp, 0))
     return -1;
   if (S_ISDIR (vp->mode))
     RETV_ERROR (EISDIR, -1);
   if (!len)
     return 0;
-  if (vp->ops->write)
-    return vp->ops->write (vp, buffer, len, offset);
-  else
+  if (!vp->ops->write)
     RETV_ERROR (ENOTSUP, -1);
+  ret = vp->ops->write (vp, buffer, len, offset);
+  if (ret > 0 && vp->pages)
+    vnode_update_pages (vp, buffer, ret, offset);
+  return ret;
 }
 
 /*!
@@ -137,6 +141,8 @@ vfs_sync (struct vnode *vp)
 {
   if (!vfs_can_write (vp, 0))
     return -1;
+  if (vnode_write_pages (vp, 0, vp->size))
+    return -1;
   if (vp->ops->sync)
     return vp->ops->sync (vp);
   else
@@ -427,14 +433,18 @@ vfs_readlink (struct vnode *vp, char *buffer, size_t len)
 int
 vfs_truncate (struct vnode *vp, off_t len)
 {
+  size_t old_size = vp->size;
   if (!vfs_can_write (vp, 0))
     return -1;
   if (!S_ISREG (vp->mode))
     RETV_ERROR (EINVAL, -1);
-  if (vp->ops->truncate)
-    return vp->ops->truncate (vp, len);
-  else
+  if (!vp->ops->truncate)
     RETV_ERROR (ENOTSUP, -1);
+  if (vp->ops->truncate (vp, len))
+    return -1;
+  if (vp->pages)
+    vnode_truncate_pages (vp, old_size);
+  return 0;
 }
 
 /*!
@@ -523,6 +533,7 @@ vfs_fill (struct vnode *vp)
 void
 vfs_dealloc (struct vnode *vp)
 {
+  vnode_free_pages (vp);
   if (vp->children)
     strmap_free (vp->children, vnode_unref);
   UNREF_OBJECT (vp->parent);
@@ -530,5 +541,5 @@ vfs_dealloc (struct vnode *vp)
     vnode_remove_cache (vp);
   if (vp->ops->dealloc)
     vp->ops->dealloc (vp);
-  free (vp);
+  kmem_cache_free (&vnode_cache, vp);
 }
@@ -23,8 +23,12 @@
  */
 
 #include <pml/cdefs.h>
+#include <pml/lock.h>
 #include <pml/types.h>
 
+/*! Size of buffer used to generate memory statistics reports */
+#define MEMINFO_BUFFER_SIZE     4096
+
 /* Kernel heap definitions */
 
 /*! Must be in @ref kh_header.magic */
@@ -35,8 +39,65 @@
 #define KH_DEFAULT_ALIGN        16
 /*! Minimum size of block to split during allocations */
 #define KH_MIN_BLOCK_SPLIT_SIZE 32
+/*! Size of the header and tail around each kernel heap block */
+#define KH_BLOCK_OVERHEAD       (sizeof (struct kh_header)	\
+				 + sizeof (struct kh_tail))
+/*! Number of second-level size classes in each first-level class */
+#define KH_SL_COUNT             16
+/*! Number of first-level size classes of free blocks */
+#define KH_FL_COUNT             48
+/*! Free blocks smaller than this size are in exact size classes */
+#define KH_SMALL_SIZE           (KH_SL_COUNT * KH_DEFAULT_ALIGN)
+
+/*! The kernel heap grows by a multiple of this many bytes */
+#define KH_GROW_SIZE            0x200000
+/*! Allocations of at least this many bytes are made with vmalloc() */
+#define KH_LARGE_SIZE           0x4000
+
+/*! Number of size classes of blocks cached in magazines */
+#define KH_MAGAZINE_CLASSES     16
+/*! Largest block size cached in magazines */
+#define KH_MAGAZINE_MAX_SIZE    (KH_MAGAZINE_CLASSES * KH_DEFAULT_ALIGN)
+/*! Number of blocks held by a full magazine */
+#define KH_MAGAZINE_ROUNDS      16
+/*! Number of full magazines kept in the depot for each size class */
+#define KH_DEPOT_MAX_FULL       8
 
 #define KH_FLAG_ALLOC           (1 << 0)    /*!< Block is allocated */
+#define KH_FLAG_CACHED          (1 << 1)    /*!< Block is in a magazine */
+/*! Shift of the call site tag in the flags of an allocated block */
+#define KH_FLAG_TAG_SHIFT       16
+/*! Mask of the call site tag in the flags of an allocated block */
+#define KH_FLAG_TAG_MASK        (0xffffU << KH_FLAG_TAG_SHIFT)
+
+/* Kernel heap accounting definitions */
+
+/*! Number of call sites tracked by kernel heap accounting */
+#define HEAPINFO_CALLERS        512
+/*! Number of power of two size classes in the allocation histogram */
+#define HEAPINFO_CLASSES        24
+/*! Number of call sites listed in kernel heap reports */
+#define HEAPINFO_TOP_CALLERS    32
+/*! Size of buffer used to generate kernel heap reports */
+#define HEAPINFO_BUFFER_SIZE    8192
+
+/* Object cache definitions */
+
+/*! Smallest number of objects a slab should hold */
+#define KMEM_MIN_OBJECTS        8
+/*! Largest order of the page frame blocks used as slabs */
+#define KMEM_MAX_ORDER          3
+
+/*!
+ * Initializer for a statically allocated object cache. The slab layout is
+ * computed when the first object is allocated.
+ *
+ * @param n the name of the cache
+ * @param s the size of each object
+ * @param c the constructor to run on new objects, or NULL
+ */
+
+#define KMEM_CACHE_INIT(n, s, c) { .name = (n), .size = (s), .ctor = (c) }
 
 /*!
  * Header for a block in the kernel heap. This structure is placed in front
@@ -62,20 +123,106 @@ struct kh_tail
   struct kh_header *header;     /*!< Pointer to the corresponding header */
 };
 
+/*!
+ * Counters of kernel heap usage. Sizes count the data of blocks, not their
+ * headers and tails. Blocks cached in per-CPU magazines are counted as used.
+ */
+
+struct kh_stats
+{
+  size_t size;                  /*!< Bytes managed by the heap */
+  size_t used;                  /*!< Bytes in allocated blocks */
+  size_t peak;                  /*!< Largest number of bytes used */
+  size_t free;                  /*!< Bytes in free blocks */
+  size_t grown;                 /*!< Bytes added to the heap */
+  size_t grows;                 /*!< Number of times the heap grew */
+};
+
+/*!
+ * Counters of large kernel allocations.
+ */
+
+struct vmalloc_stats
+{
+  size_t areas;                 /*!< Number of allocated areas */
+  size_t pages;                 /*!< Number of pages mapped in areas */
+};
+
+struct kmem_slab;
+
+/*!
+ * Cache of objects of a single size. Objects are allocated from slabs,
+ * blocks of page frames from the physical page frame allocator, and freed
+ * objects are kept in their slab for reuse. If the cache has a constructor,
+ * it is run once on each object when its slab is created, and objects must
+ * be returned to the cache in their constructed state.
+ */
+
+struct kmem_cache
+{
+  const char *name;             /*!< Name shown in memory statistics */
+  size_t size;                  /*!< Size of each object */
+  void (*ctor) (void *);        /*!< Constructor run on new objects */
+  size_t stride;                /*!< Distance between objects in a slab */
+  size_t link;                  /*!< Offset of the free list link */
+  size_t offset;                /*!< Offset of the first object in a slab */
+  size_t count;                 /*!< Number of objects in each slab */
+  unsigned int order;           /*!< Order of the slab blocks */
+  struct kmem_slab *partial;    /*!< Slabs with free objects */
+  struct kmem_slab *empty;      /*!< Slab kept with no allocated objects */
+  size_t slabs;                 /*!< Number of slabs */
+  size_t active;                /*!< Number of allocated objects */
+  lock_t lock;                  /*!< Lock for the cache */
+  struct kmem_cache *next;      /*!< Next cache in the list of caches */
+};
+
 __BEGIN_DECLS
 
+extern struct kh_stats kh_stats;
+extern struct vmalloc_stats vmalloc_stats;
+extern struct kmem_cache *kmem_caches;
+
+uintptr_t alloc_pages (unsigned int order);
+void free_pages (uintptr_t addr, unsigned int order);
+void ref_pages (uintptr_t addr, unsigned int order);
+void split_page (uintptr_t addr, unsigned int order);
 uintptr_t alloc_page (void);
+uintptr_t alloc_zeroed_page (void);
 void ref_page (uintptr_t addr);
+unsigned int page_ref_count (uintptr_t addr);
 void free_page (uintptr_t addr);
+void free_page_cold (uintptr_t addr);
+void page_cache_drain (void);
 void *alloc_virtual_page (void);
 void free_virtual_page (void *ptr);
 
 void kh_init (uintptr_t base, size_t size);
 void *kh_alloc_aligned (size_t size, size_t align);
+size_t kh_alloc_batch (size_t size, void **ptrs, size_t count);
 void *kh_realloc (void *ptr, size_t size);
 void kh_free (void *ptr);
+void kh_free_batch (void **ptrs, size_t count);
+size_t kh_largest_free (int lock);
+
+void *vmalloc (size_t size);
+size_t vmalloc_size (const void *ptr);
+unsigned int vmalloc_tag (const void *ptr);
+void vmalloc_set_tag (void *ptr, unsigned int tag);
+void vfree (void *ptr);
+
+void *kmem_cache_alloc (struct kmem_cache *cache);
+void *kmem_cache_zalloc (struct kmem_cache *cache);
+void kmem_cache_free (struct kmem_cache *cache, void *ptr);
 
 int expand_mmap (uintptr_t *pml4t, void *addr, size_t len);
+int mmap_fault (void *addr, int write);
+
+ssize_t meminfo_read (void *buffer, size_t len, off_t offset);
+
+void heapinfo_alloc (void *ptr, void *caller);
+void heapinfo_free (void *ptr);
+ssize_t heapinfo_read (void *buffer, size_t len, off_t offset);
+void heapinfo_dump (void);
 
 __END_DECLS
 
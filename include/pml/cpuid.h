@@ -84,4 +84,15 @@
 #define CPUID_RDRND             (1 << 30)
 #define CPUID_HYPERVISOR        (1 << 31)
 
+/* Page 7, EBX */
+
+#define CPUID_FSGSBASE          (1 << 0)
+#define CPUID_BMI1              (1 << 3)
+#define CPUID_AVX2              (1 << 5)
+#define CPUID_SMEP              (1 << 7)
+#define CPUID_BMI2              (1 << 8)
+#define CPUID_ERMS              (1 << 9)
+#define CPUID_INVPCID           (1 << 10)
+#define CPUID_SMAP              (1 << 20)
+
 #endif
@@ -29,6 +29,9 @@
 #define CR0_CD                  (1 << 30)
 #define CR0_PG                  (1 << 31)
 
+#define CR3_PCID_MASK           0xfff
+#define CR3_NO_FLUSH            0x8000000000000000
+
 #define CR4_VME                 (1 << 0)
 #define CR4_PVI                 (1 << 1)
 #define CR4_TSD                 (1 << 2)
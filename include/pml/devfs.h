@@ -31,6 +31,10 @@
 #define DEVFS_ROOT_INO          DEVFS_SPECIAL_INO
 /*! Inode of the /dev/fd directory */
 #define DEVFS_FD_INO            (DEVFS_SPECIAL_INO | 1)
+/*! Inode of the /dev/meminfo memory statistics file */
+#define DEVFS_MEMINFO_INO       (DEVFS_SPECIAL_INO | 2)
+/*! Inode of the /dev/heapinfo kernel heap statistics file */
+#define DEVFS_HEAPINFO_INO      (DEVFS_SPECIAL_INO | 3)
 
 /*! Mode of directories in devfs */
 #define DEVFS_DIR_MODE          (S_IFDIR	\
@@ -41,6 +45,12 @@
 				 | S_IROTH	\
 				 | S_IXOTH)
 
+/*! Mode of read-only statistics files in devfs */
+#define DEVFS_INFO_FILE_MODE    (S_IFREG	\
+				 | S_IRUSR	\
+				 | S_IRGRP	\
+				 | S_IROTH)
+
 /*! Mode of block device files in devfs */
 #define DEVFS_BLOCK_DEVICE_MODE (S_IFBLK	\
 				 | S_IRUSR	\
@@ -22,6 +22,7 @@
  * @brief @c ELF file parsing
  */
 
+#include <pml/process.h>
 #include <pml/vfs.h>
 #include <elf.h>
 
@@ -43,9 +44,9 @@ struct elf_exec
 
 __BEGIN_DECLS
 
-int elf_mmap (void *base, size_t len, int prot, struct vnode *vp, size_t filesz,
+int elf_mmap (void *base, size_t len, int prot, struct fd *file, size_t filesz,
 	      off_t offset);
-int elf_load_phdrs (Elf64_Ehdr *ehdr, struct vnode *vp);
+int elf_load_phdrs (Elf64_Ehdr *ehdr, struct fd *file);
 int elf_load_file (struct elf_exec *exec, struct vnode *vp);
 
 __END_DECLS
@@ -52,6 +52,13 @@
 #define SEEK_CUR                1
 #define SEEK_END                2
 
+#define POSIX_FADV_NORMAL       0
+#define POSIX_FADV_RANDOM       1
+#define POSIX_FADV_SEQUENTIAL   2
+#define POSIX_FADV_WILLNEED     3
+#define POSIX_FADV_DONTNEED     4
+#define POSIX_FADV_NOREUSE      5
+
 #define F_DUPFD                 0x4000
 #define F_GETFD                 0x4001
 #define F_SETFD                 0x4002
@@ -0,0 +1,44 @@
+/* lz4.h -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef __PML_LZ4_H
+#define __PML_LZ4_H
+
+/*!
+ * @file
+ * @brief LZ4 block compression
+ */
+
+#include <pml/cdefs.h>
+#include <pml/types.h>
+
+/*! Number of bits in the hash of a 4-byte sequence used to find matches */
+#define LZ4_HASH_BITS           12
+/*! Number of entries in the match table passed to lz4_compress() */
+#define LZ4_HASH_SIZE           (1 << LZ4_HASH_BITS)
+/*! Largest input accepted by lz4_compress() */
+#define LZ4_MAX_INPUT           0xffff
+
+__BEGIN_DECLS
+
+ssize_t lz4_compress (const void *src, size_t len, void *dest, size_t dest_len,
+		      uint16_t *table);
+ssize_t lz4_decompress (const void *src, size_t len, void *dest,
+			size_t dest_len);
+
+__END_DECLS
+
+#endif
@@ -41,6 +41,14 @@
 #define MS_SYNC                 (1 << 1)
 #define MS_INVALIDATE           (1 << 2)
 
+#define MADV_NORMAL             0
+#define MADV_RANDOM             1
+#define MADV_SEQUENTIAL         2
+#define MADV_WILLNEED           3
+#define MADV_DONTNEED           4
+#define MADV_MERGEABLE          12
+#define MADV_UNMERGEABLE        13
+
 #define MREMAP_MAYMOVE          (1 << 0)
 #define MREMAP_FIXED            (1 << 1)
 
@@ -22,6 +22,7 @@
  * @brief Reference-counted objects
  */
 
+#include <pml/alloc.h>
 #include <stdlib.h>
 
 /*!
@@ -46,6 +47,21 @@
   (((x) = calloc (1, sizeof (*(x)))) ?				\
    ((x)->__ref_free = (ff), ++(x)->__ref_count) : 0)
 
+/*!
+ * Allocates a reference-counted object from an object cache and sets its
+ * reference count to one. All other fields in the object are initialized to
+ * zero. The function called when the last reference is removed must return
+ * the object to the cache.
+ *
+ * @param x the object as an lvalue
+ * @param c pointer to the object cache
+ * @param ff function to call when last reference is removed
+ */
+
+#define ALLOC_OBJECT_CACHE(x, c, ff)				\
+  (((x) = kmem_cache_zalloc (c)) ?				\
+   ((x)->__ref_free = (ff), ++(x)->__ref_count) : 0)
+
 /*!
  * Increments the reference count of a pointer to a reference-counted object.
  * The object passed to this macro may be evaluated more than once, so it
@@ -34,6 +34,10 @@
 #define DATA_SEGMENT_MAX        0x10000000000
 /*! Size of per-process kernel-mode stack */
 #define KERNEL_STACK_SIZE       0x100000
+/*! Number of cached pages around a faulting address mapped with it */
+#define MMAP_FAULT_AROUND_PAGES 16
+/*! Number of pages read ahead on faults in sequentially accessed mappings */
+#define MMAP_READAHEAD_PAGES    32
 
 /*! Expands to a pointer to the currently running process */
 #define THIS_PROCESS (process_queue.queue[process_queue.front])
@@ -72,6 +76,7 @@ struct fd
   char *path;                   /*!< Absolute path to file */
   off_t offset;                 /*!< Current file offset */
   int flags;                    /*!< Flags used to open file */
+  int advice;                   /*!< Access pattern advice for reads */
   /*! Number of process file descriptors holding a reference */
   size_t count;
 };
@@ -157,15 +162,26 @@ struct mmap
   int fd;                       /*!< File descriptor number of mapped file */
   off_t offset;                 /*!< File offset corresponding to start */
   int flags;                    /*!< Mapping flags */
+  int advice;                   /*!< Access pattern advice */
+  int mergeable;                /*!< Whether identical pages may be merged */
+  struct mmap *left;            /*!< Subtree of regions at lower addresses */
+  struct mmap *right;           /*!< Subtree of regions at higher addresses */
+  int height;                   /*!< Height of the subtree */
+  uintptr_t low;                /*!< Lowest base address in the subtree */
+  uintptr_t high;               /*!< Highest end address in the subtree */
+  size_t max_gap;               /*!< Largest gap between regions in subtree */
 };
 
 /*!
- * Represents a table of memory regions allocated to a process.
+ * Represents a table of memory regions allocated to a process. The regions
+ * are stored in an AVL tree ordered by base address. Each node also tracks
+ * the largest unmapped gap between the regions in its subtree, so free
+ * areas can be found without visiting every region.
  */
 
 struct mmap_table
 {
-  struct mmap *table;           /*!< Array of memory region structures */
+  struct mmap *root;            /*!< Root of the memory region tree */
   size_t len;                   /*!< Number of memory regions */
 };
 
@@ -201,6 +217,12 @@ struct process
   struct rusage self_rusage;    /*!< Resource usage of process */
   struct rusage child_rusage;   /*!< Resource usage of terminated children */
   struct sigaction sighandlers[NSIG];   /*!< Signal handler array */
+  /*! Incremented when a mapping shared by the threads is invalidated */
+  unsigned long tlb_gen;
+  /*! Mask of CPUs currently running a thread of this process */
+  unsigned long cpus;
+  /*! Thread suspended by vfork until this process calls execve or exits */
+  struct thread *vfork_parent;
 };
 
 /*!
@@ -235,11 +257,20 @@ void free_altprocfd (struct process *process, int fd);
 void fill_fd (int fd, int sysfd, struct vnode *vp, int flags);
 struct fd *file_fd (int fd);
 
+struct mmap *find_region (uintptr_t addr);
+struct mmap *find_region_after (uintptr_t addr);
+int mmap_insert (const struct mmap *region);
+int mmap_table_copy (struct mmap_table *dest, const struct mmap_table *src);
+void mmap_table_free (struct mmap_table *mmaps);
+
 struct process *process_alloc (int priority);
 void process_free (struct process *process);
 void process_exit (unsigned int index, int status);
 int process_enqueue (struct process *process);
 struct process *process_fork (struct thread **t, int copy);
+void process_vfork_release (struct process *process, uintptr_t *pml4t,
+			    struct mmap_table *mmaps);
+void process_vfork_wait (pid_t pid);
 pid_t process_get_pid (struct process *process);
 void process_fill_wait (struct process *process, int mode, int status);
 void process_kill (int mode, int status) __noreturn;
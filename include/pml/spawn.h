@@ -0,0 +1,46 @@
+/* spawn.h -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef __PML_SPAWN_H
+#define __PML_SPAWN_H
+
+/*!
+ * @file
+ * @brief Definitions for spawning processes
+ */
+
+#include <pml/types.h>
+
+#define SPAWN_ACTION_OPEN       0
+#define SPAWN_ACTION_CLOSE      1
+#define SPAWN_ACTION_DUP2       2
+
+/*!
+ * Represents an action performed on the file descriptor table of a spawned
+ * process before its program is loaded.
+ */
+
+struct spawn_action
+{
+  int type;                     /*!< Type of action */
+  int fd;                       /*!< File descriptor to act on */
+  int newfd;                    /*!< Target file descriptor for dup2 */
+  int flags;                    /*!< Flags to open the file with */
+  mode_t mode;                  /*!< Mode of a created file */
+  const char *path;             /*!< Path of the file to open */
+};
+
+#endif
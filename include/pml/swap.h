@@ -0,0 +1,94 @@
+/* swap.h -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef __PML_SWAP_H
+#define __PML_SWAP_H
+
+/*!
+ * @file
+ * @brief Swap space for anonymous memory
+ */
+
+#include <pml/device.h>
+#include <pml/memory.h>
+
+/*! Largest number of address spaces that can share a swap slot */
+#define SWAP_MAX_REFS           0xffff
+
+/*! Set in slot numbers of pages stored in the compressed page pool */
+#define SWAP_SLOT_COMPRESSED    ((size_t) 1 << 36)
+
+/*! Default size of the compressed page pool, as a percentage of memory */
+#define ZSWAP_DEFAULT_PERCENT   20
+/*! Size of the units used to track free space in compressed pool pages */
+#define ZSWAP_CHUNK_SIZE        64
+/*! Number of units of free space in a compressed pool page */
+#define ZSWAP_CHUNKS            (PAGE_SIZE / ZSWAP_CHUNK_SIZE)
+/*! Pages that do not compress below this size are not stored in the pool */
+#define ZSWAP_MAX_LEN           (PAGE_SIZE * 3 / 4)
+
+/*!
+ * Represents the block device used as swap space. The device is divided
+ * into page-sized slots, each holding the contents of one anonymous page.
+ * Slot zero is never allocated, so zero can be used to indicate failure.
+ */
+
+struct swap_space
+{
+  struct block_device *device;  /*!< Block device holding the slots */
+  unsigned short *map;          /*!< Number of references to each slot */
+  size_t slots;                 /*!< Number of slots on the device */
+  size_t used;                  /*!< Number of allocated slots */
+  size_t hint;                  /*!< Slot to start searching for free slots */
+};
+
+/*!
+ * Counters of the compressed page pool and of the time taken to bring
+ * swapped pages back into memory.
+ */
+
+struct zswap_stats
+{
+  size_t stored;                /*!< Number of pages in the pool */
+  size_t stored_bytes;          /*!< Total size of the compressed pages */
+  size_t pool_pages;            /*!< Number of page frames used by the pool */
+  size_t stores;                /*!< Number of pages added to the pool */
+  size_t rejected;              /*!< Number of pages that did not compress */
+  size_t pool_full;             /*!< Number of pages refused for lack of space */
+  size_t loads;                 /*!< Number of pages read from the pool */
+  uint64_t load_ns;             /*!< Nanoseconds spent reading from the pool */
+  size_t disk_loads;            /*!< Number of pages read from the device */
+  uint64_t disk_load_ns;        /*!< Nanoseconds spent reading from the device */
+};
+
+__BEGIN_DECLS
+
+extern struct swap_space swap_space;
+extern struct zswap_stats zswap_stats;
+
+size_t swap_out (const void *page);
+void swap_ref (size_t slot);
+void swap_free (size_t slot);
+int swap_read (size_t slot, void *buffer);
+
+size_t zswap_store (const void *data);
+int zswap_load (size_t slot, void *buffer);
+void zswap_ref (size_t slot);
+void zswap_free (size_t slot);
+
+__END_DECLS
+
+#endif
@@ -36,6 +36,9 @@
 /*! Default permission bits for symbolic links */
 #define SYMLINK_MODE (S_IFLNK | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)
 
+/*! Number of bytes read ahead into the page cache on sequential reads */
+#define VNODE_READAHEAD_SIZE    0x20000
+
 /* Vnode flags */
 
 #define VN_FLAG_NO_BLOCK        (1 << 0)    /*!< Prevent I/O from blocking */
@@ -376,6 +379,7 @@ struct vnode
   struct vnode *parent;         /*!< Parent vnode */
   struct mount *mount;          /*!< Filesystem the vnode is on */
   void *data;                   /*!< Driver-specific private data */
+  struct hashmap *pages;        /*!< Cached pages of file data by index */
 };
 
 /*!
@@ -400,6 +404,7 @@ extern size_t filesystem_count;
 extern size_t mount_count;
 extern struct vnode *root_vnode;
 extern struct mount *devfs;
+extern struct kmem_cache vnode_cache;
 
 int vfs_can_read (struct vnode *vp, int real);
 int vfs_can_write (struct vnode *vp, int real);
@@ -454,6 +459,20 @@ struct vnode *vnode_namei (const char *path, int link_count);
 int vnode_dir_name (const char *path, struct vnode **dir, const char **name);
 struct vnode *vnode_find_mount_point (struct vnode *vp, const char *name);
 
+uintptr_t vnode_get_page (struct vnode *vp, size_t index);
+ssize_t vnode_read_pages (struct vnode *vp, void *buffer, size_t len,
+			  off_t offset);
+void vnode_update_pages (struct vnode *vp, const void *buffer, size_t len,
+			 off_t offset);
+int vnode_write_pages (struct vnode *vp, off_t offset, size_t len);
+void vnode_truncate_pages (struct vnode *vp, size_t old_size);
+void vnode_free_pages (struct vnode *vp);
+void vnode_readahead (struct vnode *vp, off_t offset, size_t len);
+void vnode_drop_pages (struct vnode *vp, off_t offset, size_t len);
+size_t vnode_shrink_cache (size_t target);
+int vnode_queue_writeback (struct vnode *vp, off_t offset, size_t len);
+void vnode_flush_writeback (void);
+
 __END_DECLS
 
 #endif
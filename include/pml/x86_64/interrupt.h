@@ -45,6 +45,12 @@
 /*! Maximum number of CPUs supported for SMP */
 #define MAX_CORES               16
 
+/*! Number of distinct local APIC IDs */
+#define LOCAL_APIC_ID_COUNT     256
+
+/*! Interrupt enable flag in the RFLAGS register */
+#define RFLAGS_IF               (1 << 9)
+
 /*! Physical address of boostrap stack for APs */
 #define SMP_AP_INIT_STACK       0x7ff0
 /*! Physical address of bootstrap GDT for entering long mode */
@@ -61,8 +67,15 @@
 
 #define SMP_AP_LONG_START_ADDR  0x8100
 
+/*! Interrupt vector number of page fault exception */
+#define INT_PAGE_FAULT          0x0e
+/*! Interrupt stack table entry used by the page fault handler */
+#define PAGE_FAULT_IST          1
+
 /*! Interrupt vector number of sigreturn interrupt */
 #define INT_SIGRETURN           0x90
+/*! Interrupt vector number of TLB shootdown interprocessor interrupt */
+#define INT_TLB_SHOOTDOWN       0x91
 
 /*! Number of IRQs handled by an I/O APIC */
 #define IOAPIC_IRQ_COUNT        24
@@ -198,11 +211,41 @@ int_enable (void)
   __asm__ volatile ("sti");
 }
 
+/*!
+ * Disables hardware-generated interrupts and returns the previous state of
+ * the RFLAGS register, to be passed to int_restore().
+ *
+ * @return the previous value of RFLAGS
+ */
+
+__always_inline static inline unsigned long
+int_save_disable (void)
+{
+  unsigned long flags;
+  __asm__ volatile ("pushfq\npop %0\ncli" : "=r" (flags) :: "memory");
+  return flags;
+}
+
+/*!
+ * Re-enables hardware-generated interrupts if they were enabled before
+ * the matching call to int_save_disable().
+ *
+ * @param flags the value returned by int_save_disable()
+ */
+
+__always_inline static inline void
+int_restore (unsigned long flags)
+{
+  if (flags & RFLAGS_IF)
+    int_enable ();
+}
+
 __BEGIN_DECLS
 
 extern apic_id_t bsp_id;
 extern apic_id_t local_apics[MAX_CORES];
 extern size_t local_apic_count;
+extern unsigned char local_apic_indices[LOCAL_APIC_ID_COUNT];
 extern void *local_apic_addr;
 extern apic_id_t ioapic_id;
 extern void *ioapic_addr;
@@ -225,6 +268,7 @@ void ioapic_set_irq (unsigned char irq, uint64_t entry);
 
 void set_int_vector (unsigned char num, void *addr, unsigned char privilege,
 		     unsigned char type);
+void set_int_ist (unsigned char num, unsigned char ist);
 void fill_idt_vectors (void);
 void init_idt (void);
 
@@ -232,6 +276,7 @@ void int_start (void);
 void smp_init (void);
 
 void int_sigreturn (void);
+void int_page_fault_entry (void);
 
 __END_DECLS
 
@@ -265,6 +310,26 @@ ioapic_write (unsigned char reg, unsigned int value)
   ioapic[4] = value;
 }
 
+/*!
+ * Returns the index of the current processor in @ref local_apics. This is
+ * used to select per-CPU data structures, so it only reads the ID register
+ * of the local APIC and looks up the index recorded when the MADT was
+ * parsed. If SMP is disabled or only one processor was found, zero is
+ * returned without accessing the local APIC.
+ *
+ * @return the index of the current processor
+ */
+
+__always_inline static inline unsigned int
+smp_cpu_index (void)
+{
+#ifdef ENABLE_SMP
+  if (local_apic_count > 1)
+    return local_apic_indices[LOCAL_APIC_REG (LOCAL_APIC_REG_ID) >> 24];
+#endif
+  return 0;
+}
+
 #endif /* !__ASSEMBLER__ */
 
 #endif
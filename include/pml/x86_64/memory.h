@@ -38,8 +38,10 @@
  * <td>Thread stack space</td></tr>
  * <tr><td>@c 0xfffffd8000000000</td><td>@c 0xfffffd8fffffffff</td><td>64G</td>
  * <td>Pipe buffer mappings</td></tr>
- * <tr><td>@c 0xfffffd9000000000</td><td>@c 0xfffffdffffffffff</td><td>448G</td>
- * <td>Reserved kernel memory</td></tr>
+ * <tr><td>@c 0xfffffd9000000000</td><td>@c 0xfffffdbfffffffff</td><td>192G</td>
+ * <td>Kernel heap growth</td></tr>
+ * <tr><td>@c 0xfffffdc000000000</td><td>@c 0xfffffdffffffffff</td><td>256G</td>
+ * <td>Large kernel allocations</td></tr>
  * <tr><td>@c 0xfffffe0000000000</td><td>@c 0xffffffffffffffff</td><td>2T</td>
  * <td>Physical memory mappings</td></tr>
  * </table>
@@ -69,6 +71,14 @@
 #define PIPE_BUFFER_BASE_VMA    0xfffffd8000000000
 /*! Top virtual address of pipe buffer area */
 #define PIPE_BUFFER_TOP_VMA     0xfffffd9000000000
+/*! Base virtual address of memory added to the kernel heap */
+#define KERNEL_HEAP_BASE_VMA    0xfffffd9000000000
+/*! Top virtual address of memory added to the kernel heap */
+#define KERNEL_HEAP_TOP_VMA     0xfffffdc000000000
+/*! Base virtual address of large kernel allocations */
+#define VMALLOC_BASE_VMA        0xfffffdc000000000
+/*! Top virtual address of large kernel allocations */
+#define VMALLOC_TOP_VMA         0xfffffe0000000000
 /*! Base of physical memory map */
 #define LOW_PHYSICAL_BASE_VMA   0xfffffe0000000000
 
@@ -85,6 +95,10 @@
 #define SIGINFO_VMA             0xfffffd7fb0000000
 /*! Address of the signal trampoline */
 #define SIGNAL_TRAMPOLINE_VMA   0xfffffd7fb0001000
+/*! Virtual address of the top of the page fault handler stack */
+#define PAGE_FAULT_STACK_TOP_VMA 0xfffffd7fb0100000
+/*! Size of the page fault handler stack */
+#define PAGE_FAULT_STACK_SIZE   0x8000
 
 /* Paging definitions */
 
@@ -107,6 +121,11 @@
 
 #define PAGE_FLAG_SWAP          (1 << 1)  /*!< Fetch page from swap space */
 #define PAGE_FLAG_COW           (1 << 9)  /*!< Copy page on write */
+#define PAGE_FLAG_SHARED        (1 << 10) /*!< Page of a shared file mapping */
+#define PAGE_FLAG_SWAP_RW       (1 << 11) /*!< Swapped out page was writable */
+
+/*! Page flags that are not copied to newly allocated paging structures */
+#define PAGE_LEAF_FLAGS         (PAGE_FLAG_COW | PAGE_FLAG_SHARED)
 
 #define PAGE_ERR_PRESENT        (1 << 0)  /*!< Page-protection violation */
 #define PAGE_ERR_WRITE          (1 << 1)  /*!< Write access */
@@ -121,6 +140,45 @@
 /*! Huge page size (1 gigabyte), used when PDPT.S is set */
 #define HUGE_PAGE_SIZE          0x40000000
 
+/*! Largest block order managed by the physical page frame allocator */
+#define PAGE_MAX_ORDER          10
+/*! Block order of a large page */
+#define LARGE_PAGE_ORDER        9
+
+/*! Number of page frames that can be held in a per-CPU page cache */
+#define PAGE_CACHE_SIZE         64
+/*! Number of page frames moved between a page cache and the free lists */
+#define PAGE_CACHE_BATCH        16
+
+/*! Maximum number of page frames in the pre-zeroed page pool */
+#define ZERO_POOL_SIZE          256
+/*! Number of page frames zeroed by each call to zero_pool_refill() */
+#define ZERO_POOL_BATCH         16
+/*! Minimum number of free page frames needed to refill the zeroed page pool */
+#define ZERO_POOL_MIN_FREE      4096
+
+#define PAGE_META_FREE          (1 << 0)  /*!< Page heads a free block */
+#define PAGE_META_DIRTY         (1 << 1)  /*!< Cached file data was modified */
+#define PAGE_META_REFERENCED    (1 << 2)  /*!< Cached file data was used */
+
+/*! Number of free page frames below which the kernel process reclaims pages */
+#define RECLAIM_LOW_PAGES       1024
+/*! Number of free page frames background reclaim tries to reach */
+#define RECLAIM_HIGH_PAGES      2048
+/*! Number of page frames reclaimed by each call to reclaim_pages() */
+#define RECLAIM_BATCH           32
+/*! Number of pages hashed by each call to merge_background() */
+#define MERGE_SCAN_PAGES        256
+
+/*!
+ * Maximum number of pages invalidated one by one after a range operation.
+ * Larger ranges are invalidated by flushing the whole TLB.
+ */
+#define VM_FLUSH_MAX_PAGES      32
+
+/*! Number of process-context identifiers supported by the processor */
+#define PCID_COUNT              4096
+
 /*! Address of system memory map */
 #define MMAP_ADDR               0xfffffe0000009000
 
@@ -197,17 +255,103 @@
 
 #define PHYS32_REL(x) (PHYS_REL ((uintptr_t) (x)))
 
+/*!
+ * Determines whether an address is in the area used for large kernel
+ * allocations made with vmalloc().
+ *
+ * @param x the address
+ * @return nonzero if the address is in the area
+ */
+
+#define IS_VMALLOC_ADDR(x) ((uintptr_t) (x) >= VMALLOC_BASE_VMA		\
+			    && (uintptr_t) (x) < VMALLOC_TOP_VMA)
+
+/*!
+ * Determines whether a page table entry refers to a page that was moved
+ * to swap space.
+ *
+ * @param e the page table entry
+ * @return nonzero if the entry holds a swap slot
+ */
+
+#define PAGE_IS_SWAP(e)							\
+  (((e) & (PAGE_FLAG_PRESENT | PAGE_FLAG_SWAP)) == PAGE_FLAG_SWAP)
+
+/*!
+ * Builds a non-present page table entry referring to a swap slot.
+ *
+ * @param slot the swap slot number
+ * @param rw whether the page was writable
+ * @return the page table entry
+ */
+
+#define SWAP_ENTRY(slot, rw)						\
+  (((uintptr_t) (slot) << 12) | PAGE_FLAG_SWAP | PAGE_FLAG_USER		\
+   | ((rw) ? PAGE_FLAG_SWAP_RW : 0))
+
+/*!
+ * Extracts the swap slot number from a page table entry for which
+ * @ref PAGE_IS_SWAP is true.
+ *
+ * @param e the page table entry
+ * @return the swap slot number
+ */
+
+#define SWAP_SLOT(e)            ((uintptr_t) (e) >> 12)
+
 /*! Page-align a variable */
 #define __page_align            __attribute__ ((aligned (PAGE_SIZE)))
 
 /*!
- * Metadata of a page for the physical page frame allocator.
+ * Metadata of a page for the physical page frame allocator. Free memory is
+ * kept in blocks of 2<sup>n</sup> pages aligned to their size, and only the
+ * first page of a free block is linked into the free list of its order.
+ * Page frame number zero is never free, so it is used to terminate the lists.
  */
 
 struct page_meta
 {
   /*! Number of references to this page, zero means the page is not allocated */
   unsigned int count;
+  unsigned char order;          /*!< Block order if this page heads a block */
+  unsigned char flags;          /*!< Allocator flags */
+  unsigned short reserved;      /*!< Reserved, must be zero */
+  uint32_t next;                /*!< Next free block of the same order */
+  uint32_t prev;                /*!< Previous free block of the same order */
+};
+
+/*!
+ * Per-CPU cache of free page frames in front of the physical page frame
+ * allocator. The cache is a ring ordered from the coldest page frame at
+ * @ref start to the most recently freed page frame, which is handed out first.
+ * Single page frame allocations and frees only access the cache of the
+ * current CPU, and the global free lists are only locked to move a batch of
+ * page frames in or out.
+ */
+
+struct page_cache
+{
+  uintptr_t pages[PAGE_CACHE_SIZE]; /*!< Physical addresses of cached pages */
+  size_t start;                 /*!< Index of coldest cached page frame */
+  size_t count;                 /*!< Number of cached page frames */
+  unsigned long hits;           /*!< Allocations served from the cache */
+  unsigned long refills;        /*!< Batches taken from the free lists */
+  unsigned long drains;         /*!< Batches returned to the free lists */
+};
+
+/*!
+ * Pool of page frames zeroed ahead of time by the kernel process, used to
+ * take zeroing off the critical path of page frame allocations that need
+ * zero-filled memory.
+ */
+
+struct zero_pool
+{
+  uintptr_t pages[ZERO_POOL_SIZE]; /*!< Physical addresses of zeroed pages */
+  size_t count;                 /*!< Number of page frames in the pool */
+  unsigned long hits;           /*!< Allocations served from the pool */
+  unsigned long misses;         /*!< Allocations zeroed synchronously */
+  unsigned long refills;        /*!< Page frames zeroed in the background */
 };
 
 /*!
@@ -221,6 +365,46 @@ struct mem_region
   uint64_t len;                 /*!< Length of memory region */
 };
 
+/*!
+ * Range of virtual memory whose TLB entries must be invalidated after
+ * range operations change or remove mappings in it. An empty range has
+ * equal start and end addresses.
+ */
+
+struct vm_flush
+{
+  uintptr_t start;              /*!< Lowest changed page */
+  uintptr_t end;                /*!< End of the highest changed page */
+};
+
+/*!
+ * Counters of the page reclaim scanner, reported in the memory statistics.
+ */
+
+struct reclaim_stats
+{
+  unsigned long scanned;        /*!< Mapped pages examined */
+  unsigned long aged;           /*!< Pages given a second chance */
+  unsigned long file_unmapped;  /*!< Pages of file mappings unmapped */
+  unsigned long cache_evicted;  /*!< Clean page cache pages freed */
+  unsigned long swapped_out;    /*!< Anonymous pages written to swap */
+  unsigned long swapped_in;     /*!< Pages read back from swap */
+  unsigned long direct;         /*!< Reclaims run by failed page faults */
+};
+
+/*!
+ * Counters of the page merging scanner, reported in the memory statistics.
+ * The number of pages saved is recounted on each pass of the scanner.
+ */
+
+struct merge_stats
+{
+  unsigned long scanned;        /*!< Mergeable pages hashed */
+  unsigned long merged;         /*!< Pages replaced by a stable page */
+  unsigned long shared;         /*!< Stable page frames in use */
+  unsigned long saved;          /*!< Page frames freed by merging */
+};
+
 /*!
  * Represents a memory map of the system.
  */
@@ -229,31 +413,61 @@ struct mem_map
 {
   struct mem_region *regions;   /*!< Array of memory region structures */
   size_t count;                 /*!< Number of memory regions */
-  size_t curr;                  /*!< Current memory region */
 };
 
+__BEGIN_DECLS
+
+extern int vm_pcid_enabled;
+extern int vm_tlb_tracking;
+
+void vm_pcid_update (uintptr_t addr);
+void vm_pcid_flush (void);
+void vm_tlb_update (uintptr_t start, uintptr_t end);
+void vm_tlb_poll (void);
+
+__END_DECLS
+
 /*!
- * Clears all entries in the TLB by reloading the CR3 register.
+ * Clears all non-global entries in the TLB by reloading the CR3 register.
+ * If PCIDs are enabled, only the entries of the current thread are cleared.
  */
 
 __always_inline static inline void
 vm_clear_tlb (void)
 {
-  __asm__ volatile ("mov %%cr3, %%rax\nmov %%rax, %%cr3" ::: "memory");
+  if (vm_pcid_enabled)
+    vm_pcid_flush ();
+  else
+    __asm__ volatile ("mov %%cr3, %%rax\nmov %%rax, %%cr3" ::: "memory");
 }
 
 /*!
- * Invalidates a single page in the TLB.
+ * Invalidates a single page in the TLB of the current CPU only.
  *
  * @param addr address of page to invalidate
  */
 
 __always_inline static inline void
-vm_clear_page (void *addr)
+vm_invlpg (void *addr)
 {
   __asm__ volatile ("invlpg (%0)" :: "r" (addr) : "memory");
 }
 
+/*!
+ * Invalidates a single page in the TLB, including the TLBs of other
+ * threads and CPUs sharing the mapping.
+ *
+ * @param addr address of page to invalidate
+ */
+
+__always_inline static inline void
+vm_clear_page (void *addr)
+{
+  vm_invlpg (addr);
+  if (vm_tlb_tracking)
+    vm_tlb_update ((uintptr_t) addr, (uintptr_t) addr + PAGE_SIZE);
+}
+
 /*!
  * Changes the PML4T to use for the current address space.
  *
@@ -266,6 +480,9 @@ vm_set_cr3 (uintptr_t addr)
   __asm__ volatile ("mov %0, %%cr3" :: "r" (addr) : "memory");
 }
 
+struct process;
+struct thread;
+
 __BEGIN_DECLS
 
 extern void *__kernel_vma;
@@ -280,6 +497,14 @@ extern uintptr_t phys_map_pdpt[PAGE_STRUCT_ENTRIES * 4] __page_align;
 extern struct page_meta *phys_alloc_table;
 extern uintptr_t next_phys_addr;
 extern uintptr_t total_phys_mem;
+extern size_t phys_page_count;
+extern size_t phys_free_pages;
+extern struct page_cache page_caches[];
+extern struct zero_pool zero_pool;
+extern struct reclaim_stats reclaim_stats;
+extern struct merge_stats merge_stats;
+extern int merge_active;
+extern uintptr_t zero_page;
 extern struct mem_map mmap;
 
 uintptr_t physical_addr (void *addr);
@@ -287,10 +512,40 @@ uintptr_t vm_phys_addr (uintptr_t *pml4t, void *addr);
 int vm_map_page (uintptr_t *pml4t, uintptr_t phys_addr, void *addr,
 		 unsigned int flags);
 int vm_unmap_page (uintptr_t *pml4t, void *addr);
-void vm_next_page (void);
+int vm_unshare_table (uintptr_t *entry, int pt);
+int vm_map_large_page (uintptr_t *pml4t, uintptr_t phys_addr, void *addr,
+		       unsigned int flags);
+int vm_split_large_page (uintptr_t *pml4t, void *addr);
+int vm_map_range (uintptr_t *pml4t, uintptr_t phys_addr, void *addr,
+		  size_t len, unsigned int flags);
+int vm_unmap_range (uintptr_t *pml4t, void *addr, size_t len,
+		    struct vm_flush *flush);
+int vm_protect_range (uintptr_t *pml4t, void *addr, size_t len,
+		      unsigned int flags, struct vm_flush *flush);
+void vm_flush_tlb (struct vm_flush *flush);
+int vm_alloc_range (uintptr_t *pml4t, void *addr, size_t len,
+		    unsigned int flags);
+int vm_free_range (uintptr_t *pml4t, void *addr, size_t len);
+void vm_collect_dirty (uintptr_t *pml4t, void *addr, size_t len);
+int vm_move_range (uintptr_t *pml4t, void *dest, void *src, size_t len);
+int vm_share_range (uintptr_t *dest, uintptr_t *src, void *addr, size_t len);
+int vm_copy_range (uintptr_t *dest, uintptr_t *src, void *addr, size_t len,
+		   unsigned int flags);
 void vm_unmap_user_mem (uintptr_t *pml4t);
 void vm_init (void);
 void mark_resv_mem_alloc (void);
+void clear_page_nt (void *addr);
+void zero_pool_refill (void);
+void init_zero_page (void);
+void vm_init_pcid (void);
+unsigned int vm_alloc_pcid (void);
+void vm_pcid_invalidate (struct thread *thread);
+uintptr_t vm_pcid_cr3 (void);
+void vm_tlb_switch (struct process *prev, struct process *next);
+void vm_tlb_flush_process (struct process *process, struct vm_flush *flush);
+size_t reclaim_pages (size_t target);
+void reclaim_background (void);
+void merge_background (void);
 
 void ref_pt (uintptr_t *pt);
 void ref_pdt (uintptr_t *pdt);
@@ -301,6 +556,65 @@ void free_pdpt (uintptr_t *pdpt);
 
 __END_DECLS
 
+/*!
+ * Adds an area to the range of virtual memory to invalidate in the TLB.
+ *
+ * @param flush the range to invalidate
+ * @param start the page-aligned start of the area
+ * @param end the page-aligned end of the area
+ */
+
+static inline void
+vm_flush_add (struct vm_flush *flush, uintptr_t start, uintptr_t end)
+{
+  if (flush->start == flush->end)
+    {
+      flush->start = start;
+      flush->end = end;
+      return;
+    }
+  if (start < flush->start)
+    flush->start = start;
+  if (end > flush->end)
+    flush->end = end;
+}
+
+/*!
+ * Transfers the dirty bit of a page table entry in a shared file mapping
+ * to the page frame metadata, so the modified data is written back to the
+ * file even after the mapping is removed.
+ *
+ * @param pte the page table entry
+ */
+
+static inline void
+vm_mark_dirty (uintptr_t pte)
+{
+  if ((pte & (PAGE_FLAG_SHARED | PAGE_FLAG_DIRTY))
+      == (PAGE_FLAG_SHARED | PAGE_FLAG_DIRTY))
+    __atomic_fetch_or (&phys_alloc_table[pte / PAGE_SIZE].flags,
+		       PAGE_META_DIRTY, __ATOMIC_ACQ_REL);
+}
+
+/*!
+ * Determines whether a large page can be written in place by its only
+ * owner. The reference count of the first page frame only covers the whole
+ * large page if the block was not split by another address space, since
+ * after a split the other page frames may still be mapped elsewhere.
+ *
+ * @param pde the large page directory entry
+ * @return nonzero if the large page is unshared and still a whole block
+ */
+
+static inline int
+vm_large_page_owned (uintptr_t pde)
+{
+  struct page_meta *page =
+    phys_alloc_table + (pde & ~(LARGE_PAGE_SIZE - 1)) / PAGE_SIZE;
+  return page->order == LARGE_PAGE_ORDER
+    && __atomic_load_n (&page->count, __ATOMIC_ACQUIRE) == 1;
+}
+
 #endif /* !__ASSEMBLER__ */
 
 #endif
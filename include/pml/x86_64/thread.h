@@ -27,6 +27,7 @@
 
 #ifndef __ASSEMBLER__
 
+#include <pml/interrupt.h>
 #include <pml/vfs.h>
 #include <pml/signal.h>
 
@@ -70,6 +71,11 @@ struct thread
   struct thread_args args;      /*!< Properties of thread */
   int state;                    /*!< Thread state */
   int error;                    /*!< Thread-local error number (errno) */
+  unsigned int pcid;            /*!< Process-context identifier */
+  /*! Process TLB generation when last run on each CPU */
+  unsigned long tlb_gen[MAX_CORES];
+  /*! Kernel TLB generation when last run on each CPU */
+  unsigned long kernel_tlb_gen[MAX_CORES];
   int sig;                      /*!< Number of queued signals */
   sigset_t sigblocked;          /*!< Mask of blocked signals */
   sigset_t sigpending;          /*!< Mask of pending blocked signals */
@@ -130,6 +136,7 @@ void thread_save_stack (struct thread *thread, void *stack);
 void thread_switch (void **stack, uintptr_t *pml4t_phys);
 struct thread *thread_create (struct thread_args *args);
 int thread_alloc_tl_kernel_data (struct thread *thread);
+int thread_stack_fault (uintptr_t *pml4t, uintptr_t addr);
 void thread_free (struct thread *thread);
 int thread_attach_process (struct process *process, struct thread *thread);
 struct thread *thread_clone (struct thread *thread, int copy);
@@ -42,6 +42,9 @@
 struct boot_options
 {
   char *root_device;            /*!< Device to mount as root partition */
+  int zswap_percent;            /*!< Percentage of memory for compressed swap */
+  int merge;                    /*!< Whether all anonymous memory is mergeable */
+  int heapinfo;                 /*!< Whether kernel heap accounting is on */
 };
 
 __BEGIN_DECLS
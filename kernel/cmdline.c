@@ -17,6 +17,7 @@
 /*! @file */
 
 #include <pml/panic.h>
+#include <pml/swap.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,7 +31,9 @@ char *command_line;
  * init_command_line().
  */
 
-struct boot_options boot_options;
+struct boot_options boot_options = {
+  .zswap_percent = ZSWAP_DEFAULT_PERCENT
+};
 
 /*!
  * Parses the command line given to the kernel.
@@ -62,6 +65,21 @@ init_command_line (void)
 	    panic ("Boot option `root' requires an argument");
 	  boot_options.root_device = arg;
 	}
+      else if (!strcmp (ptr, "heapinfo"))
+	boot_options.heapinfo = 1;
+      else if (!strcmp (ptr, "merge"))
+	boot_options.merge = 1;
+      else if (!strcmp (ptr, "zswap"))
+	{
+	  int percent = 0;
+	  if (UNLIKELY (!arg || !*arg))
+	    panic ("Boot option `zswap' requires an argument");
+	  for (; isdigit (*arg); arg++)
+	    percent = percent * 10 + *arg - '0';
+	  if (UNLIKELY (*arg || percent > 100))
+	    panic ("Boot option `zswap' must be a percentage");
+	  boot_options.zswap_percent = percent;
+	}
       ptr = end + 1;
     }
 }
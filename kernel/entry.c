@@ -17,6 +17,7 @@
 /*! @file */
 
 #include <pml/device.h>
+#include <pml/memory.h>
 #include <pml/panic.h>
 #include <pml/syscall.h>
 #include <pml/tty.h>
@@ -45,6 +46,21 @@ try_execve (const char *path, char *const *argv, char *const *envp)
   printf ("%s: could not exec %s (errno %d)\n", __FUNCTION__, path, errno);
 }
 
+/*!
+ * Performs background work while the kernel process has nothing else to do.
+ * This function is called repeatedly by the kernel process while waiting
+ * for the init process.
+ */
+
+static void
+kernel_idle (void)
+{
+  zero_pool_refill ();
+  vnode_flush_writeback ();
+  reclaim_background ();
+  merge_background ();
+}
+
 /*! Prints a welcome message on boot. */
 
 void
@@ -91,7 +107,11 @@ fork_init (void)
   else
     {
       int status;
-      sys_wait4 (pid, &status, 0, NULL);
+      while (!sys_wait4 (pid, &status, WNOHANG, NULL))
+	{
+	  kernel_idle ();
+	  sched_yield ();
+	}
       if (WIFEXITED (status))
 	panic ("Init process terminated with status %d", WEXITSTATUS (status));
       else if (WIFSIGNALED (status))
@@ -17,6 +17,7 @@
 /*! @file */
 
 #include <pml/alloc.h>
+#include <pml/ctlreg.h>
 #include <pml/elf.h>
 #include <pml/memory.h>
 #include <pml/mman.h>
@@ -25,36 +26,58 @@
 #include <stdio.h>
 #include <string.h>
 
-static char *
-copy_string (struct elf_exec *exec, char *str)
+/*!
+ * Frees an array of strings allocated by copy_string_array().
+ *
+ * @param array the array of strings, which may be NULL
+ */
+
+static void
+free_string_array (char **array)
 {
-  size_t len;
-  size_t base_len;
-  uintptr_t ptr;
-  char *temp;
-  char *s = str;
-  const char *cptr;
-
-  /* Determine length of string */
-  ptr = vm_phys_addr (exec->old_pml4t, s);
-  cptr = (char *) PHYS_REL (ptr);
-  len = strnlen (cptr, PAGE_SIZE - (ptr & (PAGE_SIZE - 1)));
-  base_len = len;
-  if (len == PAGE_SIZE - (ptr & (PAGE_SIZE - 1)))
+  size_t i;
+  if (!array)
+    return;
+  for (i = 0; array[i]; i++)
+    free (array[i]);
+  free (array);
+}
+
+/*!
+ * Copies a null-terminated array of strings into kernel memory.
+ *
+ * @param array the array of strings to copy
+ * @param len pointer to store the number of strings in the array
+ * @return the copied array, or NULL on failure
+ */
+
+static char **
+copy_string_array (char *const *array, size_t *len)
+{
+  char **copy;
+  size_t i;
+  for (*len = 0; array[*len]; (*len)++)
+    ;
+  copy = calloc (*len + 1, sizeof (char *));
+  if (UNLIKELY (!copy))
+    RETV_ERROR (ENOMEM, NULL);
+  for (i = 0; i < *len; i++)
     {
-      s = ALIGN_UP (s, PAGE_SIZE);
-      while (1)
+      copy[i] = strdup (array[i]);
+      if (UNLIKELY (!copy[i]))
 	{
-	  size_t slen;
-	  ptr = vm_phys_addr (exec->old_pml4t, s);
-	  cptr = (char *) PHYS_REL (ptr);
-	  slen = strnlen (cptr, PAGE_SIZE);
-	  len += slen;
-	  if (slen < PAGE_SIZE)
-	    break;
-	  s += PAGE_SIZE;
+	  free_string_array (copy);
+	  RETV_ERROR (ENOMEM, NULL);
 	}
     }
+  return copy;
+}
+
+static char *
+copy_string (struct elf_exec *exec, const char *str)
+{
+  size_t len = strlen (str);
+  char *temp;
 
   /* Allocate space for argument list */
   if (!exec->arg_data)
@@ -79,81 +102,70 @@ copy_string (struct elf_exec *exec, char *str)
 
   /* Copy string to allocated area */
   temp = exec->arg_ptr;
-  s = str;
-  ptr = vm_phys_addr (exec->old_pml4t, s);
-  cptr = (char *) PHYS_REL (ptr);
-  exec->arg_ptr = mempcpy (exec->arg_ptr, cptr, base_len);
-  s = ALIGN_UP (s, PAGE_SIZE);
-  if (len >= PAGE_SIZE)
-    {
-      for (; base_len <= len - PAGE_SIZE; base_len += PAGE_SIZE)
-	{
-	  ptr = vm_phys_addr (exec->old_pml4t, s);
-	  cptr = (char *) PHYS_REL (ptr);
-	  exec->arg_ptr = mempcpy (exec->arg_ptr, cptr, PAGE_SIZE);
-	  s += PAGE_SIZE;
-	}
-    }
-  ptr = vm_phys_addr (exec->old_pml4t, s);
-  cptr = (char *) PHYS_REL (ptr);
-  exec->arg_ptr = mempcpy (exec->arg_ptr, cptr, len - base_len);
+  exec->arg_ptr = mempcpy (exec->arg_ptr, str, len);
   *exec->arg_ptr++ = '\0';
   return temp;
 }
 
 /*!
- * Maps a continuous region of virtual memory. This function is used to
- * map memory to load an ELF file's code or data.
+ * Maps a segment of an ELF file into memory. Pages containing file data
+ * are mapped from the page cache of the file when they are first accessed,
+ * so processes running the same program share read-only pages, and
+ * writable pages are only copied once written to. The zero-filled
+ * remainder of the segment is mapped as anonymous memory.
  *
  * @param base starting virtual address to map
  * @param len number of bytes to map
  * @param prot mmap-style protection flags for the memory region
- * @param vp the file to read
- * @param filesz number of bytes to read
- * @param offset offset in the file to read
+ * @param file the system file descriptor of the file to map
+ * @param filesz number of bytes of file data
+ * @param offset offset in the file of the data
  * @return zero on success
  */
 
 int
-elf_mmap (void *base, size_t len, int prot, struct vnode *vp, size_t filesz,
+elf_mmap (void *base, size_t len, int prot, struct fd *file, size_t filesz,
 	  off_t offset)
 {
-  void *ptr;
-  void *cptr;
-  int flags = PAGE_FLAG_USER;
-  if (prot & PROT_WRITE)
-    flags |= PAGE_FLAG_RW;
-
-  for (ptr = ALIGN_DOWN (base, PAGE_SIZE);
-       ptr < ALIGN_UP (base + len, PAGE_SIZE); ptr += PAGE_SIZE)
-    {
-      uintptr_t page = alloc_page ();
-      if (UNLIKELY (!page))
-	goto err0;
-      memset ((void *) PHYS_REL (page), 0, PAGE_SIZE);
-      if (vm_map_page (THIS_THREAD->args.pml4t, page, ptr, PAGE_FLAG_RW))
-	{
-	  free_page (page);
-	  goto err0;
-	}
-    }
+  uintptr_t start = ALIGN_DOWN ((uintptr_t) base, PAGE_SIZE);
+  uintptr_t data_end = ALIGN_UP ((uintptr_t) base + filesz, PAGE_SIZE);
+  uintptr_t end = ALIGN_UP ((uintptr_t) base + len, PAGE_SIZE);
+  struct mmap region;
+  if (data_end > end)
+    data_end = end;
+  if (((uintptr_t) base - offset) & (PAGE_SIZE - 1))
+    RETV_ERROR (ENOEXEC, -1);
 
-  if (filesz && vfs_read (vp, base, filesz, offset) != (ssize_t) filesz)
-    goto err0;
+  region.prot = prot;
+  region.fd = -1;
+  region.advice = MADV_NORMAL;
+  region.mergeable = 0;
+  if (data_end > start)
+    {
+      region.base = start;
+      region.len = data_end - start;
+      region.file = file;
+      region.offset = offset - ((uintptr_t) base - start);
+      region.flags = MAP_PRIVATE;
+      if (mmap_insert (&region))
+	return -1;
 
-  for (ptr = ALIGN_DOWN (base, PAGE_SIZE);
-       ptr < ALIGN_UP (base + len, PAGE_SIZE); ptr += PAGE_SIZE)
+      /* Clear the rest of the last page of file data if it is part of
+	 the zero-filled area. This copies the page. */
+      if (filesz < len && (prot & PROT_WRITE))
+	memset (base + filesz, 0, data_end - (uintptr_t) base - filesz);
+    }
+  if (end > data_end)
     {
-      if (vm_map_page (THIS_THREAD->args.pml4t, physical_addr ((void *) ptr),
-		       ptr, flags))
-	goto err0;
+      region.base = data_end;
+      region.len = end - data_end;
+      region.file = NULL;
+      region.offset = 0;
+      region.flags = MAP_PRIVATE | MAP_ANONYMOUS;
+      if (mmap_insert (&region))
+	return -1;
     }
   return 0;
-
- err0:
-  for (cptr = ALIGN_DOWN (base, PAGE_SIZE); cptr < ptr; cptr += PAGE_SIZE)
-    free_page (physical_addr (cptr));
-  return -1;
 }
 
 /*!
@@ -161,19 +173,19 @@ elf_mmap (void *base, size_t len, int prot, struct vnode *vp, size_t filesz,
  *
  * @param exec the execution context
  * @param ehdr the ELF file header
- * @param vp the vnode of the ELF file
+ * @param file the system file descriptor of the ELF file
  * @return zero on success
  */
 
 int
-elf_load_phdrs (Elf64_Ehdr *ehdr, struct vnode *vp)
+elf_load_phdrs (Elf64_Ehdr *ehdr, struct fd *file)
 {
   Elf64_Phdr phdr;
   size_t i;
   for (i = 0; i < ehdr->e_phnum; i++)
     {
-      if (vfs_read (vp, &phdr, sizeof (Elf64_Phdr), ehdr->e_phoff + i *
-		    ehdr->e_phentsize) != sizeof (Elf64_Phdr))
+      if (vfs_read (file->vnode, &phdr, sizeof (Elf64_Phdr), ehdr->e_phoff
+		    + i * ehdr->e_phentsize) != sizeof (Elf64_Phdr))
 	RETV_ERROR (EIO, -1);
       if (phdr.p_type == PT_LOAD)
 	{
@@ -188,7 +200,7 @@ elf_load_phdrs (Elf64_Ehdr *ehdr, struct vnode *vp)
 	  if (phdr.p_vaddr + phdr.p_memsz > USER_MEMORY_LIMIT)
 	    RETV_ERROR (EFAULT, -1);
 	  if (elf_mmap ((void *) phdr.p_vaddr, phdr.p_memsz, flags,
-			vp, phdr.p_filesz, phdr.p_offset))
+			file, phdr.p_filesz, phdr.p_offset))
 	    return -1;
 
 	  brk = (void *) ALIGN_UP (phdr.p_vaddr + phdr.p_memsz, PAGE_SIZE);
@@ -211,6 +223,8 @@ int
 elf_load_file (struct elf_exec *exec, struct vnode *vp)
 {
   Elf64_Ehdr ehdr;
+  int sysfd;
+  int ret;
   if (vfs_read (vp, &ehdr, sizeof (Elf64_Ehdr), 0) != sizeof (Elf64_Ehdr)
       || ehdr.e_ident[EI_MAG0] != ELFMAG0
       || ehdr.e_ident[EI_MAG1] != ELFMAG1
@@ -223,7 +237,17 @@ elf_load_file (struct elf_exec *exec, struct vnode *vp)
       || ehdr.e_machine != ELF_MACHINE)
     RETV_ERROR (ENOEXEC, -1);
   THIS_PROCESS->brk.base = 0;
-  if (elf_load_phdrs (&ehdr, vp))
+
+  /* Memory regions of the program segments reference the file through a
+     system file descriptor */
+  sysfd = alloc_fd ();
+  if (sysfd == -1)
+    RETV_ERROR (ENFILE, -1);
+  REF_ASSIGN (system_fd_table[sysfd].vnode, vp);
+  system_fd_table[sysfd].flags = O_RDONLY;
+  ret = elf_load_phdrs (&ehdr, system_fd_table + sysfd);
+  free_fd (sysfd);
+  if (ret)
     return -1;
   exec->entry = (void *) ehdr.e_entry;
   THIS_PROCESS->brk.curr = THIS_PROCESS->brk.base;
@@ -236,6 +260,7 @@ sys_execve (const char *path, char *const *argv, char *const *envp)
 {
   struct vnode *vp = vnode_namei (path, 0);
   struct elf_exec exec;
+  struct mmap_table old_mmaps;
   struct thread *thread;
   char **args;
   char **argsm = NULL;
@@ -244,30 +269,30 @@ sys_execve (const char *path, char *const *argv, char *const *envp)
   char **envm = NULL;
   size_t nenv = 0;
   char **arrbuf;
+  uintptr_t pcid;
   size_t i;
   int ret;
   if (!vp)
     return -1;
 
-  /* TODO Check that argv/envp doesn't exceed ARG_MAX */
+  /* Copy the arguments while the old address space is still loaded,
+     since parts of it may not be mapped yet.
+     TODO Check that argv/envp doesn't exceed ARG_MAX */
   if (argv)
     {
-      for (i = 0; argv[i]; i++)
-	nargs++;
-      argsm = calloc (nargs + 1, sizeof (char *));
+      argsm = copy_string_array (argv, &nargs);
       if (UNLIKELY (!argsm))
-	RETV_ERROR (ENOMEM, -1);
-      memcpy (argsm, argv, sizeof (char *) * nargs);
+	{
+	  UNREF_OBJECT (vp);
+	  return -1;
+	}
       argv = argsm;
     }
   if (envp)
     {
-      for (i = 0; envp[i]; i++)
-	nenv++;
-      envm = calloc (nenv + 1, sizeof (char *));
+      envm = copy_string_array (envp, &nenv);
       if (UNLIKELY (!envm))
 	goto err0;
-      memcpy (envm, envp, sizeof (char *) * nenv);
       envp = envm;
     }
 
@@ -284,11 +309,20 @@ sys_execve (const char *path, char *const *argv, char *const *envp)
 	  THIS_THREAD->args.pml4t + PAGE_STRUCT_ENTRIES / 2,
 	  PAGE_STRUCT_SIZE / 2);
 
-  /* Save the old PML4T and load the new one */
+  /* Save the old PML4T and load the new one. The thread keeps its PCID,
+     whose TLB entries are flushed by loading CR3. */
   __asm__ volatile ("mov %%cr3, %0" : "=r" (exec.old_pml4t_phys));
+  pcid = exec.old_pml4t_phys & CR3_PCID_MASK;
+  exec.old_pml4t_phys &= ~CR3_PCID_MASK;
   exec.old_pml4t = (uintptr_t *) PHYS_REL (exec.old_pml4t_phys);
   THIS_THREAD->args.pml4t = exec.pml4t;
-  __asm__ volatile ("mov %0, %%cr3" :: "r" (exec.pml4t_phys));
+  vm_set_cr3 (exec.pml4t_phys | pcid);
+
+  /* Start with no memory regions, since page faults are resolved using
+     the regions of the new image */
+  old_mmaps = THIS_PROCESS->mmaps;
+  THIS_PROCESS->mmaps.root = NULL;
+  THIS_PROCESS->mmaps.len = 0;
 
   /* Load the ELF file into memory */
   ret = elf_load_file (&exec, vp);
@@ -319,12 +353,15 @@ sys_execve (const char *path, char *const *argv, char *const *envp)
 	*arrbuf++ = copy_string (&exec, envp[i]);
     }
   *arrbuf++ = NULL;
-  free (argsm);
-  free (envm);
+  free_string_array (argsm);
+  free_string_array (envm);
 
-  /* Clear other threads, old user memory, and signal handlers */
+  /* Clear other threads, old user memory, and signal handlers. If the
+     old address space was borrowed by vfork, it is returned instead. */
   thread_switch_lock = 1;
+  process_vfork_release (THIS_PROCESS, exec.old_pml4t, &old_mmaps);
   vm_unmap_user_mem (exec.old_pml4t);
+  mmap_table_free (&old_mmaps);
   memset (THIS_PROCESS->sighandlers, 0, sizeof (struct sigaction) * NSIG);
   thread = THIS_THREAD;
   THIS_PROCESS->threads.front = 0;
@@ -336,12 +373,15 @@ sys_execve (const char *path, char *const *argv, char *const *envp)
   __builtin_unreachable ();
 
  err1:
-  /* Restore the old PML4T before returning */
+  /* Restore the old PML4T and memory regions before returning */
+  mmap_table_free (&THIS_PROCESS->mmaps);
+  THIS_PROCESS->mmaps = old_mmaps;
   THIS_THREAD->args.pml4t = exec.old_pml4t;
-  __asm__ volatile ("mov %0, %%cr3" :: "r" (exec.old_pml4t_phys));
+  vm_set_cr3 (exec.old_pml4t_phys | pcid);
+  vm_unmap_user_mem (exec.pml4t);
   free_page (exec.pml4t_phys);
  err0:
-  free (argsm);
-  free (envm);
+  free_string_array (argsm);
+  free_string_array (envm);
   return -1;
 }
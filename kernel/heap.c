@@ -18,15 +18,376 @@
 
 #include <pml/alloc.h>
 #include <pml/lock.h>
+#include <pml/memory.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*!
+ * Links between the free blocks of a size class. This structure is placed
+ * at the start of the data of every free block.
+ */
+
+struct kh_links
+{
+  struct kh_header *next;       /*!< Next free block in the size class */
+  struct kh_header *prev;       /*!< Previous free block in the size class */
+};
+
 static lock_t kh_lock;
 static uintptr_t kh_base_addr;
 static uintptr_t kh_end_addr;
 
+/*! End of the memory mapped to grow the heap */
+static uintptr_t kh_grow_addr = KERNEL_HEAP_BASE_VMA;
+
+/*! Counters of kernel heap usage */
+struct kh_stats kh_stats;
+
+/*!
+ * Free blocks are indexed by size in two levels, similar to the TLSF
+ * allocator. Each first-level class covers a power of two range of sizes
+ * and is divided into @ref KH_SL_COUNT second-level classes. The bitmaps
+ * record which classes have free blocks, so a suitable block is found in
+ * constant time.
+ */
+
+static struct kh_header *kh_free_lists[KH_FL_COUNT][KH_SL_COUNT];
+static uint64_t kh_fl_bitmap;
+static uint32_t kh_sl_bitmap[KH_FL_COUNT];
+
+/*!
+ * Determines the size class of a free block.
+ *
+ * @param size the size of the block data
+ * @param fl pointer to store the first-level class
+ * @param sl pointer to store the second-level class
+ */
+
+static inline void
+kh_size_class (size_t size, unsigned int *fl, unsigned int *sl)
+{
+  unsigned int bit;
+  if (size < KH_SMALL_SIZE)
+    {
+      *fl = 0;
+      *sl = size / KH_DEFAULT_ALIGN;
+      return;
+    }
+  bit = 63 - __builtin_clzl (size);
+  *sl = (size >> (bit - __builtin_ctz (KH_SL_COUNT))) ^ KH_SL_COUNT;
+  *fl = bit - __builtin_ctz (KH_SMALL_SIZE) + 1;
+}
+
+/*!
+ * Determines the bounds of the part of the heap containing a block. The
+ * heap starts with the memory given to kh_init(), and memory mapped later
+ * is added in a separate contiguous area of virtual memory.
+ *
+ * @param header the header of the block
+ * @param base pointer to store the start of the part
+ * @return the end of the part
+ */
+
+static inline uintptr_t
+kh_bounds (struct kh_header *header, uintptr_t *base)
+{
+  if ((uintptr_t) header >= KERNEL_HEAP_BASE_VMA
+      && (uintptr_t) header < KERNEL_HEAP_TOP_VMA)
+    {
+      *base = KERNEL_HEAP_BASE_VMA;
+      return kh_grow_addr;
+    }
+  *base = kh_base_addr;
+  return kh_end_addr;
+}
+
+static inline struct kh_links *
+kh_links (struct kh_header *header)
+{
+  return (struct kh_links *) (header + 1);
+}
+
+static inline struct kh_tail *
+kh_tail (struct kh_header *header)
+{
+  return (struct kh_tail *) ((uintptr_t) (header + 1) + header->size);
+}
+
+/*!
+ * Finds the block following a block in the heap.
+ *
+ * @param header the header of the block
+ * @return the header of the next block, or NULL if the block is the last
+ */
+
+static inline struct kh_header *
+kh_next (struct kh_header *header)
+{
+  struct kh_header *next = (struct kh_header *) (kh_tail (header) + 1);
+  uintptr_t base;
+  return (uintptr_t) next < kh_bounds (header, &base) ? next : NULL;
+}
+
+/*!
+ * Finds the block preceding a block in the heap.
+ *
+ * @param header the header of the block
+ * @return the header of the previous block, or NULL if the block is the first
+ */
+
+static inline struct kh_header *
+kh_prev (struct kh_header *header)
+{
+  uintptr_t base;
+  kh_bounds (header, &base);
+  if ((uintptr_t) header <= base)
+    return NULL;
+  return ((struct kh_tail *) header - 1)->header;
+}
+
+/*!
+ * Checks the header and tail magic numbers of a block.
+ *
+ * @param header the header of the block
+ * @return zero if the block is valid
+ */
+
+static int
+kh_check (struct kh_header *header)
+{
+  struct kh_tail *tail;
+  uintptr_t base;
+  if (UNLIKELY (header->magic != KH_HEADER_MAGIC))
+    {
+      debug_printf ("bad magic number in header block\n");
+      return -1;
+    }
+  tail = kh_tail (header);
+  if (UNLIKELY ((uintptr_t) (tail + 1) > kh_bounds (header, &base)
+		|| tail->magic != KH_TAIL_MAGIC || tail->header != header))
+    {
+      debug_printf ("invalid tail block for header block\n");
+      return -1;
+    }
+  return 0;
+}
+
+/*!
+ * Writes the tail of a block after its data.
+ *
+ * @param header the header of the block
+ */
+
+static inline void
+kh_set_tail (struct kh_header *header)
+{
+  struct kh_tail *tail = kh_tail (header);
+  tail->magic = KH_TAIL_MAGIC;
+  tail->reserved = 0;
+  tail->header = header;
+}
+
+static void
+kh_insert (struct kh_header *header)
+{
+  struct kh_links *links = kh_links (header);
+  unsigned int fl;
+  unsigned int sl;
+  kh_size_class (header->size, &fl, &sl);
+  links->prev = NULL;
+  links->next = kh_free_lists[fl][sl];
+  if (links->next)
+    kh_links (links->next)->prev = header;
+  kh_free_lists[fl][sl] = header;
+  kh_fl_bitmap |= 1UL << fl;
+  kh_sl_bitmap[fl] |= 1U << sl;
+  kh_stats.free += header->size;
+}
+
+static void
+kh_remove (struct kh_header *header)
+{
+  struct kh_links *links = kh_links (header);
+  unsigned int fl;
+  unsigned int sl;
+  kh_size_class (header->size, &fl, &sl);
+  if (links->prev)
+    kh_links (links->prev)->next = links->next;
+  else
+    {
+      kh_free_lists[fl][sl] = links->next;
+      if (!links->next)
+	{
+	  kh_sl_bitmap[fl] &= ~(1U << sl);
+	  if (!kh_sl_bitmap[fl])
+	    kh_fl_bitmap &= ~(1UL << fl);
+	}
+    }
+  if (links->next)
+    kh_links (links->next)->prev = links->prev;
+  kh_stats.free -= header->size;
+}
+
+/*!
+ * Adjusts the number of bytes in allocated blocks.
+ *
+ * @param add the number of bytes allocated
+ * @param sub the number of bytes freed
+ */
+
+static inline void
+kh_account (size_t add, size_t sub)
+{
+  kh_stats.used += add - sub;
+  if (kh_stats.used > kh_stats.peak)
+    kh_stats.peak = kh_stats.used;
+}
+
+/*!
+ * Finds a free block at least as large as a requested size. The size is
+ * rounded up to the next size class, so any block in the class found is
+ * large enough.
+ *
+ * @param size the minimum size of the block data
+ * @return the header of the block, or NULL if no block is large enough
+ */
+
+static struct kh_header *
+kh_find_free (size_t size)
+{
+  unsigned int fl;
+  unsigned int sl;
+  uint32_t sl_map;
+  uint64_t fl_map;
+  if (size >= KH_SMALL_SIZE)
+    size += (1UL << (63 - __builtin_clzl (size)
+		     - __builtin_ctz (KH_SL_COUNT))) - 1;
+  kh_size_class (size, &fl, &sl);
+  if (fl >= KH_FL_COUNT)
+    return NULL;
+
+  sl_map = kh_sl_bitmap[fl] & (~0U << sl);
+  if (!sl_map)
+    {
+      fl_map = kh_fl_bitmap & (~0UL << (fl + 1));
+      if (!fl_map)
+	return NULL;
+      fl = __builtin_ctzl (fl_map);
+      sl_map = kh_sl_bitmap[fl];
+    }
+  return kh_free_lists[fl][__builtin_ctz (sl_map)];
+}
+
+/*!
+ * Shrinks a block to a size, creating a new block from the remaining space
+ * if it is large enough.
+ *
+ * @param header the header of the block
+ * @param size the new size of the block data
+ * @return the header of the new block, or NULL if the block was not split
+ */
+
+static struct kh_header *
+kh_split (struct kh_header *header, size_t size)
+{
+  struct kh_header *rest;
+  if (header->size < size + KH_BLOCK_OVERHEAD + KH_MIN_BLOCK_SPLIT_SIZE)
+    return NULL;
+  rest = (struct kh_header *) ((uintptr_t) (header + 1) + size
+			       + sizeof (struct kh_tail));
+  rest->magic = KH_HEADER_MAGIC;
+  rest->flags = 0;
+  rest->size = header->size - size - KH_BLOCK_OVERHEAD;
+  kh_tail (header)->header = rest;
+  header->size = size;
+  kh_set_tail (header);
+  return rest;
+}
+
+/*!
+ * Marks a block as free, unifies it with adjacent free blocks and adds the
+ * result to its free list.
+ *
+ * @param header the header of the block
+ */
+
+static void
+kh_release (struct kh_header *header)
+{
+  struct kh_header *prev = kh_prev (header);
+  struct kh_header *next = kh_next (header);
+  header->flags &= ~(KH_FLAG_ALLOC | KH_FLAG_CACHED | KH_FLAG_TAG_MASK);
+  if (prev && !(prev->flags & KH_FLAG_ALLOC))
+    {
+      kh_remove (prev);
+      prev->size += KH_BLOCK_OVERHEAD + header->size;
+      kh_tail (prev)->header = prev;
+      header = prev;
+    }
+  if (next && !(next->flags & KH_FLAG_ALLOC))
+    {
+      kh_remove (next);
+      header->size += KH_BLOCK_OVERHEAD + next->size;
+      kh_tail (header)->header = header;
+    }
+  kh_insert (header);
+}
+
+/*!
+ * Rounds up a requested allocation size so all memory accesses are aligned
+ * and a freed block can hold its free list links.
+ *
+ * @param size the requested size
+ * @return the size of the block data to allocate
+ */
+
+static inline size_t
+kh_block_size (size_t size)
+{
+  size = ALIGN_UP (size, KH_DEFAULT_ALIGN);
+  return size < sizeof (struct kh_links) ? sizeof (struct kh_links) : size;
+}
+
+/*!
+ * Maps more memory at the end of the kernel heap, so that a free block of
+ * at least a given size is available. The new memory is unified with a
+ * free block at the end of the heap. The heap lock must be held.
+ *
+ * @param size the minimum size of the block data
+ * @return the header of a large enough free block, or NULL if the heap
+ * could not grow
+ */
+
+static struct kh_header *
+kh_grow (size_t size)
+{
+  struct kh_header *header;
+  size_t len;
+
+  /* Free blocks are searched by rounding up to the next size class, so
+     the new block must be large enough for the rounded size */
+  len = ALIGN_UP (size + size / KH_SL_COUNT + KH_BLOCK_OVERHEAD, KH_GROW_SIZE);
+  if (UNLIKELY (len > KERNEL_HEAP_TOP_VMA - kh_grow_addr))
+    RETV_ERROR (ENOMEM, NULL);
+  if (vm_alloc_range (kernel_pml4t, (void *) kh_grow_addr, len,
+		      PAGE_FLAG_RW | PAGE_FLAG_GLOBAL))
+    return NULL;
+
+  header = (struct kh_header *) kh_grow_addr;
+  header->magic = KH_HEADER_MAGIC;
+  header->flags = KH_FLAG_ALLOC;
+  header->size = len - KH_BLOCK_OVERHEAD;
+  kh_grow_addr += len;
+  kh_set_tail (header);
+  kh_release (header);
+  kh_stats.size += len - KH_BLOCK_OVERHEAD;
+  kh_stats.grown += len;
+  kh_stats.grows++;
+  return kh_find_free (size);
+}
+
 /*!
  * Initializes the kernel heap.
  *
@@ -38,19 +399,99 @@ void
 kh_init (uintptr_t base, size_t size)
 {
   struct kh_header *header;
-  struct kh_tail *tail;
 
   kh_base_addr = base;
+  kh_end_addr = base + size;
   header = (struct kh_header *) base;
   header->magic = KH_HEADER_MAGIC;
   header->flags = 0;
-  header->size = size - sizeof (struct kh_header) - sizeof (struct kh_tail);
+  header->size = size - KH_BLOCK_OVERHEAD;
+  kh_set_tail (header);
+  kh_insert (header);
+  kh_stats.size = header->size;
+}
 
-  kh_end_addr = base + size;
-  tail = (struct kh_tail *) kh_end_addr - 1;
-  tail->magic = KH_TAIL_MAGIC;
-  tail->reserved = 0;
-  tail->header = header;
+/*!
+ * Allocates a block of memory on the kernel heap. A free block from the
+ * smallest size class that is guaranteed to fit the request is used, so
+ * the time taken does not depend on the number of blocks in the heap. The
+ * heap lock must be held.
+ *
+ * @param size the size of the block data, from kh_block_size()
+ * @param align the required alignment of the returned pointer
+ * @return a pointer to the new block, or NULL if the allocation failed
+ */
+
+static void *
+kh_alloc_locked (size_t size, size_t align)
+{
+  struct kh_header *header;
+  struct kh_header *rest;
+  uintptr_t block;
+  size_t search;
+
+  /* Leave room to split off a free block in front of an aligned block */
+  search = size;
+  if (align > KH_DEFAULT_ALIGN)
+    search += align + KH_BLOCK_OVERHEAD + KH_MIN_BLOCK_SPLIT_SIZE;
+
+  header = kh_find_free (search);
+  if (!header)
+    {
+      header = kh_grow (search);
+      if (UNLIKELY (!header))
+	RETV_ERROR (ENOMEM, NULL);
+    }
+  if (UNLIKELY (kh_check (header)))
+    RETV_ERROR (EUCLEAN, NULL);
+  kh_remove (header);
+
+  block = (uintptr_t) (header + 1);
+  if (block & (align - 1))
+    {
+      /* Move the block up to the requested alignment and free the space
+	 in front of it */
+      uintptr_t aligned = ALIGN_UP (block + KH_BLOCK_OVERHEAD
+				    + KH_MIN_BLOCK_SPLIT_SIZE, align);
+      struct kh_header *aligned_header = (struct kh_header *) aligned - 1;
+      aligned_header->magic = KH_HEADER_MAGIC;
+      aligned_header->flags = 0;
+      aligned_header->size = header->size - (aligned - block);
+      kh_tail (aligned_header)->header = aligned_header;
+      header->size = (uintptr_t) aligned_header - sizeof (struct kh_tail)
+	- block;
+      kh_set_tail (header);
+      kh_insert (header);
+      header = aligned_header;
+    }
+
+  /* The blocks adjacent to a free block are allocated, so the remaining
+     space can be added to a free list without unifying it */
+  rest = kh_split (header, size);
+  if (rest)
+    kh_insert (rest);
+  header->flags |= KH_FLAG_ALLOC;
+  kh_account (header->size, 0);
+  return header + 1;
+}
+
+/*!
+ * Unallocates a block on the kernel heap. The heap lock must be held.
+ *
+ * @param ptr the pointer to free
+ */
+
+static void
+kh_free_locked (void *ptr)
+{
+  struct kh_header *header = (struct kh_header *) ptr - 1;
+  if (UNLIKELY (kh_check (header) || !(header->flags & KH_FLAG_ALLOC)))
+    {
+      debug_printf ("invalid pointer");
+      RET_ERROR (EFAULT);
+    }
+  kh_account (0, header->size);
+  kh_release (header);
 }
 
 /*!
@@ -64,157 +505,62 @@ kh_init (uintptr_t base, size_t size)
 void *
 kh_alloc_aligned (size_t size, size_t align)
 {
-  struct kh_header *header = (struct kh_header *) kh_base_addr;
-  struct kh_tail *tail;
-  void *block;
+  void *ptr;
 
   /* Check that the requested alignment is a power of two */
   if (UNLIKELY (!IS_P2 (align)))
     RETV_ERROR (EINVAL, NULL);
-
-  /* Align the requested size to the default alignment so all memory
-     accesses are aligned */
-  size = ALIGN_UP (size, KH_DEFAULT_ALIGN);
+  if (align < KH_DEFAULT_ALIGN)
+    align = KH_DEFAULT_ALIGN;
 
   spinlock_acquire (&kh_lock);
-  while (1)
-    {
-      if (UNLIKELY (header >= (struct kh_header *) kh_end_addr))
-	{
-	  /* Reached the end of the heap and no suitable block was found */
-	  spinlock_release (&kh_lock);
-	  RETV_ERROR (ENOMEM, NULL);
-	}
-      if (UNLIKELY (header->magic != KH_HEADER_MAGIC))
-	{
-	  spinlock_release (&kh_lock);
-	  debug_printf ("bad magic number in header block\n");
-	  RETV_ERROR (EUCLEAN, NULL);
-	}
-
-      /* Check that the tail block is valid */
-      tail = (struct kh_tail *) ((uintptr_t) header + header->size +
-				 sizeof (struct kh_header));
-      if (UNLIKELY (tail->magic != KH_TAIL_MAGIC || tail->header != header))
-	{
-	  spinlock_release (&kh_lock);
-	  debug_printf ("invalid tail block for header block\n");
-	  RETV_ERROR (EUCLEAN, NULL);
-	}
-
-      /* Check if the header is free */
-      block = (void *) ((uintptr_t) header + sizeof (struct kh_header));
-      if (!(header->flags & KH_FLAG_ALLOC))
-	{
-	  /* Align the pointer to the requested alignment and check if
-	     the block is large enough to fit the requested size */
-	  block = ALIGN_UP (block, align);
-	  if (block < (void *) tail
-	      && (uintptr_t) tail - (uintptr_t) block >= size)
-	    {
-	      struct kh_header *aligned_header = (struct kh_header *) block - 1;
-	      size_t diff = (uintptr_t) aligned_header - (uintptr_t) header;
-	      if (diff > 0 && diff < sizeof (struct kh_header) +
-		  sizeof (struct kh_tail) && header == (void *) kh_base_addr)
-		{
-		  /* No space to fit an empty block, move to the next
-		     possible pointer */
-		  aligned_header =
-		    (struct kh_header *) ((uintptr_t) aligned_header + align);
-		  diff += align;
-		}
-	      memcpy (aligned_header, header, sizeof (struct kh_header));
-	      aligned_header->size -= diff;
-	      if (diff > KH_MIN_BLOCK_SPLIT_SIZE + sizeof (struct kh_header) +
-		  sizeof (struct kh_tail))
-		{
-		  /* Add a new free block in between the old header and
-		     the new aligned header */
-		  struct kh_tail *prev_tail;
-		  header->size = diff - sizeof (struct kh_header) -
-		    sizeof (struct kh_tail);
-		  prev_tail = (struct kh_tail *) aligned_header - 1;
-		  prev_tail->magic = KH_TAIL_MAGIC;
-		  prev_tail->reserved = 0;
-		  prev_tail->header = header;
-		}
-	      else if (diff > 0)
-		{
-		  struct kh_tail *prev_tail = (struct kh_tail *) header - 1;
-		  if (prev_tail < (struct kh_tail *) kh_base_addr)
-		    {
-		      /* This is the first block of the heap, we must make
-			 a new block even if its size is zero since we cannot
-			 change the starting location of the heap */
-		      struct kh_header *first_header =
-			(struct kh_header *) kh_base_addr;
-		      first_header->magic = KH_HEADER_MAGIC;
-		      first_header->flags = 0;
-		      first_header->size = diff - sizeof (struct kh_header) -
-			sizeof (struct kh_tail);
-
-		      prev_tail =
-			(struct kh_tail *) ((uintptr_t) kh_base_addr +
-					    sizeof (struct kh_header) +
-					    first_header->size);
-		      prev_tail->magic = KH_TAIL_MAGIC;
-		      prev_tail->reserved = 0;
-		      prev_tail->header = first_header;
-		    }
-		  else
-		    {
-		      /* Increase the size of the previous block up to
-			 the new aligned block */
-		      struct kh_tail *new_tail;
-		      prev_tail->header->size += diff;
-		      new_tail = (struct kh_tail *) aligned_header - 1;
-		      memcpy (new_tail, prev_tail, sizeof (struct kh_tail));
-		    }
-		  tail->header = aligned_header;
-		}
-
-	      /* We found a suitable header, stop searching */
-	      header = aligned_header;
-	      break;
-	    }
-	}
+  ptr = kh_alloc_locked (kh_block_size (size), align);
+  spinlock_release (&kh_lock);
+  return ptr;
+}
 
-      /* Move to the next header */
-      header = (struct kh_header *) (tail + 1);
-    }
+/*!
+ * Allocates several blocks of the same size on the kernel heap, taking the
+ * heap lock only once.
+ *
+ * @param size the minimum size of each block
+ * @param ptrs the array to store pointers to the blocks
+ * @param count the number of blocks to allocate
+ * @return the number of blocks allocated
+ */
 
-  /* If the header is large enough that we can create another header using
-     the free space, shrink the header and insert one after to fill the
-     extra space */
-  if (header->size >= size + sizeof (struct kh_header) +
-      sizeof (struct kh_tail) + KH_MIN_BLOCK_SPLIT_SIZE)
+size_t
+kh_alloc_batch (size_t size, void **ptrs, size_t count)
+{
+  size_t i;
+  size = kh_block_size (size);
+  spinlock_acquire (&kh_lock);
+  for (i = 0; i < count; i++)
     {
-      struct kh_header *new_header;
-      struct kh_tail *new_tail;
-
-      /* Create a new tail to match the current header */
-      new_tail = (struct kh_tail *) ((uintptr_t) header +
-				     sizeof (struct kh_header) + size);
-      new_tail->magic = KH_TAIL_MAGIC;
-      new_tail->reserved = 0;
-      new_tail->header = header;
-
-      /* Create a new header for the remaining space in the old block */
-      new_header = (struct kh_header *) (new_tail + 1);
-      new_header->magic = KH_HEADER_MAGIC;
-      new_header->flags = header->flags;
-      new_header->size = header->size - size - sizeof (struct kh_header) -
-	sizeof (struct kh_tail);
-      tail->header = new_header;
-
-      /* Shrink the header to the requested size */
-      header->size = size;
+      ptrs[i] = kh_alloc_locked (size, KH_DEFAULT_ALIGN);
+      if (UNLIKELY (!ptrs[i]))
+	break;
     }
+  spinlock_release (&kh_lock);
+  return i;
+}
 
-  /* Mark the header as allocated and return the pointer to its data */
-  header->flags |= KH_FLAG_ALLOC;
+/*!
+ * Unallocates several blocks on the kernel heap, taking the heap lock only
+ * once.
+ *
+ * @param ptrs the array of pointers to free
+ * @param count the number of pointers
+ */
+
+void
+kh_free_batch (void **ptrs, size_t count)
+{
+  size_t i;
+  spinlock_acquire (&kh_lock);
+  for (i = 0; i < count; i++)
+    kh_free_locked (ptrs[i]);
   spinlock_release (&kh_lock);
-  return block;
 }
 
 /*!
@@ -231,14 +577,16 @@ void *
 kh_realloc (void *ptr, size_t size)
 {
   struct kh_header *header = (struct kh_header *) ptr - 1;
+  struct kh_header *next;
+  struct kh_header *rest;
+  void *new_ptr;
+  size_t old_size;
   if (!ptr)
     return kh_alloc_aligned (size, KH_DEFAULT_ALIGN);
-  /* Align the requested size to the default alignment so all memory
-     accesses are aligned */
-  size = ALIGN_UP (size, KH_DEFAULT_ALIGN);
+  size = kh_block_size (size);
 
   spinlock_acquire (&kh_lock);
-  if (UNLIKELY (header->magic != KH_HEADER_MAGIC))
+  if (UNLIKELY (kh_check (header)))
     {
       spinlock_release (&kh_lock);
       debug_printf ("invalid pointer");
@@ -250,94 +598,44 @@ kh_realloc (void *ptr, size_t size)
       return kh_alloc_aligned (size, KH_DEFAULT_ALIGN);
     }
 
-  if (size > header->size)
+  old_size = header->size;
+  if (size <= header->size)
     {
-      /* We are requesting more memory than available in the current block.
-	 If the next block is free and unifying it with the current block
-	 would make it large enough, do it, otherwise allocate a new block
-	 and copy the data over. */
-      struct kh_header *next_header =
-	(struct kh_header *) ((uintptr_t) header + sizeof (struct kh_header) +
-			      sizeof (struct kh_tail) + header->size);
-      if (next_header < (struct kh_header *) kh_end_addr
-	  && !(next_header->flags & KH_FLAG_ALLOC) && header->size +
-	  sizeof (struct kh_header) + sizeof (struct kh_tail) +
-	  next_header->size >= size)
-	{
-	  struct kh_tail *next_tail =
-	    (struct kh_tail *) ((uintptr_t) next_header +
-				sizeof (struct kh_header) + next_header->size);
-	  size_t extra = sizeof (struct kh_header) + sizeof (struct kh_tail) +
-	    next_header->size;
-	  size_t needed = size - header->size;
-	  if (extra - needed >= sizeof (struct kh_header) +
-	      sizeof (struct kh_tail) + KH_MIN_BLOCK_SPLIT_SIZE)
-	    {
-	      /* Create a new block to hold the remaining space instead of
-		 using it all for the allocated block */
-	      struct kh_header *new_header;
-	      struct kh_tail *new_tail;
-	      size_t next_size = next_header->size;
-
-	      new_tail = (struct kh_tail *) ((uintptr_t) header +
-					     sizeof (struct kh_header) + size);
-	      new_tail->magic = KH_TAIL_MAGIC;
-	      new_tail->reserved = 0;
-	      new_tail->header = header;
-
-	      new_header = (struct kh_header *) (new_tail + 1);
-	      new_header->magic = KH_HEADER_MAGIC;
-	      new_header->flags = header->flags & ~KH_FLAG_ALLOC;
-	      new_header->size = header->size + next_size - size;
-	      header->size = size;
-	      next_tail->header = new_header;
-	    }
-	  else
-	    {
-	      next_tail->header = header;
-	      header->size += extra;
-	    }
-	}
-      else
-	{
-	  void *new_ptr;
-	  spinlock_release (&kh_lock);
-	  new_ptr = kh_alloc_aligned (size, KH_DEFAULT_ALIGN);
-	  if (UNLIKELY (!new_ptr))
-	    return NULL;
-	  memcpy (new_ptr, ptr, header->size);
-	  kh_free (ptr);
-	  return new_ptr;
-	}
+      /* Free the end of the block if it is large enough to make a new
+	 free block */
+      rest = kh_split (header, size);
+      if (rest)
+	kh_release (rest);
+      kh_account (header->size, old_size);
+      spinlock_release (&kh_lock);
+      return ptr;
     }
-  /* We are requesting less memory than the block contains. If the
-     freed memory is large enough to make a new free block, make one. */
-  else if (header->size - size >= sizeof (struct kh_header) +
-	   sizeof (struct kh_tail) + KH_MIN_BLOCK_SPLIT_SIZE)
+
+  /* If the next block is free and unifying it with the current block
+     would make it large enough, do it, otherwise allocate a new block
+     and copy the data over */
+  next = kh_next (header);
+  if (next && !(next->flags & KH_FLAG_ALLOC)
+      && header->size + KH_BLOCK_OVERHEAD + next->size >= size)
     {
-      struct kh_header *next_header;
-      struct kh_tail *tail;
-      struct kh_tail *next_tail;
-
-      tail = (struct kh_tail *) ((uintptr_t) header +
-				 sizeof (struct kh_header) + size);
-      tail->magic = KH_TAIL_MAGIC;
-      tail->reserved = 0;
-      tail->header = header;
-
-      next_header = (struct kh_header *) (tail + 1);
-      next_header->magic = KH_HEADER_MAGIC;
-      next_header->flags = header->flags & ~KH_FLAG_ALLOC;
-      next_header->size = header->size - size - sizeof (struct kh_header) -
-	sizeof (struct kh_tail);
-
-      next_tail = (struct kh_tail *) ((uintptr_t) header +
-				      sizeof (struct kh_header) + header->size);
-      next_tail->header = next_header;
-      header->size = size;
+      kh_remove (next);
+      header->size += KH_BLOCK_OVERHEAD + next->size;
+      kh_tail (header)->header = header;
+      rest = kh_split (header, size);
+      if (rest)
+	kh_insert (rest);
+      kh_account (header->size, old_size);
+      spinlock_release (&kh_lock);
+      return ptr;
     }
   spinlock_release (&kh_lock);
-  return ptr;
+
+  new_ptr = kh_alloc_aligned (size, KH_DEFAULT_ALIGN);
+  if (UNLIKELY (!new_ptr))
+    return NULL;
+  memcpy (new_ptr, ptr, old_size);
+  kh_free (ptr);
+  return new_ptr;
 }
 
 /*!
@@ -350,50 +648,43 @@ kh_realloc (void *ptr, size_t size)
 void
 kh_free (void *ptr)
 {
-  struct kh_header *header;
-  struct kh_header *next_header;
-  struct kh_tail *tail;
-  struct kh_tail *next_tail;
   if (!ptr)
     return;
-
-  /* Validate the pointer's header and mark it as free */
   spinlock_acquire (&kh_lock);
-  header = (struct kh_header *) ptr - 1;
-  if (UNLIKELY (header->magic != KH_HEADER_MAGIC))
-    {
-      spinlock_release (&kh_lock);
-      debug_printf ("invalid pointer");
-      RET_ERROR (EFAULT);
-    }
-  header->flags &= ~KH_FLAG_ALLOC;
+  kh_free_locked (ptr);
+  spinlock_release (&kh_lock);
+}
 
-  /* Unify this block with a preceding free block */
-  tail = (struct kh_tail *) header - 1;
-  if (tail >= (struct kh_tail *) kh_base_addr
-      && header->flags == tail->header->flags)
-    {
-      tail->header->size += header->size + sizeof (struct kh_header) +
-	sizeof (struct kh_tail);
-      next_tail = (struct kh_tail *) ((uintptr_t) header +
-				      sizeof (struct kh_header) + header->size);
-      next_tail->header = tail->header;
-      header = tail->header;
-    }
+/*!
+ * Determines the size of the largest free block in the kernel heap. Only
+ * the highest nonempty size class needs to be searched.
+ *
+ * @param lock whether to take the heap lock, which should only be skipped
+ * when the system is halting
+ * @return the size of the data of the largest free block
+ */
 
-  /* Unify this block with a following free block */
-  next_header =
-    (struct kh_header *) ((uintptr_t) header + sizeof (struct kh_header) +
-			  sizeof (struct kh_tail) + header->size);
-  if (next_header < (struct kh_header *) kh_end_addr
-      && header->flags == next_header->flags)
+size_t
+kh_largest_free (int lock)
+{
+  struct kh_header *header;
+  unsigned int fl;
+  unsigned int sl;
+  size_t size = 0;
+  if (lock)
+    spinlock_acquire (&kh_lock);
+  if (kh_fl_bitmap)
     {
-      header->size += sizeof (struct kh_header) + sizeof (struct kh_tail) +
-	next_header->size;
-      next_tail = (struct kh_tail *) ((uintptr_t) next_header +
-				      sizeof (struct kh_header) +
-				      next_header->size);
-      next_tail->header = header;
+      fl = 63 - __builtin_clzl (kh_fl_bitmap);
+      sl = 31 - __builtin_clz (kh_sl_bitmap[fl]);
+      for (header = kh_free_lists[fl][sl]; header;
+	   header = kh_links (header)->next)
+	{
+	  if (header->size > size)
+	    size = header->size;
+	}
     }
-  spinlock_release (&kh_lock);
+  if (lock)
+    spinlock_release (&kh_lock);
+  return size;
 }
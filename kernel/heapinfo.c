@@ -0,0 +1,339 @@
+/* heapinfo.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/alloc.h>
+#include <pml/interrupt.h>
+#include <pml/lock.h>
+#include <pml/memory.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*! Tag of blocks that are counted but whose call site is not tracked */
+#define HEAPINFO_UNTRACKED      (HEAPINFO_CALLERS + 1)
+
+/*!
+ * Live allocations made from a call site. Each accounted block is tagged
+ * with the index of its call site plus one, so freeing the block updates
+ * the call site that allocated it. Blocks with a zero tag were allocated
+ * before accounting was enabled and are ignored.
+ */
+
+struct heapinfo_caller
+{
+  void *addr;                   /*!< Return address of the allocation */
+  size_t live;                  /*!< Number of live allocations */
+  size_t bytes;                 /*!< Bytes in live allocations */
+  size_t allocs;                /*!< Total number of allocations */
+};
+
+static lock_t heapinfo_lock;
+static struct heapinfo_caller heapinfo_callers[HEAPINFO_CALLERS];
+static size_t heapinfo_allocs[HEAPINFO_CLASSES];
+static size_t heapinfo_live[HEAPINFO_CLASSES];
+static size_t heapinfo_untracked;
+static size_t heapinfo_used;
+static size_t heapinfo_peak;
+static char heapinfo_dump_buffer[HEAPINFO_BUFFER_SIZE];
+
+/*!
+ * Determines the size and call site tag of an allocated block.
+ *
+ * @param ptr the block
+ * @param tag pointer to store the tag
+ * @return the size of the block
+ */
+
+static size_t
+heapinfo_block (void *ptr, unsigned int *tag)
+{
+  struct kh_header *header;
+  if (IS_VMALLOC_ADDR (ptr))
+    {
+      *tag = vmalloc_tag (ptr);
+      return vmalloc_size (ptr);
+    }
+  header = (struct kh_header *) ptr - 1;
+  *tag = (header->flags & KH_FLAG_TAG_MASK) >> KH_FLAG_TAG_SHIFT;
+  return header->size;
+}
+
+static void
+heapinfo_set_tag (void *ptr, unsigned int tag)
+{
+  struct kh_header *header;
+  if (IS_VMALLOC_ADDR (ptr))
+    vmalloc_set_tag (ptr, tag);
+  else
+    {
+      header = (struct kh_header *) ptr - 1;
+      header->flags = (header->flags & ~KH_FLAG_TAG_MASK)
+	| tag << KH_FLAG_TAG_SHIFT;
+    }
+}
+
+/*!
+ * Determines the histogram class of a block size. Class @e n counts blocks
+ * of at most 2<sup>n + 4</sup> bytes, and the last class also counts all
+ * larger blocks.
+ *
+ * @param size the size of the block
+ * @return the histogram class
+ */
+
+static inline unsigned int
+heapinfo_class (size_t size)
+{
+  unsigned int class;
+  if (size <= 16)
+    return 0;
+  class = 64 - __builtin_clzl (size - 1) - 4;
+  return class < HEAPINFO_CLASSES ? class : HEAPINFO_CLASSES - 1;
+}
+
+/*!
+ * Finds the tag of a call site, adding the call site to the table if it is
+ * new. The heap accounting lock must be held.
+ *
+ * @param addr the return address of the allocation
+ * @return the tag of the call site
+ */
+
+static unsigned int
+heapinfo_lookup (void *addr)
+{
+  size_t index = (uintptr_t) addr % HEAPINFO_CALLERS;
+  size_t i;
+  for (i = 0; i < HEAPINFO_CALLERS; i++)
+    {
+      struct heapinfo_caller *caller = heapinfo_callers + index;
+      if (caller->addr == addr)
+	return index + 1;
+      if (!caller->addr)
+	{
+	  caller->addr = addr;
+	  return index + 1;
+	}
+      index = (index + 1) % HEAPINFO_CALLERS;
+    }
+  return HEAPINFO_UNTRACKED;
+}
+
+/*!
+ * Records an allocation made through the kernel heap interface.
+ *
+ * @param ptr the allocated block, or NULL if the allocation failed
+ * @param caller the return address of the allocation function
+ */
+
+void
+heapinfo_alloc (void *ptr, void *caller)
+{
+  unsigned int class;
+  unsigned int tag;
+  unsigned long flags;
+  size_t size;
+  if (!ptr)
+    return;
+  size = heapinfo_block (ptr, &tag);
+  class = heapinfo_class (size);
+
+  flags = int_save_disable ();
+  spinlock_acquire (&heapinfo_lock);
+  tag = heapinfo_lookup (caller);
+  if (tag == HEAPINFO_UNTRACKED)
+    heapinfo_untracked++;
+  else
+    {
+      struct heapinfo_caller *c = heapinfo_callers + tag - 1;
+      c->live++;
+      c->bytes += size;
+      c->allocs++;
+    }
+  heapinfo_allocs[class]++;
+  heapinfo_live[class]++;
+  heapinfo_used += size;
+  if (heapinfo_used > heapinfo_peak)
+    heapinfo_peak = heapinfo_used;
+  spinlock_release (&heapinfo_lock);
+  int_restore (flags);
+  heapinfo_set_tag (ptr, tag);
+}
+
+/*!
+ * Records a block being freed through the kernel heap interface. The tag of
+ * the block is cleared, so a block that is freed again inside the heap
+ * interface is not counted twice.
+ *
+ * @param ptr the block to free
+ */
+
+void
+heapinfo_free (void *ptr)
+{
+  unsigned int tag;
+  unsigned long flags;
+  size_t size;
+  if (!ptr)
+    return;
+  size = heapinfo_block (ptr, &tag);
+  if (!tag || tag > HEAPINFO_UNTRACKED)
+    return;
+
+  flags = int_save_disable ();
+  spinlock_acquire (&heapinfo_lock);
+  if (tag == HEAPINFO_UNTRACKED)
+    heapinfo_untracked--;
+  else
+    {
+      struct heapinfo_caller *c = heapinfo_callers + tag - 1;
+      c->live--;
+      c->bytes -= size;
+    }
+  heapinfo_live[heapinfo_class (size)]--;
+  heapinfo_used -= size;
+  spinlock_release (&heapinfo_lock);
+  int_restore (flags);
+  heapinfo_set_tag (ptr, 0);
+}
+
+/*!
+ * Writes a report of kernel heap usage to a buffer. The counters are read
+ * without locking, so the report may be slightly inconsistent if the heap
+ * is in use.
+ *
+ * @param buffer the buffer to write to
+ * @param len size of the buffer
+ * @param lock whether the heap lock may be taken
+ * @return the number of characters written, not including the terminating
+ * null character
+ */
+
+static size_t
+heapinfo_format (char *buffer, size_t len, int lock)
+{
+  size_t top[HEAPINFO_TOP_CALLERS];
+  size_t count = 0;
+  size_t largest = kh_largest_free (lock);
+  size_t n = 0;
+  size_t i;
+
+#define HEAPINFO_PRINT(...)						\
+  do									\
+    {									\
+      if (n < len)							\
+	n += snprintf (buffer + n, len - n, __VA_ARGS__);		\
+    }									\
+  while (0)
+
+  HEAPINFO_PRINT ("HeapSize:       %lu kB\n", kh_stats.size / 1024);
+  HEAPINFO_PRINT ("HeapUsed:       %lu kB\n", kh_stats.used / 1024);
+  HEAPINFO_PRINT ("HeapPeak:       %lu kB\n", kh_stats.peak / 1024);
+  HEAPINFO_PRINT ("HeapFree:       %lu kB\n", kh_stats.free / 1024);
+  HEAPINFO_PRINT ("LargestFree:    %lu kB\n", largest / 1024);
+  if (kh_stats.free)
+    {
+      /* Fraction of free memory not in the largest free block */
+      size_t frag = (kh_stats.free - largest) * 10000 / kh_stats.free;
+      HEAPINFO_PRINT ("Fragmentation:  %lu.%02lu%%\n", frag / 100,
+		      frag % 100);
+    }
+  if (!boot_options.heapinfo)
+    goto end;
+
+  HEAPINFO_PRINT ("AllocUsed:      %lu kB\n", heapinfo_used / 1024);
+  HEAPINFO_PRINT ("AllocPeak:      %lu kB\n", heapinfo_peak / 1024);
+  HEAPINFO_PRINT ("Untracked:      %lu\n", heapinfo_untracked);
+  for (i = 0; i < HEAPINFO_CLASSES; i++)
+    {
+      if (heapinfo_allocs[i])
+	HEAPINFO_PRINT ("Size %-10lu  %lu live, %lu allocs\n", 16UL << i,
+			heapinfo_live[i], heapinfo_allocs[i]);
+    }
+
+  /* List the call sites with the most live bytes */
+  for (i = 0; i < HEAPINFO_CALLERS; i++)
+    {
+      struct heapinfo_caller *caller = heapinfo_callers + i;
+      size_t j;
+      if (!caller->live)
+	continue;
+      if (count < HEAPINFO_TOP_CALLERS)
+	count++;
+      else if (caller->bytes <= heapinfo_callers[top[count - 1]].bytes)
+	continue;
+      for (j = count - 1;
+	   j && heapinfo_callers[top[j - 1]].bytes < caller->bytes; j--)
+	top[j] = top[j - 1];
+      top[j] = i;
+    }
+  for (i = 0; i < count; i++)
+    {
+      struct heapinfo_caller *caller = heapinfo_callers + top[i];
+      HEAPINFO_PRINT ("Caller %p  %lu live, %lu bytes, %lu allocs\n",
+		      caller->addr, caller->live, caller->bytes,
+		      caller->allocs);
+    }
+
+#undef HEAPINFO_PRINT
+ end:
+  return n < len ? n : len - 1;
+}
+
+/*!
+ * Reads from the text report of kernel heap usage, which is generated when
+ * this function is called.
+ *
+ * @param buffer the buffer to store the data read
+ * @param len the maximum number of bytes to read
+ * @param offset the offset in the report to start reading from
+ * @return the number of bytes read, or -1 on failure
+ */
+
+ssize_t
+heapinfo_read (void *buffer, size_t len, off_t offset)
+{
+  char *report = malloc (HEAPINFO_BUFFER_SIZE);
+  size_t report_len;
+  if (UNLIKELY (!report))
+    RETV_ERROR (ENOMEM, -1);
+  report_len = heapinfo_format (report, HEAPINFO_BUFFER_SIZE, 1);
+  if (offset < 0 || (size_t) offset >= report_len)
+    len = 0;
+  else if (len > report_len - offset)
+    len = report_len - offset;
+  memcpy (buffer, report + offset, len);
+  free (report);
+  return len;
+}
+
+/*!
+ * Prints the report of kernel heap usage to the console if heap accounting
+ * is enabled. This is called on a kernel panic, so no memory is allocated
+ * and the heap lock is not taken.
+ */
+
+void
+heapinfo_dump (void)
+{
+  if (!boot_options.heapinfo)
+    return;
+  heapinfo_format (heapinfo_dump_buffer, HEAPINFO_BUFFER_SIZE, 0);
+  printf ("%s", heapinfo_dump_buffer);
+}
@@ -0,0 +1,144 @@
+/* meminfo.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/alloc.h>
+#include <pml/interrupt.h>
+#include <pml/memory.h>
+#include <pml/swap.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*!
+ * Writes a report of memory allocator statistics to a buffer.
+ *
+ * @param buffer the buffer to write to
+ * @param len size of the buffer
+ * @return the number of characters written, not including the terminating
+ * null character
+ */
+
+static size_t
+meminfo_format (char *buffer, size_t len)
+{
+  struct kmem_cache *cache;
+  size_t n = 0;
+  size_t i;
+
+#define MEMINFO_PRINT(...)						\
+  do									\
+    {									\
+      if (n < len)							\
+	n += snprintf (buffer + n, len - n, __VA_ARGS__);		\
+    }									\
+  while (0)
+
+  MEMINFO_PRINT ("MemTotal:       %lu kB\n", total_phys_mem / 1024);
+  MEMINFO_PRINT ("MemFree:        %lu kB\n",
+		 phys_free_pages * (PAGE_SIZE / 1024));
+  for (i = 0; i < MAX_CORES; i++)
+    {
+      struct page_cache *cache = page_caches + i;
+      if (!cache->hits && !cache->refills)
+	continue;
+      MEMINFO_PRINT ("PageCache%lu:     %lu pages, %lu hits, %lu refills, "
+		     "%lu drains\n", i, cache->count, cache->hits,
+		     cache->refills, cache->drains);
+    }
+  MEMINFO_PRINT ("HeapGrown:      %lu kB\n", kh_stats.grown / 1024);
+  MEMINFO_PRINT ("HeapGrows:      %lu\n", kh_stats.grows);
+  MEMINFO_PRINT ("VmallocUsed:    %lu kB\n",
+		 vmalloc_stats.pages * (PAGE_SIZE / 1024));
+  MEMINFO_PRINT ("VmallocAreas:   %lu\n", vmalloc_stats.areas);
+  MEMINFO_PRINT ("ZeroPool:       %lu pages\n", zero_pool.count);
+  MEMINFO_PRINT ("ZeroPoolHits:   %lu\n", zero_pool.hits);
+  MEMINFO_PRINT ("ZeroPoolMisses: %lu\n", zero_pool.misses);
+  MEMINFO_PRINT ("ZeroPoolFilled: %lu\n", zero_pool.refills);
+  MEMINFO_PRINT ("SwapTotal:      %lu kB\n",
+		 swap_space.slots * (PAGE_SIZE / 1024));
+  MEMINFO_PRINT ("SwapFree:       %lu kB\n",
+		 (swap_space.slots ? swap_space.slots - swap_space.used - 1 : 0)
+		 * (PAGE_SIZE / 1024));
+  MEMINFO_PRINT ("ReclaimScanned: %lu\n", reclaim_stats.scanned);
+  MEMINFO_PRINT ("ReclaimAged:    %lu\n", reclaim_stats.aged);
+  MEMINFO_PRINT ("ReclaimDirect:  %lu\n", reclaim_stats.direct);
+  MEMINFO_PRINT ("FileUnmapped:   %lu\n", reclaim_stats.file_unmapped);
+  MEMINFO_PRINT ("CacheEvicted:   %lu\n", reclaim_stats.cache_evicted);
+  MEMINFO_PRINT ("SwapOuts:       %lu\n", reclaim_stats.swapped_out);
+  MEMINFO_PRINT ("SwapIns:        %lu\n", reclaim_stats.swapped_in);
+  MEMINFO_PRINT ("MergeScanned:   %lu\n", merge_stats.scanned);
+  MEMINFO_PRINT ("MergeMerged:    %lu\n", merge_stats.merged);
+  MEMINFO_PRINT ("MergeShared:    %lu pages\n", merge_stats.shared);
+  MEMINFO_PRINT ("MergeSaved:     %lu pages\n", merge_stats.saved);
+  MEMINFO_PRINT ("ZswapStored:    %lu kB\n",
+		 zswap_stats.stored * (PAGE_SIZE / 1024));
+  MEMINFO_PRINT ("ZswapPool:      %lu kB\n",
+		 zswap_stats.pool_pages * (PAGE_SIZE / 1024));
+  if (zswap_stats.stored_bytes)
+    {
+      size_t ratio = zswap_stats.stored * PAGE_SIZE * 100
+	/ zswap_stats.stored_bytes;
+      MEMINFO_PRINT ("ZswapRatio:     %lu.%02lu\n", ratio / 100, ratio % 100);
+    }
+  MEMINFO_PRINT ("ZswapStores:    %lu\n", zswap_stats.stores);
+  MEMINFO_PRINT ("ZswapRejected:  %lu\n", zswap_stats.rejected);
+  MEMINFO_PRINT ("ZswapPoolFull:  %lu\n", zswap_stats.pool_full);
+  MEMINFO_PRINT ("ZswapLoads:     %lu\n", zswap_stats.loads);
+  if (zswap_stats.loads)
+    MEMINFO_PRINT ("ZswapLoadTime:  %lu ns\n",
+		   zswap_stats.load_ns / zswap_stats.loads);
+  MEMINFO_PRINT ("DiskSwapLoads:  %lu\n", zswap_stats.disk_loads);
+  if (zswap_stats.disk_loads)
+    MEMINFO_PRINT ("DiskLoadTime:   %lu ns\n",
+		   zswap_stats.disk_load_ns / zswap_stats.disk_loads);
+  for (cache = kmem_caches; cache; cache = cache->next)
+    MEMINFO_PRINT ("Slab %-14s  %lu/%lu objects, %lu kB\n", cache->name,
+		   cache->active, cache->slabs * cache->count,
+		   cache->slabs * (PAGE_SIZE << cache->order) / 1024);
+
+#undef MEMINFO_PRINT
+  return n < len ? n : len - 1;
+}
+
+/*!
+ * Reads from the text report of memory allocator statistics, which is
+ * generated when this function is called.
+ *
+ * @param buffer the buffer to store the data read
+ * @param len the maximum number of bytes to read
+ * @param offset the offset in the report to start reading from
+ * @return the number of bytes read, or -1 on failure
+ */
+
+ssize_t
+meminfo_read (void *buffer, size_t len, off_t offset)
+{
+  char *report = malloc (MEMINFO_BUFFER_SIZE);
+  size_t report_len;
+  if (UNLIKELY (!report))
+    RETV_ERROR (ENOMEM, -1);
+  report_len = meminfo_format (report, MEMINFO_BUFFER_SIZE);
+  if (offset < 0 || (size_t) offset >= report_len)
+    len = 0;
+  else if (len > report_len - offset)
+    len = report_len - offset;
+  memcpy (buffer, report + offset, len);
+  free (report);
+  return len;
+}
@@ -23,112 +23,494 @@
 #include <string.h>
 
 /*!
- * Locates a memory region with a base address less than a requested address.
+ * Determines the height of a subtree of memory regions.
  *
- * @param base the address to search with
- * @return the index in the mmap table of the region, or -1 if there is no 
- * mapping satisfying the condition
- * @todo use binary search for performance
+ * @param node the root of the subtree, or NULL
+ * @return the height of the subtree
  */
 
-static ssize_t
-find_region_before (uintptr_t base)
+static inline int
+mmap_height (const struct mmap *node)
 {
-  struct mmap_table *mmaps = &THIS_PROCESS->mmaps;
-  ssize_t i;
-  for (i = 0; (size_t) i < mmaps->len; i++)
+  return node ? node->height : 0;
+}
+
+/*!
+ * Recalculates the height and free gap information of a node in a memory
+ * region tree from its children.
+ *
+ * @param node the node to update
+ */
+
+static void
+mmap_update (struct mmap *node)
+{
+  struct mmap *left = node->left;
+  struct mmap *right = node->right;
+  uintptr_t end = node->base + node->len;
+  int lh = mmap_height (left);
+  int rh = mmap_height (right);
+  node->height = (lh > rh ? lh : rh) + 1;
+  node->low = left ? left->low : node->base;
+  node->high = right ? right->high : end;
+  node->max_gap = 0;
+  if (left)
+    {
+      node->max_gap = left->max_gap;
+      if (node->base - left->high > node->max_gap)
+	node->max_gap = node->base - left->high;
+    }
+  if (right)
     {
-      if (mmaps->table[i].base >= base)
-	return i - 1;
+      if (right->max_gap > node->max_gap)
+	node->max_gap = right->max_gap;
+      if (right->low - end > node->max_gap)
+	node->max_gap = right->low - end;
     }
-  return mmaps->len - 1;
 }
 
 /*!
- * Locates a memory region with a base address less than or equal to a 
- * requested address.
+ * Rotates a subtree of memory regions to the left, making the right child
+ * of its root the new root.
  *
- * @param base the address to search with
- * @return the index in the mmap table of the region, or -1 if there is no 
- * mapping satisfying the condition
- * @todo use binary search for performance
+ * @param node the root of the subtree, which must have a right child
+ * @return the new root of the subtree
  */
 
-static ssize_t
-find_region_before_equal (uintptr_t base)
+static struct mmap *
+mmap_rotate_left (struct mmap *node)
 {
-  struct mmap_table *mmaps = &THIS_PROCESS->mmaps;
-  ssize_t i;
-  for (i = 0; (size_t) i < mmaps->len; i++)
+  struct mmap *right = node->right;
+  node->right = right->left;
+  right->left = node;
+  mmap_update (node);
+  mmap_update (right);
+  return right;
+}
+
+/*!
+ * Rotates a subtree of memory regions to the right, making the left child
+ * of its root the new root.
+ *
+ * @param node the root of the subtree, which must have a left child
+ * @return the new root of the subtree
+ */
+
+static struct mmap *
+mmap_rotate_right (struct mmap *node)
+{
+  struct mmap *left = node->left;
+  node->left = left->right;
+  left->right = node;
+  mmap_update (node);
+  mmap_update (left);
+  return left;
+}
+
+/*!
+ * Restores the AVL balance condition at a node of a memory region tree
+ * after one of its subtrees has changed.
+ *
+ * @param node the node to balance
+ * @return the new root of the subtree
+ */
+
+static struct mmap *
+mmap_balance (struct mmap *node)
+{
+  int balance;
+  mmap_update (node);
+  balance = mmap_height (node->left) - mmap_height (node->right);
+  if (balance > 1)
+    {
+      if (mmap_height (node->left->left) < mmap_height (node->left->right))
+	node->left = mmap_rotate_left (node->left);
+      return mmap_rotate_right (node);
+    }
+  else if (balance < -1)
     {
-      if (mmaps->table[i].base > base)
-	return i - 1;
+      if (mmap_height (node->right->right) < mmap_height (node->right->left))
+	node->right = mmap_rotate_right (node->right);
+      return mmap_rotate_left (node);
     }
-  return mmaps->len - 1;
+  return node;
 }
 
 /*!
- * Writes all data in mappings or parts of mappings contained in an area in
- * virtual memory to disk.
+ * Inserts a memory region into a tree ordered by base address and
+ * rebalances the path to it. The region must not overlap any region
+ * already in the tree.
  *
- * @param addr the base address of the region to sync
- * @param len number of bytes to sync
- * @return zero on success
+ * @param node the root of the tree, or NULL if the tree is empty
+ * @param region the region to insert
+ * @return the new root of the tree
  */
 
-static int
-sync_mappings (void *addr, size_t len)
+static struct mmap *
+mmap_tree_insert (struct mmap *node, struct mmap *region)
 {
-  struct mmap_table *mmaps = &THIS_PROCESS->mmaps;
-  struct mmap *region;
-  uintptr_t ptr = (uintptr_t) addr;
-  uintptr_t i;
-  ssize_t ri;
+  if (!node)
+    {
+      region->left = NULL;
+      region->right = NULL;
+      mmap_update (region);
+      return region;
+    }
+  if (region->base < node->base)
+    node->left = mmap_tree_insert (node->left, region);
+  else
+    node->right = mmap_tree_insert (node->right, region);
+  return mmap_balance (node);
+}
+
+/*!
+ * Detaches the region with the lowest base address from a subtree of
+ * memory regions. The children of the detached region are not updated.
+ *
+ * @param node the root of the subtree, which must not be empty
+ * @param min pointer to store the detached region
+ * @return the new root of the subtree
+ */
 
-  /* Find the last mapping under the requested address */
-  ri = find_region_before (ptr);
-  if (ri >= 0)
+static struct mmap *
+mmap_tree_remove_min (struct mmap *node, struct mmap **min)
+{
+  if (!node->left)
     {
-      region = mmaps->table + ri;
-      if (region->base + region->len > ptr)
-	{
-	  /* Write the data at the end of the base */
-	  if (region->file
-	      && vfs_write (region->file->vnode, (void *) ptr,
-			    region->base + region->len - ptr,
-			    region->offset + ptr - region->base) < 0)
-	    return -1;
-	}
+      *min = node;
+      return node->right;
     }
+  node->left = mmap_tree_remove_min (node->left, min);
+  return mmap_balance (node);
+}
 
-  for (i = ri + 1; i < mmaps->len; i++)
+/*!
+ * Detaches the region starting at an address from a tree of memory
+ * regions. The region itself is not freed. Nothing is done if no region
+ * starts at the address.
+ *
+ * @param node the root of the tree
+ * @param base the base address of the region to remove
+ * @return the new root of the tree
+ */
+
+static struct mmap *
+mmap_tree_remove (struct mmap *node, uintptr_t base)
+{
+  struct mmap *min;
+  if (!node)
+    return NULL;
+  if (base < node->base)
+    node->left = mmap_tree_remove (node->left, base);
+  else if (base > node->base)
+    node->right = mmap_tree_remove (node->right, base);
+  else
     {
-      region = mmaps->table + i;
-      if (ptr + len >= region->base + region->len)
-	{
-	  /* The region is entirely overlapped */
-	  if (region->file
-	      && vfs_write (region->file->vnode, (void *) region->base,
-			    region->len, region->offset) < 0)
-	    return -1;
-	}
-      else if (ptr + len > region->base)
+      if (!node->right)
+	return node->left;
+      node->right = mmap_tree_remove_min (node->right, &min);
+      min->left = node->left;
+      min->right = node->right;
+      node = min;
+    }
+  return mmap_balance (node);
+}
+
+/*!
+ * Updates the free gap information on the path to a region after the
+ * region has been resized. The region must keep its position in the tree.
+ *
+ * @param node the root of the tree
+ * @param base the base address of the resized region
+ */
+
+static void
+mmap_tree_fix (struct mmap *node, uintptr_t base)
+{
+  if (!node)
+    return;
+  if (base < node->base)
+    mmap_tree_fix (node->left, base);
+  else if (base > node->base)
+    mmap_tree_fix (node->right, base);
+  mmap_update (node);
+}
+
+/*!
+ * Searches a subtree of memory regions for the lowest unmapped area of
+ * a given size at or above an address. Subtrees without a large enough gap
+ * are skipped.
+ *
+ * @param node the root of the subtree
+ * @param lo the end of the region before the subtree
+ * @param hi the base of the region after the subtree
+ * @param hint the lowest address the area may start at
+ * @param len the size of the area
+ * @return the base address of the area, or zero if none was found
+ */
+
+static uintptr_t
+mmap_tree_find_gap (const struct mmap *node, uintptr_t lo, uintptr_t hi,
+		    uintptr_t hint, size_t len)
+{
+  uintptr_t ret;
+  if (hi <= hint || hi - lo < len)
+    return 0;
+  if (!node)
+    {
+      if (lo < hint)
+	lo = hint;
+      return hi - lo >= len ? lo : 0;
+    }
+  if (node->low - lo < len && node->max_gap < len && hi - node->high < len)
+    return 0;
+  ret = mmap_tree_find_gap (node->left, lo, node->base, hint, len);
+  if (ret)
+    return ret;
+  return mmap_tree_find_gap (node->right, node->base + node->len, hi, hint,
+			     len);
+}
+
+/*!
+ * Copies a subtree of memory regions, adding a reference to every mapped
+ * file. If an allocation fails, the remaining nodes are not copied and the
+ * partial copy is still returned so it can be freed with mmap_tree_free().
+ *
+ * @param node the root of the subtree to copy
+ * @param err pointer to an error flag, which is set to one on failure and
+ * stops the copy if already set
+ * @return the root of the copy, or NULL if the subtree is empty
+ */
+
+static struct mmap *
+mmap_tree_copy (const struct mmap *node, int *err)
+{
+  struct mmap *copy;
+  if (!node || *err)
+    return NULL;
+  copy = malloc (sizeof (struct mmap));
+  if (UNLIKELY (!copy))
+    {
+      *err = 1;
+      return NULL;
+    }
+  *copy = *node;
+  if (copy->file)
+    copy->file->count++;
+  copy->left = mmap_tree_copy (node->left, err);
+  copy->right = mmap_tree_copy (node->right, err);
+  return copy;
+}
+
+/*!
+ * Frees every region in a subtree of memory regions and releases their
+ * references to mapped files. The memory in the regions is not unmapped.
+ *
+ * @param node the root of the subtree, or NULL
+ */
+
+static void
+mmap_tree_free (struct mmap *node)
+{
+  if (!node)
+    return;
+  mmap_tree_free (node->left);
+  mmap_tree_free (node->right);
+  if (node->file)
+    free_fd (node->file - system_fd_table);
+  free (node);
+}
+
+/*!
+ * Locates the memory region containing an address.
+ *
+ * @param addr the address to search with
+ * @return the memory region, or NULL if the address is not mapped
+ */
+
+struct mmap *
+find_region (uintptr_t addr)
+{
+  struct mmap *node = THIS_PROCESS->mmaps.root;
+  while (node)
+    {
+      if (addr < node->base)
+	node = node->left;
+      else if (addr >= node->base + node->len)
+	node = node->right;
+      else
+	return node;
+    }
+  return NULL;
+}
+
+/*!
+ * Locates the lowest memory region ending after an address. This is either
+ * the region containing the address or the first region after it.
+ *
+ * @param addr the address to search with
+ * @return the memory region, or NULL if no region ends after the address
+ */
+
+struct mmap *
+find_region_after (uintptr_t addr)
+{
+  struct mmap *node = THIS_PROCESS->mmaps.root;
+  struct mmap *region = NULL;
+  while (node)
+    {
+      if (node->base + node->len > addr)
 	{
-	  /* The region's start overlaps */
-	  if (region->file
-	      && vfs_write (region->file->vnode, (void *) region->base,
-			    ptr + len - region->base, region->offset) < 0)
-	    return -1;
+	  region = node;
+	  node = node->left;
 	}
       else
-	break;
+	node = node->right;
     }
+  return region;
+}
+
+/*!
+ * Removes a memory region from the current process's mmap table and
+ * releases its reference to the mapped file, if any. The memory in the
+ * region is not unmapped.
+ *
+ * @param region the memory region to remove
+ */
+
+static void
+mmap_remove (struct mmap *region)
+{
+  struct mmap_table *mmaps = &THIS_PROCESS->mmaps;
+  mmaps->root = mmap_tree_remove (mmaps->root, region->base);
+  mmaps->len--;
+  if (region->file)
+    free_fd (region->file - system_fd_table);
+  free (region);
+}
+
+/*!
+ * Splits a memory region in the current process's mmap table in two at an
+ * address inside the region.
+ *
+ * @param region the memory region to split
+ * @param addr the page-aligned address to split at
+ * @return the new region starting at the address, or NULL on failure
+ */
+
+static struct mmap *
+mmap_split (struct mmap *region, uintptr_t addr)
+{
+  struct mmap tail = *region;
+  tail.base = addr;
+  tail.len = region->base + region->len - addr;
+  tail.offset += addr - region->base;
+  if (mmap_insert (&tail))
+    return NULL;
+  region->len = addr - region->base;
+  mmap_tree_fix (THIS_PROCESS->mmaps.root, region->base);
+  return find_region (addr);
+}
+
+/*!
+ * Determines whether every page in an area of virtual memory is part of a
+ * memory region or the program data segment.
+ *
+ * @param ptr the page-aligned base address of the area
+ * @param end the page-aligned end address of the area
+ * @return nonzero if the whole area is mapped
+ */
+
+static int
+mmap_range_mapped (uintptr_t ptr, uintptr_t end)
+{
+  uintptr_t brk_base = (uintptr_t) THIS_PROCESS->brk.base;
+  uintptr_t brk_end = ALIGN_UP ((uintptr_t) THIS_PROCESS->brk.curr, PAGE_SIZE);
+  while (ptr < end)
+    {
+      struct mmap *region = find_region (ptr);
+      if (region)
+	ptr = region->base + region->len;
+      else if (ptr >= brk_base && ptr < brk_end)
+	ptr = brk_end;
+      else
+	return 0;
+    }
+  return 1;
+}
+
+/*!
+ * Copies a table of memory regions, adding a reference to every mapped
+ * file. On failure, the regions copied so far remain in the destination
+ * table and must be freed with mmap_table_free().
+ *
+ * @param dest the table to copy to
+ * @param src the table to copy
+ * @return zero on success
+ */
+
+int
+mmap_table_copy (struct mmap_table *dest, const struct mmap_table *src)
+{
+  int err = 0;
+  dest->root = mmap_tree_copy (src->root, &err);
+  dest->len = src->len;
+  if (err)
+    RETV_ERROR (ENOMEM, -1);
   return 0;
 }
 
+/*!
+ * Writes the modified pages of shared file mappings contained in an area in
+ * virtual memory to disk. Only pages that have been written to since they
+ * were last written to disk are written. The dirty bits of the page table
+ * entries are collected into the page cache before writing, so the pages
+ * are written again only if they are modified after this call.
+ *
+ * @param addr the base address of the region to sync
+ * @param len number of bytes to sync
+ * @param async whether to queue the pages for the background flusher instead
+ * of waiting for them to be written
+ * @return zero on success
+ */
+
+static int
+sync_mappings (void *addr, size_t len, int async)
+{
+  uintptr_t *pml4t = THIS_THREAD->args.pml4t;
+  uintptr_t ptr = (uintptr_t) addr;
+  uintptr_t end = ptr + len;
+  struct mmap *region;
+  int ret = 0;
+  for (region = find_region_after (ptr); region && region->base < end;
+       region = find_region_after (region->base + region->len))
+    {
+      uintptr_t start = region->base > ptr ? region->base : ptr;
+      uintptr_t stop = region->base + region->len < end
+	? region->base + region->len : end;
+      if (!region->file || !(region->flags & MAP_SHARED))
+	continue;
+      vm_collect_dirty (pml4t, (void *) start,
+			ALIGN_UP (stop, PAGE_SIZE) - start);
+      if (async)
+	{
+	  if (vnode_queue_writeback (region->file->vnode,
+				     region->offset + start - region->base,
+				     stop - start))
+	    ret = -1;
+	}
+      else if (vnode_write_pages (region->file->vnode,
+				  region->offset + start - region->base,
+				  stop - start))
+	ret = -1;
+    }
+  return ret;
+}
+
 /*!
  * Removes all mappings or parts of mappings contained in an area in
  * virtual memory, optionally writing the contents of the memory to disk.
+ * A mapping containing the whole area is split in two.
  *
  * @param addr the base address of the region to clear
  * @param len number of bytes to clear
@@ -140,77 +522,78 @@ static int
 clear_mappings (void *addr, size_t len, int sync)
 {
   struct mmap_table *mmaps = &THIS_PROCESS->mmaps;
-  struct mmap *region;
+  uintptr_t *pml4t = THIS_THREAD->args.pml4t;
   uintptr_t ptr = (uintptr_t) addr;
-  uintptr_t i;
-  ssize_t ri;
+  uintptr_t end = ptr + len;
+  struct vm_flush flush = {0, 0};
+  struct mmap *region;
+  int ret = 0;
 
   if (sync)
     {
-      if (sync_mappings (addr, len))
+      if (sync_mappings (addr, len, 0))
 	return -1;
     }
 
-  /* Find the last mapping under the requested address */
-  ri = find_region_before (ptr);
-  if (ri >= 0)
+  while ((region = find_region_after (ptr)) && region->base < end)
     {
-      region = mmaps->table + ri;
-      if (region->base + region->len > ptr)
+      uintptr_t region_end = region->base + region->len;
+      if (region->base < ptr && region_end > end)
 	{
-	  /* The end of the region overlaps, truncate it */
+	  /* The area is inside the region, split off the part after it */
+	  struct mmap tail = *region;
+	  tail.base = end;
+	  tail.len = region_end - end;
+	  tail.offset += end - region->base;
+	  if (mmap_insert (&tail))
+	    return -1;
 	  region->len = ptr - region->base;
-	  for (i = region->base + region->len; i < ptr; i += PAGE_SIZE)
+	  mmap_tree_fix (mmaps->root, region->base);
+	  ret = vm_unmap_range (pml4t, addr, len, &flush);
+	  break;
+	}
+      else if (region->base < ptr)
+	{
+	  /* The end of the region overlaps, truncate it */
+	  if (vm_unmap_range (pml4t, addr, region_end - ptr, &flush))
 	    {
-	      if (vm_unmap_page (THIS_THREAD->args.pml4t, (void *) i))
-		return -1;
-	      free_page (physical_addr ((void *) i));
-	      vm_clear_page ((void *) i);
+	      ret = -1;
+	      break;
 	    }
+	  region->len = ptr - region->base;
+	  mmap_tree_fix (mmaps->root, region->base);
 	}
-    }
-
-  for (i = ri + 1; i < mmaps->len; i++)
-    {
-      region = mmaps->table + i;
-      if (ptr + len >= region->base + region->len)
+      else if (region_end <= end)
 	{
 	  /* The region is entirely overlapped, remove it completely */
-	  uintptr_t j;
-	  for (j = region->base; j < region->base + region->len; j += PAGE_SIZE)
+	  if (vm_unmap_range (pml4t, (void *) region->base, region->len,
+			      &flush))
 	    {
-	      if (vm_unmap_page (THIS_THREAD->args.pml4t, (void *) j))
-		return -1;
-	      free_page (physical_addr ((void *) j));
-	      vm_clear_page ((void *) j);
+	      ret = -1;
+	      break;
 	    }
-	  if (region->file)
-	    free_procfd (region->fd);
-	  mmaps->len--;
-	  memmove (mmaps->table + i, mmaps->table + i + 1,
-		   sizeof (struct mmap) * (mmaps->len - i));
-	  i--;
+	  mmap_remove (region);
 	}
-      else if (ptr + len > region->base)
+      else
 	{
-	  /* The region's start overlaps, remove that portion */
-	  uintptr_t j;
-	  size_t diff = ptr + len - region->base;
-	  for (j = region->base; j < ptr + len; j += PAGE_SIZE)
+	  /* The region's start overlaps, remove that portion. Moving the
+	     base up to the end of the area keeps the tree ordered, since
+	     no other region lies in between. */
+	  size_t diff = end - region->base;
+	  if (vm_unmap_range (pml4t, (void *) region->base, diff, &flush))
 	    {
-	      if (vm_unmap_page (THIS_THREAD->args.pml4t, (void *) j))
-		return -1;
-	      free_page (physical_addr ((void *) j));
-	      vm_clear_page ((void *) j);
+	      ret = -1;
+	      break;
 	    }
-	  mmaps->table[i].len -= diff;
-	  mmaps->table[i].base = ptr + len;
-	  mmaps->table[i].offset += diff;
+	  region->len -= diff;
+	  region->base = end;
+	  region->offset += diff;
+	  mmap_tree_fix (mmaps->root, region->base);
+	  break;
 	}
-      else
-	break;
     }
-  return 0;
+  vm_flush_tlb (&flush);
+  return ret;
 }
 
 /*!
@@ -228,54 +611,283 @@ clear_mappings (void *addr, size_t len, int sync)
 int
 expand_mmap (uintptr_t *pml4t, void *addr, size_t len)
 {
-  struct mmap_table *mmaps = &THIS_PROCESS->mmaps;
-  ssize_t ri = find_region_before_equal ((uintptr_t) addr);
-  uintptr_t ptr;
-  uintptr_t cptr;
-  struct mmap *region;
-  if (ri < 0)
+  struct mmap *region = find_region ((uintptr_t) addr);
+  if (!region)
     RETV_ERROR (ENOMEM, -1);
-  region = mmaps->table + ri;
   len = ALIGN_UP (len, PAGE_SIZE);
-  for (ptr = region->base + region->len; ptr < region->base + len;
-       ptr += PAGE_SIZE)
-    {
-      uintptr_t page = alloc_page ();
-      if (UNLIKELY (!page))
-	goto err0;
-      if (vm_map_page (pml4t, page, (void *) ptr,
-		       PAGE_FLAG_USER | PAGE_FLAG_RW))
+  if (vm_alloc_range (pml4t, (void *) (region->base + region->len),
+		      len - region->len, PAGE_FLAG_USER | PAGE_FLAG_RW))
+    return -1;
+  region->len = len;
+  mmap_tree_fix (THIS_PROCESS->mmaps.root, region->base);
+  return 0;
+}
+
+/*!
+ * Adds a memory region to the current process's mmap table. The region
+ * must not overlap any existing region. A reference is added to the mapped
+ * file, if there is one.
+ *
+ * @param region the memory region to add
+ * @return zero on success
+ */
+
+int
+mmap_insert (const struct mmap *region)
+{
+  struct mmap_table *mmaps = &THIS_PROCESS->mmaps;
+  struct mmap *node = malloc (sizeof (struct mmap));
+  if (UNLIKELY (!node))
+    RETV_ERROR (ENOMEM, -1);
+  *node = *region;
+  mmaps->root = mmap_tree_insert (mmaps->root, node);
+  mmaps->len++;
+  if (region->file)
+    region->file->count++;
+  return 0;
+}
+
+/*!
+ * Removes the references to mapped files held by a table of memory regions
+ * and frees the table. The memory in the regions is not unmapped.
+ *
+ * @param mmaps the table of memory regions
+ */
+
+void
+mmap_table_free (struct mmap_table *mmaps)
+{
+  mmap_tree_free (mmaps->root);
+  mmaps->root = NULL;
+  mmaps->len = 0;
+}
+
+/*!
+ * Maps a cached page of a file into a file mapping. Shared mappings map the
+ * cached page frame directly, so every process mapping the file sees the
+ * same data. Private mappings map the cached page frame as copy-on-write,
+ * or a copy of it if the page is being written to.
+ *
+ * @param region the file mapping
+ * @param ptr the page-aligned virtual address to map
+ * @param page the physical address of the cached page frame
+ * @param flags the page flags allowed by the mapping's protection
+ * @param write whether the page is being written to
+ * @return zero on success
+ */
+
+static int
+mmap_map_file_page (struct mmap *region, uintptr_t ptr, uintptr_t page,
+		    unsigned int flags, int write)
+{
+  uintptr_t *pml4t = THIS_THREAD->args.pml4t;
+  if (region->flags & MAP_SHARED)
+    flags |= PAGE_FLAG_SHARED;
+  else if (write)
+    {
+      uintptr_t copy = alloc_page ();
+      if (UNLIKELY (!copy))
+	RETV_ERROR (ENOMEM, -1);
+      memcpy ((void *) PHYS_REL (copy), (void *) PHYS_REL (page), PAGE_SIZE);
+      if (vm_map_page (pml4t, copy, (void *) ptr, flags))
 	{
-	  free_page (page);
-	  goto err0;
+	  free_page (copy);
+	  return -1;
 	}
+      return 0;
     }
-  region->len = len;
+  else if (flags & PAGE_FLAG_RW)
+    flags = PAGE_FLAG_USER | PAGE_FLAG_COW;
+
+  ref_page (page);
+  if (vm_map_page (pml4t, page, (void *) ptr, flags))
+    {
+      free_page (page);
+      return -1;
+    }
+  return 0;
+}
+
+/*!
+ * Maps unmapped pages near a faulting page of a file mapping to avoid
+ * taking a page fault on each of them. How many pages are mapped depends
+ * on the access pattern advice of the mapping. Sequential mappings read
+ * the pages after the faulting page into the page cache and map them.
+ * Normal mappings only map pages around the faulting page that are already
+ * cached. Random mappings do not map any extra pages.
+ *
+ * @param region the file mapping
+ * @param ptr the page-aligned virtual address that was mapped
+ * @param flags the page flags allowed by the mapping's protection
+ */
+
+static void
+mmap_fault_around (struct mmap *region, uintptr_t ptr, unsigned int flags)
+{
+  uintptr_t *pml4t = THIS_THREAD->args.pml4t;
+  struct vnode *vp = region->file->vnode;
+  int readahead = region->advice == MADV_SEQUENTIAL;
+  uintptr_t start;
+  uintptr_t end;
+  if (region->advice == MADV_RANDOM)
+    return;
+  if (readahead)
+    {
+      start = ptr + PAGE_SIZE;
+      end = ptr + MMAP_READAHEAD_PAGES * PAGE_SIZE;
+    }
+  else
+    {
+      start = ALIGN_DOWN (ptr, MMAP_FAULT_AROUND_PAGES * PAGE_SIZE);
+      end = start + MMAP_FAULT_AROUND_PAGES * PAGE_SIZE;
+    }
+  if (start < region->base)
+    start = region->base;
+  if (end > region->base + region->len)
+    end = region->base + region->len;
+
+  for (; start < end; start += PAGE_SIZE)
+    {
+      size_t index = (region->offset + start - region->base) / PAGE_SIZE;
+      uintptr_t page;
+      if (start == ptr || vm_phys_addr (pml4t, (void *) start))
+	continue;
+      if (readahead)
+	page = vnode_get_page (vp, index);
+      else
+	page = (uintptr_t) hashmap_lookup (vp->pages, index);
+      if (!page)
+	{
+	  if (readahead)
+	    break;
+	  continue;
+	}
+      if (mmap_map_file_page (region, start, page, flags, 0))
+	break;
+    }
+}
+
+/*!
+ * Maps a page of a file mapping from the page cache of the file. Pages
+ * near the faulting page are also mapped on read accesses.
+ *
+ * @param region the file mapping
+ * @param ptr the page-aligned virtual address to map
+ * @param flags the page flags allowed by the mapping's protection
+ * @param write whether the page fault was caused by a write access
+ * @return zero on success
+ */
+
+static int
+mmap_fault_file (struct mmap *region, uintptr_t ptr, unsigned int flags,
+		 int write)
+{
+  uintptr_t page = vnode_get_page (region->file->vnode,
+				   (region->offset + ptr - region->base)
+				   / PAGE_SIZE);
+  if (!page || mmap_map_file_page (region, ptr, page, flags, write))
+    return -1;
+  if (!write)
+    mmap_fault_around (region, ptr, flags);
   return 0;
+}
 
- err0:
-  for (cptr = region->base; cptr < ptr; cptr += PAGE_SIZE)
+/*!
+ * Handles a page fault on a non-present page in user space. Pages of file
+ * mappings are mapped from the page cache. If the address is part of an
+ * anonymous memory region or the program data segment, a zero-filled page
+ * is mapped to it. A read access to writable memory maps
+ * the shared zero page as copy-on-write, so no memory is allocated until
+ * the page is written to. A write access to an aligned 2 MiB area contained
+ * in the region is mapped with a large page if possible.
+ *
+ * @param addr the virtual address that caused the page fault
+ * @param write whether the page fault was caused by a write access
+ * @return zero if the page fault was handled
+ */
+
+int
+mmap_fault (void *addr, int write)
+{
+  uintptr_t *pml4t = THIS_THREAD->args.pml4t;
+  uintptr_t ptr = (uintptr_t) addr;
+  struct mmap *region = find_region (ptr);
+  uintptr_t base;
+  uintptr_t end;
+  uintptr_t page;
+  unsigned int flags;
+  int prot;
+  if (region)
+    {
+      base = region->base;
+      end = region->base + region->len;
+      prot = region->prot;
+    }
+  else if (ptr >= (uintptr_t) THIS_PROCESS->brk.base
+	   && ptr < (uintptr_t) THIS_PROCESS->brk.curr)
     {
-      free_page (physical_addr ((void *) cptr));
-      vm_unmap_page (THIS_THREAD->args.pml4t, (void *) cptr);
-      vm_clear_page ((void *) cptr);
+      base = (uintptr_t) THIS_PROCESS->brk.base;
+      end = (uintptr_t) THIS_PROCESS->brk.curr;
+      prot = PROT_READ | PROT_WRITE;
     }
-  RETV_ERROR (ENOMEM, -1);
+  else
+    RETV_ERROR (EFAULT, -1);
+
+  if (prot == PROT_NONE || (write && !(prot & PROT_WRITE)))
+    RETV_ERROR (EACCES, -1);
+  flags = PAGE_FLAG_USER;
+  if (prot & PROT_WRITE)
+    flags |= PAGE_FLAG_RW;
+  ptr = ALIGN_DOWN (ptr, PAGE_SIZE);
+  if (region && region->file)
+    return mmap_fault_file (region, ptr, flags, write);
+
+  if (!write)
+    {
+      /* Share the zero page until the page is written to */
+      ref_page (zero_page);
+      if (vm_map_page (pml4t, zero_page, (void *) ptr,
+		       flags & PAGE_FLAG_RW ? PAGE_FLAG_USER | PAGE_FLAG_COW
+		       : PAGE_FLAG_USER))
+	{
+	  free_page (zero_page);
+	  return -1;
+	}
+      return 0;
+    }
+
+  if (ALIGN_DOWN (ptr, LARGE_PAGE_SIZE) >= base
+      && ALIGN_DOWN (ptr, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE <= end)
+    {
+      /* Fails if part of the area is already mapped with small pages */
+      page = alloc_pages (LARGE_PAGE_ORDER);
+      if (page)
+	{
+	  memset ((void *) PHYS_REL (page), 0, LARGE_PAGE_SIZE);
+	  if (!vm_map_large_page (pml4t, page, (void *) ptr, flags))
+	    return 0;
+	  free_pages (page, LARGE_PAGE_ORDER);
+	}
+    }
+
+  page = alloc_zeroed_page ();
+  if (UNLIKELY (!page))
+    RETV_ERROR (ENOMEM, -1);
+  if (vm_map_page (pml4t, page, (void *) ptr, flags))
+    {
+      free_page (page);
+      return -1;
+    }
+  return 0;
 }
 
 void *
 sys_mmap (void *addr, size_t len, int prot, int flags, int fd, off_t offset)
 {
-  struct mmap_table *mmaps = &THIS_PROCESS->mmaps;
-  struct mmap *temp;
+  struct mmap region;
   uintptr_t base;
-  uintptr_t ptr;
-  uintptr_t cptr;
-  ssize_t ri;
   struct fd *file = NULL;
   struct vnode *vp = NULL;
-  int pflags = prot != PROT_NONE ? PAGE_FLAG_USER : 0;
-  size_t bytes = len;
 
   /* Check arguments */
   if (!(flags & MAP_ANONYMOUS))
@@ -300,6 +912,9 @@ sys_mmap (void *addr, size_t len, int prot, int flags, int fd, off_t offset)
 	RETV_ERROR (EACCES, MAP_FAILED);
       if (!(prot & PROT_READ) && (file->flags & O_ACCMODE) == O_RDONLY)
 	RETV_ERROR (EACCES, MAP_FAILED);
+      if ((flags & MAP_SHARED) && (prot & PROT_WRITE)
+	  && (file->flags & O_ACCMODE) != O_RDWR)
+	RETV_ERROR (EACCES, MAP_FAILED);
     }
 
   /* Check that only one of MAP_SHARED or MAP_PRIVATE was included in flags */
@@ -323,98 +938,34 @@ sys_mmap (void *addr, size_t len, int prot, int flags, int fd, off_t offset)
 	 overwritten by the new mapping */
       if (clear_mappings (addr, len, 1))
 	return MAP_FAILED;
-      ri = find_region_before (base) + 1;
     }
   else
     {
-      /* Find a suitable location for the mapping, starting with the region
-	 behind the requested address and moving forward until a gap in mappings
-	 large enough is found */
-      ri = find_region_before_equal (base);
-      if (ri >= 0)
-	{
-	  struct mmap *region;
-	  struct mmap *next = mmaps->table + ri;
-	  for (; (size_t) ri < mmaps->len - 1; ri++)
-	    {
-	      region = mmaps->table + ri;
-	      next = mmaps->table + ri + 1;
-	      ptr = region->base + region->len;
-	      if (next->base - ptr >= len)
-		{
-		  base = ptr;
-		  goto found;
-		}
-	    }
-	  base = next->base + next->len;
-	}
-    found:
-      ri++;
+      /* Find the lowest gap in mappings large enough at or above the
+	 requested address */
+      base = mmap_tree_find_gap (THIS_PROCESS->mmaps.root, 0,
+				 USER_MEM_TOP_VMA, base, len);
+      if (!base)
+	RETV_ERROR (ENOMEM, MAP_FAILED);
     }
 
-  /* Map the region, first enabling write access so the file's contents
-     can be copied over */
   if (base + len >= USER_MEM_TOP_VMA)
     RETV_ERROR (EINVAL, MAP_FAILED);
-  if (prot & PROT_WRITE)
-    pflags |= PAGE_FLAG_RW;
-  for (ptr = base; ptr < base + len; ptr += PAGE_SIZE)
-    {
-      uintptr_t page = alloc_page ();
-      if (UNLIKELY (!page))
-	goto err0;
-      memset ((void *) PHYS_REL (page), 0, PAGE_SIZE);
-      if (vm_map_page (THIS_THREAD->args.pml4t, page, (void *) ptr,
-		       PAGE_FLAG_RW))
-	{
-	  free_page (page);
-	  goto err0;
-	}
-    }
-  if (vp)
-    {
-      ssize_t ret = vfs_read (vp, (void *) base, bytes, offset);
-      if (ret < 0)
-	return MAP_FAILED;
-    }
 
-  /* Remap memory region with requested protection */
-  for (cptr = base; cptr < base + len; cptr += PAGE_SIZE)
-    {
-      uintptr_t page = physical_addr ((void *) cptr);
-      if (vm_map_page (THIS_THREAD->args.pml4t, page, (void *) cptr, pflags))
-	goto err0;
-      vm_clear_page ((void *) cptr);
-    }
-
-  /* Add another entry to the mmap table */
-  temp = realloc (mmaps->table, sizeof (struct mmap) * ++mmaps->len);
-  if (!temp)
-    goto err1;
-  mmaps->table = temp;
-  memmove (mmaps->table + ri + 1, mmaps->table + ri,
-	   sizeof (struct mmap) * (mmaps->len - ri - 1));
-  mmaps->table[ri].base = base;
-  mmaps->table[ri].len = len;
-  mmaps->table[ri].prot = prot;
-  mmaps->table[ri].file = file;
-  if (file)
-    file->count++;
-  mmaps->table[ri].fd = fd;
-  mmaps->table[ri].offset = offset;
-  mmaps->table[ri].flags = flags;
+  /* Add another entry to the mmap table. Pages of the mapping are mapped
+     when they are first accessed. */
+  region.base = base;
+  region.len = len;
+  region.prot = prot;
+  region.file = file;
+  region.fd = fd;
+  region.offset = offset;
+  region.flags = flags;
+  region.advice = MADV_NORMAL;
+  region.mergeable = 0;
+  if (mmap_insert (&region))
+    return MAP_FAILED;
   return (void *) base;
-
- err1:
-  mmaps->len--;
- err0:
-  for (cptr = ALIGN_DOWN (base, PAGE_SIZE); cptr < ptr; cptr += PAGE_SIZE)
-    {
-      free_page (physical_addr ((void *) cptr));
-      vm_unmap_page (THIS_THREAD->args.pml4t, (void *) cptr);
-      vm_clear_page ((void *) cptr);
-    }
-  return MAP_FAILED;
 }
 
 int
@@ -425,6 +976,100 @@ sys_munmap (void *addr, size_t len)
   return clear_mappings (addr, len, 0);
 }
 
+void *
+sys_mremap (void *addr, size_t old_len, size_t new_len, int flags,
+	    void *new_addr)
+{
+  uintptr_t *pml4t = THIS_THREAD->args.pml4t;
+  uintptr_t ptr = (uintptr_t) addr;
+  struct mmap *region;
+  struct mmap moved;
+  uintptr_t base = (uintptr_t) new_addr;
+  uintptr_t limit;
+
+  /* Check arguments */
+  if ((ptr & (PAGE_SIZE - 1)) || !old_len || !new_len
+      || old_len > USER_MEM_TOP_VMA || new_len > USER_MEM_TOP_VMA
+      || (flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED))
+      || ((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE)))
+    RETV_ERROR (EINVAL, MAP_FAILED);
+  old_len = ALIGN_UP (old_len, PAGE_SIZE);
+  new_len = ALIGN_UP (new_len, PAGE_SIZE);
+  if (flags & MREMAP_FIXED)
+    {
+      if ((base & (PAGE_SIZE - 1)) || base > USER_MEM_TOP_VMA - new_len
+	  || (base < ptr + old_len && base + new_len > ptr))
+	RETV_ERROR (EINVAL, MAP_FAILED);
+    }
+  region = find_region (ptr);
+  if (!region || ptr + old_len > region->base + region->len)
+    RETV_ERROR (EFAULT, MAP_FAILED);
+
+  /* Shrink the mapping by unmapping its end */
+  if (new_len < old_len)
+    {
+      if (clear_mappings ((void *) (ptr + new_len), old_len - new_len, 0))
+	return MAP_FAILED;
+      old_len = new_len;
+      region = find_region (ptr);
+    }
+  if (!(flags & MREMAP_FIXED))
+    {
+      if (new_len == old_len)
+	return addr;
+
+      /* Grow the mapping in place if it ends its region and the gap after
+	 the region is large enough. Pages of the new space are mapped when
+	 they are first accessed. */
+      if (ptr + old_len == region->base + region->len)
+	{
+	  struct mmap *next = find_region_after (ptr + old_len);
+	  limit = next ? next->base : USER_MEM_TOP_VMA;
+	  if (ptr + new_len <= limit)
+	    {
+	      region->len += new_len - old_len;
+	      mmap_tree_fix (THIS_PROCESS->mmaps.root, region->base);
+	      return addr;
+	    }
+	}
+      if (!(flags & MREMAP_MAYMOVE))
+	RETV_ERROR (ENOMEM, MAP_FAILED);
+      base = mmap_tree_find_gap (THIS_PROCESS->mmaps.root, 0,
+				 USER_MEM_TOP_VMA, USER_MMAP_BASE_VMA,
+				 new_len);
+      if (!base || base + new_len > USER_MEM_TOP_VMA)
+	RETV_ERROR (ENOMEM, MAP_FAILED);
+    }
+  else if (clear_mappings ((void *) base, new_len, 1))
+    return MAP_FAILED;
+
+  /* Give the area being moved its own region */
+  if (region->base < ptr)
+    {
+      region = mmap_split (region, ptr);
+      if (!region)
+	return MAP_FAILED;
+    }
+  if (region->base + region->len > ptr + old_len
+      && !mmap_split (region, ptr + old_len))
+    return MAP_FAILED;
+
+  /* Move the page table entries of the area to the new address */
+  moved = *region;
+  moved.base = base;
+  moved.len = new_len;
+  if (mmap_insert (&moved))
+    return MAP_FAILED;
+  if (vm_move_range (pml4t, (void *) base, addr, old_len))
+    {
+      vm_move_range (pml4t, addr, (void *) base, old_len);
+      mmap_remove (find_region (base));
+      return MAP_FAILED;
+    }
+  mmap_remove (region);
+  return (void *) base;
+}
+
 int
 sys_msync (void *addr, size_t len, int flags)
 {
@@ -432,7 +1077,152 @@ sys_msync (void *addr, size_t len, int flags)
       || ((flags & MS_ASYNC) && (flags & MS_SYNC))
       || (flags & (MS_ASYNC | MS_SYNC | MS_INVALIDATE)) == 0)
     RETV_ERROR (EINVAL, -1);
-  if (flags & MS_ASYNC)
-    RETV_ERROR (ENOTSUP, -1);
-  return sync_mappings (addr, len);
+  return sync_mappings (addr, len, flags & MS_ASYNC);
+}
+
+int
+sys_mprotect (void *addr, size_t len, int prot)
+{
+  uintptr_t *pml4t = THIS_THREAD->args.pml4t;
+  uintptr_t ptr = (uintptr_t) addr;
+  uintptr_t end = ptr + ALIGN_UP (len, PAGE_SIZE);
+  struct vm_flush flush = {0, 0};
+  struct mmap *region;
+  unsigned int flags = 0;
+  uintptr_t start;
+  uintptr_t stop;
+  int ret = 0;
+
+  if ((ptr & (PAGE_SIZE - 1)) || end < ptr
+      || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)))
+    RETV_ERROR (EINVAL, -1);
+  for (start = ptr; start < end; start = region->base + region->len)
+    {
+      /* Every page in the area must be part of a memory region */
+      region = find_region (start);
+      if (!region)
+	RETV_ERROR (ENOMEM, -1);
+      if (region->file && (region->flags & MAP_SHARED) && (prot & PROT_WRITE)
+	  && (region->file->flags & O_ACCMODE) != O_RDWR)
+	RETV_ERROR (EACCES, -1);
+    }
+
+  if (prot & PROT_WRITE)
+    flags = PAGE_FLAG_USER | PAGE_FLAG_RW;
+  else if (prot != PROT_NONE)
+    flags = PAGE_FLAG_USER;
+  for (start = ptr; start < end; start = stop)
+    {
+      region = find_region (start);
+      stop = region->base + region->len < end
+	? region->base + region->len : end;
+      if (region->base < start)
+	{
+	  region = mmap_split (region, start);
+	  if (!region)
+	    {
+	      ret = -1;
+	      break;
+	    }
+	}
+      if (region->base + region->len > stop && !mmap_split (region, stop))
+	{
+	  ret = -1;
+	  break;
+	}
+      region->prot = prot;
+      if (vm_protect_range (pml4t, (void *) start, stop - start, flags,
+			    &flush))
+	{
+	  ret = -1;
+	  break;
+	}
+    }
+  vm_flush_tlb (&flush);
+  return ret;
+}
+
+int
+sys_madvise (void *addr, size_t len, int advice)
+{
+  uintptr_t *pml4t = THIS_THREAD->args.pml4t;
+  uintptr_t ptr = (uintptr_t) addr;
+  uintptr_t end = ptr + ALIGN_UP (len, PAGE_SIZE);
+  uintptr_t brk_base = (uintptr_t) THIS_PROCESS->brk.base;
+  uintptr_t brk_end = ALIGN_UP ((uintptr_t) THIS_PROCESS->brk.curr, PAGE_SIZE);
+  struct mmap *region;
+
+  if ((ptr & (PAGE_SIZE - 1)) || end < ptr)
+    RETV_ERROR (EINVAL, -1);
+  switch (advice)
+    {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+    case MADV_WILLNEED:
+    case MADV_DONTNEED:
+    case MADV_MERGEABLE:
+    case MADV_UNMERGEABLE:
+      break;
+    default:
+      RETV_ERROR (EINVAL, -1);
+    }
+  if (!mmap_range_mapped (ptr, end))
+    RETV_ERROR (ENOMEM, -1);
+
+  /* Free pages of the program data segment */
+  if (advice == MADV_DONTNEED && ptr < brk_end && end > brk_base)
+    {
+      uintptr_t start = ptr > brk_base ? ptr : brk_base;
+      uintptr_t stop = end < brk_end ? end : brk_end;
+      if (vm_free_range (pml4t, (void *) start, stop - start))
+	return -1;
+    }
+
+  for (region = find_region_after (ptr); region && region->base < end;
+       region = find_region_after (region->base + region->len))
+    {
+      uintptr_t start = region->base > ptr ? region->base : ptr;
+      uintptr_t stop = region->base + region->len < end
+	? region->base + region->len : end;
+      switch (advice)
+	{
+	case MADV_WILLNEED:
+	  /* Read file data into the page cache and map it now */
+	  if (!region->file || region->prot == PROT_NONE)
+	    break;
+	  for (; start < stop; start += PAGE_SIZE)
+	    {
+	      /* Stop at the end of the file, advice is only a hint */
+	      if (!vm_phys_addr (pml4t, (void *) start)
+		  && mmap_fault ((void *) start, 0))
+		break;
+	    }
+	  break;
+	case MADV_DONTNEED:
+	  /* Later accesses fault in zero-filled pages or file data */
+	  if (vm_free_range (pml4t, (void *) start, stop - start))
+	    return -1;
+	  break;
+	default:
+	  /* Only change the advice of the part of the region in the area */
+	  if (region->base < start)
+	    {
+	      region = mmap_split (region, start);
+	      if (!region)
+		return -1;
+	    }
+	  if (region->base + region->len > stop && !mmap_split (region, stop))
+	    return -1;
+	  if (advice == MADV_MERGEABLE || advice == MADV_UNMERGEABLE)
+	    {
+	      /* Pages already merged are split by later writes */
+	      region->mergeable = advice == MADV_MERGEABLE;
+	      merge_active |= region->mergeable;
+	    }
+	  else
+	    region->advice = advice;
+	}
+    }
+  return 0;
 }
@@ -16,6 +16,7 @@
 
 /*! @file */
 
+#include <pml/alloc.h>
 #include <pml/panic.h>
 #include <stdio.h>
 
@@ -33,7 +34,9 @@ panic (const char *__restrict__ fmt, ...)
   printf ("\n====================[ Kernel Panic ]====================\n");
   vprintf (fmt, args);
   va_end (args);
-  printf ("\n\n\n");
+  printf ("\n\n");
+  heapinfo_dump ();
+  printf ("\n");
 #if ARCH == x86_64
   __asm__ volatile ("cli; 1: hlt; jmp 1b");
 #else
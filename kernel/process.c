@@ -16,6 +16,9 @@
 
 /*! @file */
 
+#include <pml/alloc.h>
+#include <pml/interrupt.h>
+#include <pml/memory.h>
 #include <pml/panic.h>
 #include <errno.h>
 #include <string.h>
@@ -30,6 +33,10 @@ struct process_queue process_queue;
 
 lock_t thread_switch_lock;
 
+/*! Object cache for processes */
+static struct kmem_cache process_cache =
+  KMEM_CACHE_INIT ("process", sizeof (struct process), NULL);
+
 /*!
  * Allocates a new process structure. The process will not be added to the
  * system process queue and will have no threads.
@@ -41,7 +48,7 @@ lock_t thread_switch_lock;
 struct process *
 process_alloc (int priority)
 {
-  struct process *process = calloc (1, sizeof (struct process));
+  struct process *process = kmem_cache_zalloc (&process_cache);
   if (UNLIKELY (!process))
     return NULL;
   process->priority = priority;
@@ -60,10 +67,15 @@ process_free (struct process *process)
   struct process *parent;
   size_t i;
   if (process->threads.len)
-    thread_unmap_user_mem (process->threads.queue[0]);
+    {
+      process_vfork_release (process, process->threads.queue[0]->args.pml4t,
+			     &process->mmaps);
+      thread_unmap_user_mem (process->threads.queue[0]);
+    }
   for (i = 0; i < process->threads.len; i++)
     thread_free (process->threads.queue[i]);
   free (process->threads.queue);
+  mmap_table_free (&process->mmaps);
   unmap_pid (process->pid);
   for (i = 0; i < process->fds.size; i++)
     {
@@ -115,7 +127,7 @@ process_free (struct process *process)
     }
   free (process->children.info);
   free (process->waits.states);
-  free (process);
+  kmem_cache_free (&process_cache, process);
 }
 
 /*!
@@ -165,7 +177,11 @@ process_enqueue (struct process *process)
 }
 
 /*!
- * Forks the currently running thread into a new process.
+ * Forks the currently running thread into a new process. If the user-mode
+ * address space is not copied, the new process borrows the address space
+ * and memory regions of the current process until it calls execve or
+ * exits, and the current thread should wait for it with
+ * process_vfork_wait().
  *
  * @param t pointer to store forked thread
  * @param copy whether to copy the user-mode address space
@@ -186,6 +202,11 @@ process_fork (struct thread **t, int copy)
   thread = thread_clone (THIS_THREAD, copy);
   if (UNLIKELY (!thread))
     goto err0;
+
+  /* Pages shared with the new process were made read-only. The current
+     thread flushes its TLB when returning to its own address space, but
+     the other threads must flush theirs before they run again. */
+  THIS_THREAD->tlb_gen[smp_cpu_index ()] = ++THIS_PROCESS->tlb_gen;
   if (thread_attach_process (process, thread))
     goto err1;
   process->pid = thread->tid;
@@ -208,12 +229,10 @@ process_fork (struct thread **t, int copy)
   memcpy (&process->brk, &THIS_PROCESS->brk, sizeof (struct brk));
 
   /* Copy memory mapping data */
-  process->mmaps.len = THIS_PROCESS->mmaps.len;
-  process->mmaps.table = malloc (sizeof (struct mmap) * process->mmaps.len);
-  if (UNLIKELY (!process->mmaps.table))
+  if (!copy)
+    process->mmaps = THIS_PROCESS->mmaps;
+  else if (mmap_table_copy (&process->mmaps, &THIS_PROCESS->mmaps))
     goto err2;
-  memcpy (process->mmaps.table, THIS_PROCESS->mmaps.table,
-	  sizeof (struct mmap) * process->mmaps.len);
 
   /* Copy file descriptor table */
   process->fds.curr = THIS_PROCESS->fds.curr;
@@ -221,7 +240,7 @@ process_fork (struct thread **t, int copy)
   process->fds.max_size = THIS_PROCESS->fds.max_size;
   process->fds.table = malloc (sizeof (struct fd *) * process->fds.size);
   if (UNLIKELY (!process->fds.table))
-    goto err3;
+    goto err2;
   for (i = 0; i < process->fds.size; i++)
     {
       process->fds.table[i] = THIS_PROCESS->fds.table[i];
@@ -233,14 +252,16 @@ process_fork (struct thread **t, int copy)
   temp = realloc (THIS_PROCESS->children.info,
 		  sizeof (struct child_info) * ++THIS_PROCESS->children.len);
   if (UNLIKELY (!temp))
-    goto err3;
+    goto err2;
   THIS_PROCESS->children.info = temp;
   temp[THIS_PROCESS->children.len - 1].pid = process->pid;
+  if (!copy)
+    process->vfork_parent = THIS_THREAD;
   return process;
 
- err3:
-  free (process->mmaps.table);
  err2:
+  if (copy)
+    mmap_table_free (&process->mmaps);
   UNREF_OBJECT (process->cwd);
  err1:
   thread_free (thread);
@@ -249,6 +270,62 @@ process_fork (struct thread **t, int copy)
   return NULL;
 }
 
+/*!
+ * Returns the address space borrowed by a process created by vfork to the
+ * thread that created it, which resumes running. Paging structures that
+ * the process created or copied on write replace those of the parent,
+ * since they now hold the parent's references. Nothing is done if the
+ * process was not created by vfork.
+ *
+ * @param process the process created by vfork
+ * @param pml4t the PML4T containing the borrowed address space
+ * @param mmaps the memory regions of the borrowed address space
+ */
+
+void
+process_vfork_release (struct process *process, uintptr_t *pml4t,
+		       struct mmap_table *mmaps)
+{
+  struct thread *parent = process->vfork_parent;
+  if (!parent)
+    return;
+  memcpy (parent->args.pml4t, pml4t, PAGE_STRUCT_SIZE / 2);
+  memset (pml4t, 0, PAGE_STRUCT_SIZE / 2);
+  if (parent->process)
+    {
+      parent->process->mmaps = *mmaps;
+      parent->process->tlb_gen++;
+    }
+  vm_pcid_invalidate (parent);
+  mmaps->root = NULL;
+  mmaps->len = 0;
+  process->vfork_parent = NULL;
+}
+
+/*!
+ * Suspends the current thread until a process created by vfork returns
+ * the borrowed address space by calling execve or exiting.
+ *
+ * @param pid the PID of the process created by vfork
+ */
+
+void
+process_vfork_wait (pid_t pid)
+{
+  while (1)
+    {
+      struct process *child;
+      int done;
+      thread_switch_lock = 1;
+      child = lookup_pid (pid);
+      done = !child || child->vfork_parent != THIS_THREAD;
+      thread_switch_lock = 0;
+      if (done)
+	return;
+      sched_yield ();
+    }
+}
+
 /*!
  * Determines the PID of a process. This function is meant to be called by
  * assembly code.
@@ -0,0 +1,266 @@
+/* slab.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/alloc.h>
+#include <pml/lock.h>
+#include <pml/memory.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/*!
+ * Header at the start of each slab. The objects of the slab follow the
+ * header, and free objects are linked into a list through their free list
+ * link.
+ */
+
+struct kmem_slab
+{
+  struct kmem_cache *cache;     /*!< Cache owning the slab */
+  struct kmem_slab *next;       /*!< Next slab with free objects */
+  struct kmem_slab *prev;       /*!< Previous slab with free objects */
+  void *free;                   /*!< First free object */
+  size_t inuse;                 /*!< Number of allocated objects */
+};
+
+static lock_t kmem_caches_lock;
+
+/*! List of object caches that have allocated objects */
+struct kmem_cache *kmem_caches;
+
+/*!
+ * Computes the slab layout of an object cache and adds it to the list of
+ * object caches. The smallest slab holding at least @ref KMEM_MIN_OBJECTS
+ * objects is used. Objects of caches with a constructor have their free list
+ * link placed after the object, so the link does not overwrite constructed
+ * state.
+ *
+ * @param cache the object cache
+ * @return zero on success
+ */
+
+static int
+kmem_cache_setup (struct kmem_cache *cache)
+{
+  size_t size = ALIGN_UP (cache->size, sizeof (void *));
+  unsigned int order;
+  cache->link = cache->ctor ? size : 0;
+  if (cache->ctor || size < sizeof (void *))
+    size += sizeof (void *);
+  cache->stride = ALIGN_UP (size, KH_DEFAULT_ALIGN);
+  cache->offset = ALIGN_UP (sizeof (struct kmem_slab), KH_DEFAULT_ALIGN);
+  for (order = 0; order <= KMEM_MAX_ORDER; order++)
+    {
+      cache->count = ((PAGE_SIZE << order) - cache->offset) / cache->stride;
+      if (cache->count >= KMEM_MIN_OBJECTS)
+	break;
+    }
+  if (order > KMEM_MAX_ORDER)
+    order = KMEM_MAX_ORDER;
+  if (UNLIKELY (!cache->count))
+    RETV_ERROR (EINVAL, -1);
+  cache->order = order;
+
+  spinlock_acquire (&kmem_caches_lock);
+  cache->next = kmem_caches;
+  kmem_caches = cache;
+  spinlock_release (&kmem_caches_lock);
+  return 0;
+}
+
+/*!
+ * Allocates a new slab for an object cache and runs the constructor of the
+ * cache on each of its objects.
+ *
+ * @param cache the object cache
+ * @return the new slab, or NULL if the allocation failed
+ */
+
+static struct kmem_slab *
+kmem_slab_create (struct kmem_cache *cache)
+{
+  uintptr_t phys = alloc_pages (cache->order);
+  struct kmem_slab *slab;
+  char *obj;
+  size_t i;
+  if (UNLIKELY (!phys))
+    RETV_ERROR (ENOMEM, NULL);
+  slab = (struct kmem_slab *) PHYS_REL (phys);
+  slab->cache = cache;
+  slab->next = NULL;
+  slab->prev = NULL;
+  slab->free = NULL;
+  slab->inuse = 0;
+
+  /* Link the objects in address order so they are allocated in order */
+  obj = (char *) slab + cache->offset + cache->stride * cache->count;
+  for (i = 0; i < cache->count; i++)
+    {
+      obj -= cache->stride;
+      if (cache->ctor)
+	cache->ctor (obj);
+      *((void **) (obj + cache->link)) = slab->free;
+      slab->free = obj;
+    }
+  cache->slabs++;
+  return slab;
+}
+
+/*!
+ * Returns the memory of a slab with no allocated objects to the physical
+ * page frame allocator.
+ *
+ * @param cache the object cache
+ * @param slab the slab
+ */
+
+static void
+kmem_slab_destroy (struct kmem_cache *cache, struct kmem_slab *slab)
+{
+  free_pages ((uintptr_t) slab - LOW_PHYSICAL_BASE_VMA, cache->order);
+  cache->slabs--;
+}
+
+static void
+kmem_slab_link (struct kmem_cache *cache, struct kmem_slab *slab)
+{
+  slab->prev = NULL;
+  slab->next = cache->partial;
+  if (cache->partial)
+    cache->partial->prev = slab;
+  cache->partial = slab;
+}
+
+static void
+kmem_slab_unlink (struct kmem_cache *cache, struct kmem_slab *slab)
+{
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    cache->partial = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+}
+
+/*!
+ * Allocates an object from an object cache. The object is in its constructed
+ * state if the cache has a constructor, otherwise its contents are
+ * undefined.
+ *
+ * @param cache the object cache
+ * @return a pointer to the object, or NULL if the allocation failed
+ */
+
+void *
+kmem_cache_alloc (struct kmem_cache *cache)
+{
+  struct kmem_slab *slab;
+  char *obj;
+  spinlock_acquire (&cache->lock);
+  if (UNLIKELY (!cache->count) && kmem_cache_setup (cache))
+    {
+      spinlock_release (&cache->lock);
+      return NULL;
+    }
+
+  slab = cache->partial;
+  if (!slab)
+    {
+      if (cache->empty)
+	{
+	  slab = cache->empty;
+	  cache->empty = NULL;
+	}
+      else
+	{
+	  slab = kmem_slab_create (cache);
+	  if (UNLIKELY (!slab))
+	    {
+	      spinlock_release (&cache->lock);
+	      return NULL;
+	    }
+	}
+      kmem_slab_link (cache, slab);
+    }
+
+  obj = slab->free;
+  slab->free = *((void **) (obj + cache->link));
+  if (++slab->inuse == cache->count)
+    kmem_slab_unlink (cache, slab);
+  cache->active++;
+  spinlock_release (&cache->lock);
+  return obj;
+}
+
+/*!
+ * Allocates an object from an object cache and fills it with zeros. This
+ * should only be used with caches that have no constructor.
+ *
+ * @param cache the object cache
+ * @return a pointer to the object, or NULL if the allocation failed
+ */
+
+void *
+kmem_cache_zalloc (struct kmem_cache *cache)
+{
+  void *obj = kmem_cache_alloc (cache);
+  if (LIKELY (obj))
+    memset (obj, 0, cache->size);
+  return obj;
+}
+
+/*!
+ * Returns an object to the object cache it was allocated from. If a null
+ * pointer is given, no action is performed. A slab left with no allocated
+ * objects is kept for the next allocation if the cache has no other empty
+ * slab, otherwise it is freed.
+ *
+ * @param cache the object cache
+ * @param ptr the object to free
+ */
+
+void
+kmem_cache_free (struct kmem_cache *cache, void *ptr)
+{
+  struct kmem_slab *slab;
+  if (!ptr)
+    return;
+  slab = (struct kmem_slab *) ALIGN_DOWN ((uintptr_t) ptr,
+					  PAGE_SIZE << cache->order);
+  if (UNLIKELY (slab->cache != cache))
+    {
+      debug_printf ("object freed to wrong cache");
+      RET_ERROR (EFAULT);
+    }
+
+  spinlock_acquire (&cache->lock);
+  if (slab->inuse == cache->count)
+    kmem_slab_link (cache, slab);
+  *((void **) ((char *) ptr + cache->link)) = slab->free;
+  slab->free = ptr;
+  cache->active--;
+  if (!--slab->inuse)
+    {
+      kmem_slab_unlink (cache, slab);
+      if (cache->empty)
+	kmem_slab_destroy (cache, slab);
+      else
+	cache->empty = slab;
+    }
+  spinlock_release (&cache->lock);
+}
@@ -0,0 +1,142 @@
+/* spawn.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/fcntl.h>
+#include <pml/spawn.h>
+#include <pml/syscall.h>
+#include <errno.h>
+#include <stdlib.h>
+
+/*!
+ * Duplicates a file descriptor to a specific file descriptor number,
+ * closing the target file descriptor first if it is open.
+ *
+ * @param fd the file descriptor to duplicate
+ * @param fd2 the target file descriptor number
+ * @return zero on success
+ */
+
+static int
+spawn_dup2 (int fd, int fd2)
+{
+  if (!file_fd (fd))
+    return -1;
+  if (fd == fd2)
+    return 0;
+  sys_close (fd2);
+  return sys_fcntl (fd, F_DUPFD, fd2);
+}
+
+/*!
+ * Performs the file actions requested for a spawned process on the file
+ * descriptor table of the current process.
+ *
+ * @param actions the array of file actions
+ * @param nactions the number of file actions
+ * @return zero on success
+ */
+
+static int
+spawn_file_actions (const struct spawn_action *actions, size_t nactions)
+{
+  size_t i;
+  for (i = 0; i < nactions; i++)
+    {
+      const struct spawn_action *action = actions + i;
+      int fd;
+      switch (action->type)
+	{
+	case SPAWN_ACTION_OPEN:
+	  fd = sys_open (action->path, action->flags, action->mode);
+	  if (fd == -1)
+	    return -1;
+	  if (fd != action->fd)
+	    {
+	      if (spawn_dup2 (fd, action->fd))
+		return -1;
+	      sys_close (fd);
+	    }
+	  break;
+	case SPAWN_ACTION_CLOSE:
+	  if (sys_close (action->fd))
+	    return -1;
+	  break;
+	case SPAWN_ACTION_DUP2:
+	  if (spawn_dup2 (action->fd, action->newfd))
+	    return -1;
+	  break;
+	default:
+	  RETV_ERROR (EINVAL, -1);
+	}
+    }
+  return 0;
+}
+
+/*!
+ * Creates a new process running a program. The new process is created
+ * with vfork, so the address space of the current process is never
+ * duplicated. The new process performs the file actions and loads the
+ * program while the current thread is suspended. If either step fails,
+ * the new process exits with status 127 and its error is returned.
+ *
+ * @param path path to the program to run
+ * @param actions array of file actions to perform in the new process
+ * @param nactions number of file actions
+ * @param argv argument vector of the program
+ * @param envp environment variable vector of the program
+ * @return the PID of the new process, or -1 on failure
+ */
+
+pid_t
+sys_posix_spawn (const char *path, const struct spawn_action *actions,
+		 size_t nactions, char *const *argv, char *const *envp)
+{
+  int *error = malloc (sizeof (int));
+  int ret;
+  int status;
+  pid_t pid;
+  if (UNLIKELY (!error))
+    RETV_ERROR (ENOMEM, -1);
+  *error = 0;
+
+  pid = __fork (0);
+  if (pid == -1)
+    {
+      free (error);
+      return -1;
+    }
+  if (!pid)
+    {
+      /* The error is stored in kernel memory, which is visible to the
+	 parent after this process exits */
+      if (!spawn_file_actions (actions, nactions))
+	sys_execve (path, argv, envp);
+      *error = errno;
+      process_kill (PROCESS_WAIT_EXITED, 127);
+    }
+
+  /* The new process has now either loaded the program or exited */
+  ret = *error;
+  free (error);
+  if (ret)
+    {
+      sys_wait4 (pid, &status, 0, NULL);
+      RETV_ERROR (ret, -1);
+    }
+  return pid;
+}
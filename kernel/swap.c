@@ -0,0 +1,238 @@
+/* swap.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/hpet.h>
+#include <pml/interrupt.h>
+#include <pml/lock.h>
+#include <pml/memory.h>
+#include <pml/process.h>
+#include <pml/swap.h>
+#include <pml/vfs.h>
+#include <errno.h>
+#include <stdlib.h>
+
+static lock_t swap_lock;
+
+/*! Swap space enabled with swapon(), empty if no swap space is in use */
+struct swap_space swap_space;
+
+/*!
+ * Allocates a free slot on the swap device. The slot starts with one
+ * reference.
+ *
+ * @return the slot number, or zero if no swap space is available
+ */
+
+static size_t
+swap_alloc (void)
+{
+  size_t slot = 0;
+  size_t i;
+  unsigned long flags = int_save_disable ();
+  spinlock_acquire (&swap_lock);
+  if (swap_space.used + 1 < swap_space.slots)
+    {
+      for (i = 0; i < swap_space.slots; i++)
+	{
+	  size_t curr = (swap_space.hint + i) % swap_space.slots;
+	  if (curr && !swap_space.map[curr])
+	    {
+	      swap_space.map[curr] = 1;
+	      swap_space.used++;
+	      swap_space.hint = curr + 1;
+	      slot = curr;
+	      break;
+	    }
+	}
+    }
+  spinlock_release (&swap_lock);
+  int_restore (flags);
+  return slot;
+}
+
+/*!
+ * Adds a reference to an allocated swap slot. This is done when a page
+ * table holding the slot becomes reachable from another address space.
+ *
+ * @param slot the slot number
+ */
+
+void
+swap_ref (size_t slot)
+{
+  unsigned long flags;
+  if (slot & SWAP_SLOT_COMPRESSED)
+    {
+      zswap_ref (slot);
+      return;
+    }
+  flags = int_save_disable ();
+  spinlock_acquire (&swap_lock);
+  if (swap_space.map[slot] < SWAP_MAX_REFS)
+    swap_space.map[slot]++;
+  spinlock_release (&swap_lock);
+  int_restore (flags);
+}
+
+/*!
+ * Removes a reference to an allocated swap slot, freeing the slot if no
+ * references remain.
+ *
+ * @param slot the slot number
+ */
+
+void
+swap_free (size_t slot)
+{
+  unsigned long flags;
+  if (slot & SWAP_SLOT_COMPRESSED)
+    {
+      zswap_free (slot);
+      return;
+    }
+  flags = int_save_disable ();
+  spinlock_acquire (&swap_lock);
+  if (swap_space.map[slot] && swap_space.map[slot] < SWAP_MAX_REFS
+      && !--swap_space.map[slot])
+    {
+      swap_space.used--;
+      if (slot < swap_space.hint)
+	swap_space.hint = slot;
+    }
+  spinlock_release (&swap_lock);
+  int_restore (flags);
+}
+
+/*!
+ * Writes the contents of a page to a swap slot.
+ *
+ * @param slot the slot number
+ * @param buffer the page-sized buffer containing the data
+ * @return zero on success
+ */
+
+static int
+swap_write (size_t slot, const void *buffer)
+{
+  struct block_device *device = swap_space.device;
+  if (device->write (device, buffer, PAGE_SIZE, slot * PAGE_SIZE, 1)
+      != PAGE_SIZE)
+    RETV_ERROR (EIO, -1);
+  return 0;
+}
+
+/*!
+ * Moves the contents of a page to swap space. The page is compressed into
+ * the compressed page pool if possible, otherwise it is written to the
+ * swap device. The slot starts with one reference.
+ *
+ * @param page the contents of the page
+ * @return the slot number, or zero if the page could not be stored
+ */
+
+size_t
+swap_out (const void *page)
+{
+  size_t slot = zswap_store (page);
+  if (slot)
+    return slot;
+  if (!swap_space.device)
+    return 0;
+  slot = swap_alloc ();
+  if (!slot)
+    return 0;
+  if (swap_write (slot, page))
+    {
+      swap_free (slot);
+      return 0;
+    }
+  return slot;
+}
+
+/*!
+ * Reads the contents of a page from a swap slot. The time taken is added to
+ * the swap-in latency counters of the compressed page pool or the swap
+ * device.
+ *
+ * @param slot the slot number
+ * @param buffer the page-sized buffer to store the data
+ * @return zero on success
+ */
+
+int
+swap_read (size_t slot, void *buffer)
+{
+  struct block_device *device = swap_space.device;
+  clock_t start = hpet_active ? hpet_nanotime () : 0;
+  if (slot & SWAP_SLOT_COMPRESSED)
+    {
+      if (zswap_load (slot, buffer))
+	return -1;
+      zswap_stats.loads++;
+      if (hpet_active)
+	zswap_stats.load_ns += hpet_nanotime () - start;
+      return 0;
+    }
+  if (device->read (device, buffer, PAGE_SIZE, slot * PAGE_SIZE, 1)
+      != PAGE_SIZE)
+    RETV_ERROR (EIO, -1);
+  zswap_stats.disk_loads++;
+  if (hpet_active)
+    zswap_stats.disk_load_ns += hpet_nanotime () - start;
+  return 0;
+}
+
+int
+sys_swapon (const char *path)
+{
+  struct vnode *vp;
+  struct device *device;
+  struct disk_device_data *data;
+  unsigned short *map;
+  size_t slots;
+  if (THIS_PROCESS->euid)
+    RETV_ERROR (EPERM, -1);
+  vp = vnode_namei (path, 0);
+  if (!vp)
+    return -1;
+  if (!S_ISBLK (vp->mode))
+    {
+      UNREF_OBJECT (vp);
+      RETV_ERROR (ENOTBLK, -1);
+    }
+  device = hashmap_lookup (device_num_map, vp->rdev);
+  UNREF_OBJECT (vp);
+  if (!device || device->type != DEVICE_TYPE_BLOCK)
+    RETV_ERROR (ENODEV, -1);
+  if (swap_space.device)
+    RETV_ERROR (EBUSY, -1);
+
+  data = device->data;
+  slots = data->len / PAGE_SIZE;
+  if (slots < 2)
+    RETV_ERROR (EINVAL, -1);
+  map = calloc (slots, sizeof (unsigned short));
+  if (UNLIKELY (!map))
+    RETV_ERROR (ENOMEM, -1);
+  swap_space.map = map;
+  swap_space.used = 0;
+  swap_space.hint = 1;
+  swap_space.slots = slots;
+  swap_space.device = (struct block_device *) device;
+  return 0;
+}
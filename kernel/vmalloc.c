@@ -0,0 +1,216 @@
+/* vmalloc.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/alloc.h>
+#include <pml/lock.h>
+#include <pml/memory.h>
+#include <errno.h>
+#include <stdio.h>
+
+/*!
+ * Range of virtual memory used by a large allocation. Areas are kept in a
+ * list sorted by address, and each area is followed by an unmapped guard
+ * page so that overruns fault instead of corrupting the next area.
+ */
+
+struct vmalloc_area
+{
+  struct vmalloc_area *next;    /*!< Next area by address */
+  uintptr_t base;               /*!< Base virtual address of the area */
+  size_t len;                   /*!< Length of the mapped part of the area */
+  unsigned int tag;             /*!< Call site tag used by heap accounting */
+};
+
+static lock_t vmalloc_lock;
+static struct vmalloc_area *vmalloc_areas;
+
+/*! Counters of large kernel allocations */
+struct vmalloc_stats vmalloc_stats;
+
+/*!
+ * Finds the area starting at an address. The vmalloc lock must be held.
+ *
+ * @param ptr the base address of the area
+ * @param prev pointer to store the link pointing to the area
+ * @return the area, or NULL if no area starts at the address
+ */
+
+static struct vmalloc_area *
+vmalloc_find (const void *ptr, struct vmalloc_area ***prev)
+{
+  struct vmalloc_area **link;
+  for (link = &vmalloc_areas; *link; link = &(*link)->next)
+    {
+      if ((*link)->base == (uintptr_t) ptr)
+	{
+	  if (prev)
+	    *prev = link;
+	  return *link;
+	}
+      if ((*link)->base > (uintptr_t) ptr)
+	break;
+    }
+  return NULL;
+}
+
+/*!
+ * Allocates virtually contiguous memory backed by page frames. The memory is
+ * page-aligned and filled with zeros. This is used for large allocations
+ * so they do not take contiguous space from the kernel heap.
+ *
+ * @param size the size of the allocation
+ * @return a pointer to the memory, or NULL if the allocation failed
+ */
+
+void *
+vmalloc (size_t size)
+{
+  struct vmalloc_area *area;
+  struct vmalloc_area **link;
+  uintptr_t base = VMALLOC_BASE_VMA;
+  size_t len = ALIGN_UP (size, PAGE_SIZE);
+  if (UNLIKELY (!len || len >= VMALLOC_TOP_VMA - VMALLOC_BASE_VMA))
+    RETV_ERROR (ENOMEM, NULL);
+  area = kh_alloc_aligned (sizeof (struct vmalloc_area), KH_DEFAULT_ALIGN);
+  if (UNLIKELY (!area))
+    return NULL;
+
+  /* Use the first gap between areas that fits the area and its guard
+     page */
+  spinlock_acquire (&vmalloc_lock);
+  for (link = &vmalloc_areas; *link; link = &(*link)->next)
+    {
+      if ((*link)->base - base >= len + PAGE_SIZE)
+	break;
+      base = (*link)->base + (*link)->len + PAGE_SIZE;
+    }
+  if (UNLIKELY (VMALLOC_TOP_VMA - base < len + PAGE_SIZE))
+    {
+      spinlock_release (&vmalloc_lock);
+      kh_free (area);
+      RETV_ERROR (ENOMEM, NULL);
+    }
+  if (vm_alloc_range (kernel_pml4t, (void *) base, len,
+		      PAGE_FLAG_RW | PAGE_FLAG_GLOBAL))
+    {
+      spinlock_release (&vmalloc_lock);
+      kh_free (area);
+      return NULL;
+    }
+
+  area->base = base;
+  area->len = len;
+  area->tag = 0;
+  area->next = *link;
+  *link = area;
+  vmalloc_stats.areas++;
+  vmalloc_stats.pages += len / PAGE_SIZE;
+  spinlock_release (&vmalloc_lock);
+  return (void *) base;
+}
+
+/*!
+ * Determines the usable size of memory allocated with vmalloc().
+ *
+ * @param ptr the pointer returned by vmalloc()
+ * @return the size of the allocation, or zero if the pointer is invalid
+ */
+
+size_t
+vmalloc_size (const void *ptr)
+{
+  struct vmalloc_area *area;
+  size_t len = 0;
+  spinlock_acquire (&vmalloc_lock);
+  area = vmalloc_find (ptr, NULL);
+  if (LIKELY (area))
+    len = area->len;
+  spinlock_release (&vmalloc_lock);
+  return len;
+}
+
+/*!
+ * Determines the call site tag of memory allocated with vmalloc().
+ *
+ * @param ptr the pointer returned by vmalloc()
+ * @return the tag, or zero if the pointer is invalid
+ */
+
+unsigned int
+vmalloc_tag (const void *ptr)
+{
+  struct vmalloc_area *area;
+  unsigned int tag = 0;
+  spinlock_acquire (&vmalloc_lock);
+  area = vmalloc_find (ptr, NULL);
+  if (LIKELY (area))
+    tag = area->tag;
+  spinlock_release (&vmalloc_lock);
+  return tag;
+}
+
+/*!
+ * Sets the call site tag of memory allocated with vmalloc().
+ *
+ * @param ptr the pointer returned by vmalloc()
+ * @param tag the new tag
+ */
+
+void
+vmalloc_set_tag (void *ptr, unsigned int tag)
+{
+  struct vmalloc_area *area;
+  spinlock_acquire (&vmalloc_lock);
+  area = vmalloc_find (ptr, NULL);
+  if (LIKELY (area))
+    area->tag = tag;
+  spinlock_release (&vmalloc_lock);
+}
+
+/*!
+ * Frees memory allocated with vmalloc(), returning its page frames to the
+ * page frame allocator. If a null pointer is given, no action is performed.
+ *
+ * @param ptr the pointer to free
+ */
+
+void
+vfree (void *ptr)
+{
+  struct vmalloc_area *area;
+  struct vmalloc_area **link;
+  if (!ptr)
+    return;
+
+  /* The range is unmapped before the lock is released so a new area
+     cannot be mapped over it first */
+  spinlock_acquire (&vmalloc_lock);
+  area = vmalloc_find (ptr, &link);
+  if (UNLIKELY (!area))
+    {
+      spinlock_release (&vmalloc_lock);
+      debug_printf ("invalid pointer");
+      RET_ERROR (EFAULT);
+    }
+  *link = area->next;
+  vm_free_range (kernel_pml4t, ptr, area->len);
+  vmalloc_stats.areas--;
+  vmalloc_stats.pages -= area->len / PAGE_SIZE;
+  spinlock_release (&vmalloc_lock);
+  kh_free (area);
+}
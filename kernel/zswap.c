@@ -0,0 +1,350 @@
+/* zswap.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/alloc.h>
+#include <pml/interrupt.h>
+#include <pml/lock.h>
+#include <pml/lz4.h>
+#include <pml/memory.h>
+#include <pml/swap.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*!
+ * Header at the start of each page frame of the compressed page pool. A
+ * pool page holds up to two compressed pages, one placed after the header
+ * and one placed at the end of the page frame. Pool pages holding only
+ * one compressed page are linked into a list by their amount of free space.
+ */
+
+struct zswap_page
+{
+  struct zswap_page *next;      /*!< Next pool page in the same list */
+  struct zswap_page *prev;      /*!< Previous pool page in the same list */
+  unsigned short first;         /*!< Size of the first compressed page */
+  unsigned short last;          /*!< Size of the last compressed page */
+};
+
+/*!
+ * Location of a compressed page in the compressed page pool.
+ */
+
+struct zswap_entry
+{
+  struct zswap_page *page;      /*!< Pool page, NULL if the slot is free */
+  unsigned short len;           /*!< Size of the compressed data */
+  unsigned short refs;          /*!< Number of references to the slot */
+  int last;                     /*!< Whether the data is at the end */
+};
+
+static lock_t zswap_lock;
+
+/*! Compressed page slots, allocated when the first page is stored */
+static struct zswap_entry *zswap_slots;
+static size_t zswap_slot_count;
+static size_t zswap_hint;
+
+/*! Pool pages with one compressed page, by their free space in chunks */
+static struct zswap_page *zswap_free_lists[ZSWAP_CHUNKS];
+
+static uint16_t zswap_table[LZ4_HASH_SIZE];
+static unsigned char zswap_buffer[ZSWAP_MAX_LEN];
+
+/*! Counters of the compressed page pool */
+struct zswap_stats zswap_stats;
+
+/*!
+ * Determines the number of free chunks in a pool page holding one
+ * compressed page.
+ *
+ * @param page the pool page
+ * @return the number of free chunks
+ */
+
+static inline size_t
+zswap_free_chunks (struct zswap_page *page)
+{
+  return (PAGE_SIZE - sizeof (struct zswap_page) - page->first - page->last)
+    / ZSWAP_CHUNK_SIZE;
+}
+
+static void
+zswap_list_add (struct zswap_page *page)
+{
+  struct zswap_page **list = zswap_free_lists + zswap_free_chunks (page);
+  page->prev = NULL;
+  page->next = *list;
+  if (*list)
+    (*list)->prev = page;
+  *list = page;
+}
+
+static void
+zswap_list_remove (struct zswap_page *page)
+{
+  if (page->prev)
+    page->prev->next = page->next;
+  else
+    zswap_free_lists[zswap_free_chunks (page)] = page->next;
+  if (page->next)
+    page->next->prev = page->prev;
+}
+
+/*!
+ * Finds a place in the pool for compressed data. A pool page with enough
+ * free space is used if there is one, otherwise a new pool page is
+ * allocated unless the pool has reached its size limit.
+ *
+ * @param entry the slot to store the location in
+ * @param len the size of the compressed data
+ * @return a pointer to store the data, or NULL if no space is available
+ */
+
+static void *
+zswap_place (struct zswap_entry *entry, size_t len)
+{
+  size_t chunks = ALIGN_UP (len, ZSWAP_CHUNK_SIZE) / ZSWAP_CHUNK_SIZE;
+  struct zswap_page *page;
+  uintptr_t phys;
+  for (; chunks < ZSWAP_CHUNKS; chunks++)
+    {
+      page = zswap_free_lists[chunks];
+      if (!page)
+	continue;
+      zswap_list_remove (page);
+      entry->page = page;
+      entry->len = len;
+      if (page->first)
+	{
+	  page->last = len;
+	  entry->last = 1;
+	  return (char *) page + PAGE_SIZE - len;
+	}
+      page->first = len;
+      entry->last = 0;
+      return page + 1;
+    }
+
+  if (zswap_stats.pool_pages >= phys_page_count * boot_options.zswap_percent
+      / 100)
+    {
+      zswap_stats.pool_full++;
+      return NULL;
+    }
+  phys = alloc_page ();
+  if (UNLIKELY (!phys))
+    return NULL;
+  zswap_stats.pool_pages++;
+  page = (struct zswap_page *) PHYS_REL (phys);
+  page->first = len;
+  page->last = 0;
+  zswap_list_add (page);
+  entry->page = page;
+  entry->len = len;
+  entry->last = 0;
+  return page + 1;
+}
+
+/*!
+ * Removes compressed data from its pool page. The pool page is freed once
+ * it holds no more compressed data.
+ *
+ * @param entry the slot of the compressed data
+ */
+
+static void
+zswap_remove (struct zswap_entry *entry)
+{
+  struct zswap_page *page = entry->page;
+  int full = page->first && page->last;
+  if (!full)
+    zswap_list_remove (page);
+  if (entry->last)
+    page->last = 0;
+  else
+    page->first = 0;
+  if (full)
+    zswap_list_add (page);
+  else
+    {
+      free_page ((uintptr_t) page - LOW_PHYSICAL_BASE_VMA);
+      zswap_stats.pool_pages--;
+    }
+  zswap_stats.stored--;
+  zswap_stats.stored_bytes -= entry->len;
+  entry->page = NULL;
+}
+
+/*!
+ * Allocates the table of compressed page slots. Since each pool page holds
+ * at most two compressed pages, the table has two slots for every page
+ * frame the pool may use.
+ *
+ * @return zero on success
+ */
+
+static int
+zswap_init (void)
+{
+  size_t count = phys_page_count * boot_options.zswap_percent / 100 * 2 + 1;
+  zswap_slots = calloc (count, sizeof (struct zswap_entry));
+  if (UNLIKELY (!zswap_slots))
+    return -1;
+  zswap_slot_count = count;
+  zswap_hint = 1;
+  return 0;
+}
+
+/*!
+ * Compresses a page into the compressed page pool. Pages that do not
+ * compress to less than @ref ZSWAP_MAX_LEN bytes are rejected.
+ *
+ * @param data the contents of the page
+ * @return the swap slot number of the compressed page, or zero if the page
+ * could not be stored
+ */
+
+size_t
+zswap_store (const void *data)
+{
+  struct zswap_entry *entry = NULL;
+  size_t slot = 0;
+  ssize_t len;
+  unsigned long flags;
+  void *ptr;
+  size_t i;
+  if (!boot_options.zswap_percent)
+    return 0;
+
+  flags = int_save_disable ();
+  spinlock_acquire (&zswap_lock);
+  if (!zswap_slots && zswap_init ())
+    goto end;
+  for (i = 1; i < zswap_slot_count; i++)
+    {
+      size_t curr = (zswap_hint + i - 1) % (zswap_slot_count - 1) + 1;
+      if (!zswap_slots[curr].page)
+	{
+	  entry = zswap_slots + curr;
+	  slot = curr;
+	  break;
+	}
+    }
+  if (!entry)
+    goto end;
+
+  len = lz4_compress (data, PAGE_SIZE, zswap_buffer, ZSWAP_MAX_LEN,
+		      zswap_table);
+  if (len < 0)
+    {
+      zswap_stats.rejected++;
+      slot = 0;
+      goto end;
+    }
+  ptr = zswap_place (entry, len);
+  if (!ptr)
+    {
+      slot = 0;
+      goto end;
+    }
+  memcpy (ptr, zswap_buffer, len);
+  entry->refs = 1;
+  zswap_hint = slot + 1;
+  zswap_stats.stored++;
+  zswap_stats.stored_bytes += len;
+  zswap_stats.stores++;
+  slot |= SWAP_SLOT_COMPRESSED;
+
+ end:
+  spinlock_release (&zswap_lock);
+  int_restore (flags);
+  return slot;
+}
+
+/*!
+ * Decompresses a page from the compressed page pool.
+ *
+ * @param slot the swap slot number of the compressed page
+ * @param buffer the page-sized buffer to store the page
+ * @return zero on success
+ */
+
+int
+zswap_load (size_t slot, void *buffer)
+{
+  struct zswap_entry *entry = zswap_slots + (slot & ~SWAP_SLOT_COMPRESSED);
+  const void *data;
+  unsigned long flags = int_save_disable ();
+  int ret = 0;
+  spinlock_acquire (&zswap_lock);
+  if (entry->last)
+    data = (char *) entry->page + PAGE_SIZE - entry->len;
+  else
+    data = entry->page + 1;
+  if (lz4_decompress (data, entry->len, buffer, PAGE_SIZE) != PAGE_SIZE)
+    ret = -1;
+  spinlock_release (&zswap_lock);
+  int_restore (flags);
+  if (ret)
+    RETV_ERROR (EIO, -1);
+  return 0;
+}
+
+/*!
+ * Adds a reference to a compressed page slot.
+ *
+ * @param slot the swap slot number of the compressed page
+ */
+
+void
+zswap_ref (size_t slot)
+{
+  struct zswap_entry *entry = zswap_slots + (slot & ~SWAP_SLOT_COMPRESSED);
+  unsigned long flags = int_save_disable ();
+  spinlock_acquire (&zswap_lock);
+  if (entry->refs < SWAP_MAX_REFS)
+    entry->refs++;
+  spinlock_release (&zswap_lock);
+  int_restore (flags);
+}
+
+/*!
+ * Removes a reference to a compressed page slot, freeing the compressed
+ * page if no references remain.
+ *
+ * @param slot the swap slot number of the compressed page
+ */
+
+void
+zswap_free (size_t slot)
+{
+  size_t index = slot & ~SWAP_SLOT_COMPRESSED;
+  struct zswap_entry *entry = zswap_slots + index;
+  unsigned long flags = int_save_disable ();
+  spinlock_acquire (&zswap_lock);
+  if (entry->refs && entry->refs < SWAP_MAX_REFS && !--entry->refs)
+    {
+      zswap_remove (entry);
+      if (index < zswap_hint)
+	zswap_hint = index;
+    }
+  spinlock_release (&zswap_lock);
+  int_restore (flags);
+}
@@ -17,10 +17,14 @@
 /*! @file */
 
 #include <pml/lock.h>
+#include <pml/memory.h>
 #include <pml/thread.h>
 
 /*!
  * Acquires a spinlock. This function will block until the spinlock is free.
+ * TLB shootdowns sent to the current CPU are handled while waiting, since
+ * the CPU holding the lock may be waiting for them with interrupts
+ * disabled on this CPU.
  *
  * @param l a pointer to the spinlock object
  */
@@ -31,7 +35,7 @@ spinlock_acquire (lock_t *l)
   while (__sync_lock_test_and_set (l, 1))
     {
       while (*l)
-	;
+	vm_tlb_poll ();
     }
 }
 
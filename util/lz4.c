@@ -0,0 +1,258 @@
+/* lz4.c -- This file is part of PML.
+   Copyright (C) 2021 XNSC
+
+   PML is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   PML is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with PML. If not, see <https://www.gnu.org/licenses/>. */
+
+/*! @file */
+
+#include <pml/lz4.h>
+#include <errno.h>
+#include <string.h>
+
+/*! Length of the shortest match that can be encoded */
+#define LZ4_MIN_MATCH           4
+/*! A match must not start in this many bytes before the end of the input */
+#define LZ4_MF_LIMIT            12
+/*! The last bytes of the input are always encoded as literals */
+#define LZ4_LAST_LITERALS       5
+/*! Largest distance from a match to the data it repeats */
+#define LZ4_MAX_OFFSET          0xffff
+
+/*!
+ * Reads 4 bytes of unaligned data.
+ *
+ * @param ptr pointer to the data
+ * @return the data as an integer
+ */
+
+static inline uint32_t
+lz4_read32 (const unsigned char *ptr)
+{
+  uint32_t value;
+  memcpy (&value, ptr, sizeof (uint32_t));
+  return value;
+}
+
+/*!
+ * Determines the index in the match table of a 4-byte sequence.
+ *
+ * @param value the sequence
+ * @return the index
+ */
+
+static inline unsigned int
+lz4_hash (uint32_t value)
+{
+  return (value * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/*!
+ * Writes the remainder of a length that does not fit in its token nibble.
+ *
+ * @param op the output pointer
+ * @param len the remaining length
+ * @return the output pointer after the length
+ */
+
+static unsigned char *
+lz4_write_len (unsigned char *op, size_t len)
+{
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+/*!
+ * Writes a sequence of literals followed by a match. The last sequence of
+ * a block has no match.
+ *
+ * @param op the output pointer
+ * @param oend the end of the output buffer
+ * @param lit pointer to the literals
+ * @param lit_len number of literals
+ * @param offset distance back from the match to the data it repeats
+ * @param match_len length of the match, or zero for the last sequence
+ * @return the output pointer after the sequence, or NULL if the output
+ * buffer is too small
+ */
+
+static unsigned char *
+lz4_write_seq (unsigned char *op, unsigned char *oend,
+	       const unsigned char *lit, size_t lit_len, size_t offset,
+	       size_t match_len)
+{
+  unsigned char *token;
+  if ((size_t) (oend - op) < 1 + lit_len + lit_len / 255 + 1 + 2
+      + match_len / 255 + 1)
+    return NULL;
+
+  token = op++;
+  if (lit_len >= 15)
+    {
+      *token = 15 << 4;
+      op = lz4_write_len (op, lit_len - 15);
+    }
+  else
+    *token = lit_len << 4;
+  memcpy (op, lit, lit_len);
+  op += lit_len;
+  if (!match_len)
+    return op;
+
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  match_len -= LZ4_MIN_MATCH;
+  if (match_len >= 15)
+    {
+      *token |= 15;
+      op = lz4_write_len (op, match_len - 15);
+    }
+  else
+    *token |= match_len;
+  return op;
+}
+
+/*!
+ * Compresses data into an LZ4 block. Matches are found greedily with a
+ * single-entry hash table of previous positions, which favors speed over
+ * compression ratio.
+ *
+ * @param src the data to compress
+ * @param len the number of bytes to compress, at most @ref LZ4_MAX_INPUT
+ * @param dest the buffer to store the compressed block
+ * @param dest_len the size of the output buffer
+ * @param table a match table of @ref LZ4_HASH_SIZE entries to use
+ * @return the size of the compressed block, or -1 if the output buffer
+ * is too small
+ */
+
+ssize_t
+lz4_compress (const void *src, size_t len, void *dest, size_t dest_len,
+	      uint16_t *table)
+{
+  const unsigned char *in = src;
+  const unsigned char *ip = in;
+  const unsigned char *anchor = in;
+  const unsigned char *end = in + len;
+  const unsigned char *mflimit = len > LZ4_MF_LIMIT ? end - LZ4_MF_LIMIT : in;
+  const unsigned char *matchlimit = end - LZ4_LAST_LITERALS;
+  unsigned char *op = dest;
+  unsigned char *oend = op + dest_len;
+  if (len > LZ4_MAX_INPUT)
+    RETV_ERROR (EINVAL, -1);
+  memset (table, 0, sizeof (uint16_t) * LZ4_HASH_SIZE);
+
+  while (ip < mflimit)
+    {
+      unsigned int h = lz4_hash (lz4_read32 (ip));
+      const unsigned char *ref = in + table[h];
+      size_t match_len;
+      table[h] = ip - in;
+      if (ref >= ip || ip - ref > LZ4_MAX_OFFSET
+	  || lz4_read32 (ref) != lz4_read32 (ip))
+	{
+	  ip++;
+	  continue;
+	}
+
+      for (match_len = LZ4_MIN_MATCH;
+	   ip + match_len < matchlimit && ref[match_len] == ip[match_len];
+	   match_len++)
+	;
+      op = lz4_write_seq (op, oend, anchor, ip - anchor, ip - ref, match_len);
+      if (!op)
+	RETV_ERROR (ENOSPC, -1);
+      ip += match_len;
+      anchor = ip;
+    }
+
+  op = lz4_write_seq (op, oend, anchor, end - anchor, 0, 0);
+  if (!op)
+    RETV_ERROR (ENOSPC, -1);
+  return op - (unsigned char *) dest;
+}
+
+/*!
+ * Decompresses an LZ4 block. The block is checked so that corrupt data
+ * cannot read or write outside of the buffers.
+ *
+ * @param src the compressed block
+ * @param len the size of the compressed block
+ * @param dest the buffer to store the decompressed data
+ * @param dest_len the size of the output buffer
+ * @return the number of bytes decompressed, or -1 if the block is invalid
+ */
+
+ssize_t
+lz4_decompress (const void *src, size_t len, void *dest, size_t dest_len)
+{
+  const unsigned char *ip = src;
+  const unsigned char *iend = ip + len;
+  unsigned char *op = dest;
+  unsigned char *oend = op + dest_len;
+  while (ip < iend)
+    {
+      unsigned int token = *ip++;
+      const unsigned char *match;
+      size_t offset;
+      size_t n = token >> 4;
+      unsigned char b;
+      if (n == 15)
+	{
+	  do
+	    {
+	      if (ip == iend)
+		RETV_ERROR (EINVAL, -1);
+	      b = *ip++;
+	      n += b;
+	    }
+	  while (b == 255);
+	}
+      if (n > (size_t) (iend - ip) || n > (size_t) (oend - op))
+	RETV_ERROR (EINVAL, -1);
+      memcpy (op, ip, n);
+      op += n;
+      ip += n;
+      if (ip == iend)
+	break;
+
+      if (iend - ip < 2)
+	RETV_ERROR (EINVAL, -1);
+      offset = ip[0] | ip[1] << 8;
+      ip += 2;
+      if (!offset || offset > (size_t) (op - (unsigned char *) dest))
+	RETV_ERROR (EINVAL, -1);
+      n = token & 15;
+      if (n == 15)
+	{
+	  do
+	    {
+	      if (ip == iend)
+		RETV_ERROR (EINVAL, -1);
+	      b = *ip++;
+	      n += b;
+	    }
+	  while (b == 255);
+	}
+      n += LZ4_MIN_MATCH;
+      if (n > (size_t) (oend - op))
+	RETV_ERROR (EINVAL, -1);
+
+      /* The match may overlap the data being written */
+      for (match = op - offset; n; n--)
+	*op++ = *match++;
+    }
+  return op - (unsigned char *) dest;
+}
@@ -14,46 +14,444 @@
    You should have received a copy of the GNU General Public License
    along with PML. If not, see <https://www.gnu.org/licenses/>. */
 
+/*! @file */
+
 #include <pml/alloc.h>
+#include <pml/interrupt.h>
+#include <pml/lock.h>
 #include <pml/memory.h>
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*!
+ * Magazine of free kernel heap blocks of a single size class. The blocks
+ * are still marked as allocated in the heap, and blocks freed into a
+ * magazine are also marked as cached so freeing them again is detected.
+ */
+
+struct kh_magazine
+{
+  struct kh_magazine *next;     /*!< Next magazine in a depot list */
+  size_t count;                 /*!< Number of blocks in the magazine */
+  void *rounds[KH_MAGAZINE_ROUNDS]; /*!< Cached blocks */
+};
+
+/*!
+ * Magazines of a size class owned by a CPU. Blocks are allocated from and
+ * freed to the loaded magazine. The previous magazine is swapped with the
+ * loaded one before going to the depot, so alternating allocations and
+ * frees at a magazine boundary do not reach the depot.
+ */
+
+struct kh_cpu_magazines
+{
+  struct kh_magazine *loaded;   /*!< Magazine in use */
+  struct kh_magazine *previous; /*!< Magazine used before the loaded one */
+};
+
+/*!
+ * Global depot of magazines for a size class. CPUs exchange full and empty
+ * magazines with the depot, and the kernel heap lock is only taken to
+ * refill an empty magazine or to drain a full one when the depot already
+ * has enough full magazines.
+ */
+
+struct kh_depot
+{
+  lock_t lock;                  /*!< Lock for the depot */
+  struct kh_magazine *full;     /*!< List of full magazines */
+  struct kh_magazine *empty;    /*!< List of empty magazines */
+  size_t full_count;            /*!< Number of full magazines */
+};
+
+static struct kh_cpu_magazines kh_cpu_magazines[MAX_CORES][KH_MAGAZINE_CLASSES];
+static struct kh_depot kh_depots[KH_MAGAZINE_CLASSES];
+
+/*!
+ * Returns the magazines of a size class owned by the current CPU. The CPU
+ * index is read from the local APIC, so this is cheap enough for the
+ * allocation fast path. Interrupts must be disabled.
+ *
+ * @param class the size class
+ * @return the magazines of the current CPU
+ */
+
+static inline struct kh_cpu_magazines *
+magazine_cpu (unsigned int class)
+{
+  return kh_cpu_magazines[smp_cpu_index ()] + class;
+}
+
+/*!
+ * Allocates an empty magazine from the kernel heap.
+ *
+ * @return the magazine, or NULL if the allocation failed
+ */
+
+static struct kh_magazine *
+magazine_create (void)
+{
+  struct kh_magazine *mag =
+    kh_alloc_aligned (sizeof (struct kh_magazine), KH_DEFAULT_ALIGN);
+  if (LIKELY (mag))
+    mag->count = 0;
+  return mag;
+}
+
+/*!
+ * Replaces the empty loaded magazine of a CPU with a full magazine from the
+ * depot, or fills it with new blocks from the kernel heap if the depot has
+ * no full magazines. Interrupts must be disabled.
+ *
+ * @param cpu the magazines of the current CPU
+ * @param class the size class
+ * @return zero on success
+ */
+
+static int
+magazine_reload (struct kh_cpu_magazines *cpu, unsigned int class)
+{
+  struct kh_depot *depot = kh_depots + class;
+  struct kh_magazine *mag;
+  spinlock_acquire (&depot->lock);
+  mag = depot->full;
+  if (mag)
+    {
+      depot->full = mag->next;
+      depot->full_count--;
+      if (cpu->loaded)
+	{
+	  cpu->loaded->next = depot->empty;
+	  depot->empty = cpu->loaded;
+	}
+      cpu->loaded = mag;
+      spinlock_release (&depot->lock);
+      return 0;
+    }
+  spinlock_release (&depot->lock);
+
+  if (!cpu->loaded)
+    {
+      cpu->loaded = magazine_create ();
+      if (UNLIKELY (!cpu->loaded))
+	return -1;
+    }
+  cpu->loaded->count = kh_alloc_batch ((class + 1) * KH_DEFAULT_ALIGN,
+				       cpu->loaded->rounds,
+				       KH_MAGAZINE_ROUNDS / 2);
+  return cpu->loaded->count ? 0 : -1;
+}
+
+/*!
+ * Replaces the full loaded magazine of a CPU with an empty magazine. The
+ * previous magazine, which is also full, is given to the depot, or its
+ * blocks are returned to the kernel heap if the depot has enough full
+ * magazines. Interrupts must be disabled.
+ *
+ * @param cpu the magazines of the current CPU
+ * @param class the size class
+ * @return zero on success
+ */
+
+static int
+magazine_unload (struct kh_cpu_magazines *cpu, unsigned int class)
+{
+  struct kh_depot *depot = kh_depots + class;
+  struct kh_magazine *mag = cpu->previous;
+  spinlock_acquire (&depot->lock);
+  if (mag && depot->full_count < KH_DEPOT_MAX_FULL)
+    {
+      mag->next = depot->full;
+      depot->full = mag;
+      depot->full_count++;
+      mag = NULL;
+    }
+  if (!mag && depot->empty)
+    {
+      mag = depot->empty;
+      depot->empty = mag->next;
+    }
+  spinlock_release (&depot->lock);
+
+  if (!mag)
+    {
+      mag = magazine_create ();
+      if (UNLIKELY (!mag))
+	return -1;
+    }
+  else if (mag->count)
+    {
+      kh_free_batch (mag->rounds, mag->count);
+      mag->count = 0;
+    }
+  cpu->previous = cpu->loaded;
+  cpu->loaded = mag;
+  return 0;
+}
+
+/*!
+ * Allocates a block of a size class from the magazines of the current CPU.
+ *
+ * @param class the size class
+ * @return a pointer to the block, or NULL if the allocation failed
+ */
+
+static void *
+magazine_alloc (unsigned int class)
+{
+  struct kh_cpu_magazines *cpu;
+  void *ptr = NULL;
+  unsigned long flags = int_save_disable ();
+  cpu = magazine_cpu (class);
+  if (!cpu->loaded || !cpu->loaded->count)
+    {
+      if (cpu->previous && cpu->previous->count)
+	{
+	  struct kh_magazine *temp = cpu->loaded;
+	  cpu->loaded = cpu->previous;
+	  cpu->previous = temp;
+	}
+      else if (magazine_reload (cpu, class))
+	goto end;
+    }
+  ptr = cpu->loaded->rounds[--cpu->loaded->count];
+  ((struct kh_header *) ptr - 1)->flags &= ~KH_FLAG_CACHED;
+
+ end:
+  int_restore (flags);
+  return ptr;
+}
+
+/*!
+ * Frees a block of a size class to the magazines of the current CPU.
+ *
+ * @param ptr the block
+ * @param class the size class
+ * @return zero on success
+ */
+
+static int
+magazine_free (void *ptr, unsigned int class)
+{
+  struct kh_cpu_magazines *cpu;
+  int ret = 0;
+  unsigned long flags = int_save_disable ();
+  cpu = magazine_cpu (class);
+  if (!cpu->loaded || cpu->loaded->count == KH_MAGAZINE_ROUNDS)
+    {
+      if (cpu->previous && cpu->previous->count < KH_MAGAZINE_ROUNDS)
+	{
+	  struct kh_magazine *temp = cpu->loaded;
+	  cpu->loaded = cpu->previous;
+	  cpu->previous = temp;
+	}
+      else if (magazine_unload (cpu, class))
+	{
+	  ret = -1;
+	  goto end;
+	}
+    }
+  ((struct kh_header *) ptr - 1)->flags |= KH_FLAG_CACHED;
+  cpu->loaded->rounds[cpu->loaded->count++] = ptr;
+
+ end:
+  int_restore (flags);
+  return ret;
+}
+
+/*!
+ * Returns the blocks in the full magazines of the depot to the kernel heap.
+ * This is done when the heap runs out of memory, so cached blocks can be
+ * unified with their neighbors.
+ */
+
+static void
+magazine_drain_depot (void)
+{
+  unsigned int i;
+  for (i = 0; i < KH_MAGAZINE_CLASSES; i++)
+    {
+      struct kh_depot *depot = kh_depots + i;
+      struct kh_magazine *full;
+      struct kh_magazine *mag;
+      unsigned long flags = int_save_disable ();
+      spinlock_acquire (&depot->lock);
+      full = depot->full;
+      depot->full = NULL;
+      depot->full_count = 0;
+      spinlock_release (&depot->lock);
+      int_restore (flags);
+
+      for (mag = full; mag; mag = full)
+	{
+	  full = mag->next;
+	  kh_free_batch (mag->rounds, mag->count);
+	  kh_free (mag);
+	}
+    }
+}
+
+/*!
+ * Allocates a block without recording it in the kernel heap accounting.
+ * Small blocks are taken from the magazines of the current CPU, and large
+ * blocks are mapped with vmalloc().
+ *
+ * @param size the size of the block
+ * @return a pointer to the block, or NULL if the allocation failed
+ */
+
+static void *
+malloc_block (size_t size)
+{
+  void *ptr;
+  if (size <= KH_MAGAZINE_MAX_SIZE)
+    {
+      unsigned int class = size ? (size - 1) / KH_DEFAULT_ALIGN : 0;
+      ptr = magazine_alloc (class);
+      if (LIKELY (ptr))
+	return ptr;
+    }
+  else if (size >= KH_LARGE_SIZE)
+    return vmalloc (size);
+  ptr = kh_alloc_aligned (size, KH_DEFAULT_ALIGN);
+  if (UNLIKELY (!ptr))
+    {
+      magazine_drain_depot ();
+      ptr = kh_alloc_aligned (size, KH_DEFAULT_ALIGN);
+    }
+  return ptr;
+}
+
+/*!
+ * Frees a block without recording it in the kernel heap accounting.
+ *
+ * @param ptr the block to free
+ */
+
+static void
+free_block (void *ptr)
+{
+  struct kh_header *header;
+  if (!ptr)
+    return;
+  if (IS_VMALLOC_ADDR (ptr))
+    {
+      vfree (ptr);
+      return;
+    }
+
+  /* Blocks are cached by their size in the heap, so a cached block can be
+     reused by any allocation in its size class. The header of a cached
+     block is still marked as allocated, so blocks that are already free
+     or cached are rejected here instead of by the heap. */
+  header = (struct kh_header *) ptr - 1;
+  if (header->magic == KH_HEADER_MAGIC && header->size <= KH_MAGAZINE_MAX_SIZE)
+    {
+      if (UNLIKELY ((header->flags & (KH_FLAG_ALLOC | KH_FLAG_CACHED))
+		    != KH_FLAG_ALLOC))
+	{
+	  debug_printf ("invalid pointer");
+	  RET_ERROR (EFAULT);
+	}
+      if (!magazine_free (ptr, header->size / KH_DEFAULT_ALIGN - 1))
+	return;
+    }
+  kh_free (ptr);
+}
+
 void *
 malloc (size_t size)
 {
-  return kh_alloc_aligned (size, KH_DEFAULT_ALIGN);
+  void *ptr = malloc_block (size);
+  if (UNLIKELY (boot_options.heapinfo))
+    heapinfo_alloc (ptr, __builtin_return_address (0));
+  return ptr;
 }
 
 void *
 calloc (size_t block, size_t size)
 {
-  void *ptr = malloc (block * size);
+  void *ptr = malloc_block (block * size);
   if (LIKELY (ptr))
     memset (ptr, 0, block * size);
+  if (UNLIKELY (boot_options.heapinfo))
+    heapinfo_alloc (ptr, __builtin_return_address (0));
   return ptr;
 }
 
 void *
 aligned_alloc (size_t align, size_t size)
 {
-  return kh_alloc_aligned (size, align);
+  void *ptr;
+  if (size >= KH_LARGE_SIZE && align <= PAGE_SIZE && IS_P2 (align))
+    ptr = vmalloc (size);
+  else
+    ptr = kh_alloc_aligned (size, align);
+  if (UNLIKELY (boot_options.heapinfo))
+    heapinfo_alloc (ptr, __builtin_return_address (0));
+  return ptr;
 }
 
 void *
 valloc (size_t size)
 {
-  return kh_alloc_aligned (size, PAGE_SIZE);
+  void *ptr;
+  if (size >= KH_LARGE_SIZE)
+    ptr = vmalloc (size);
+  else
+    ptr = kh_alloc_aligned (size, PAGE_SIZE);
+  if (UNLIKELY (boot_options.heapinfo))
+    heapinfo_alloc (ptr, __builtin_return_address (0));
+  return ptr;
 }
 
 void *
 realloc (void *ptr, size_t size)
 {
-  return kh_realloc (ptr, size);
+  size_t old_size;
+  void *new_ptr;
+  if (UNLIKELY (boot_options.heapinfo))
+    heapinfo_free (ptr);
+
+  if (!ptr)
+    new_ptr = malloc_block (size);
+  else if (IS_VMALLOC_ADDR (ptr))
+    {
+      old_size = vmalloc_size (ptr);
+      new_ptr = size <= old_size ? ptr : NULL;
+    }
+  else if (size >= KH_LARGE_SIZE)
+    {
+      /* Blocks from aligned_alloc() may already be large enough */
+      old_size = ((struct kh_header *) ptr - 1)->size;
+      new_ptr = size <= old_size ? ptr : NULL;
+    }
+  else
+    new_ptr = kh_realloc (ptr, size);
+
+  /* Move the data to a new large allocation */
+  if (!new_ptr && ptr && (IS_VMALLOC_ADDR (ptr) || size >= KH_LARGE_SIZE))
+    {
+      new_ptr = vmalloc (size);
+      if (LIKELY (new_ptr))
+	{
+	  memcpy (new_ptr, ptr, old_size < size ? old_size : size);
+	  free_block (ptr);
+	}
+    }
+
+  /* The old block is still allocated if reallocating failed */
+  if (UNLIKELY (boot_options.heapinfo))
+    heapinfo_alloc (new_ptr ? new_ptr : ptr, __builtin_return_address (0));
+  return new_ptr;
 }
 
 void
 free (void *ptr)
 {
-  return kh_free (ptr);
+  if (UNLIKELY (boot_options.heapinfo))
+    heapinfo_free (ptr);
+  free_block (ptr);
 }
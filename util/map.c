@@ -16,10 +16,19 @@
 
 /*! @file */
 
+#include <pml/alloc.h>
 #include <pml/map.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*! Object cache for hashmap entries */
+static struct kmem_cache hashmap_entry_cache =
+  KMEM_CACHE_INIT ("hashmap_entry", sizeof (struct hashmap_entry), NULL);
+
+/*! Object cache for string hashmap entries */
+static struct kmem_cache strmap_entry_cache =
+  KMEM_CACHE_INIT ("strmap_entry", sizeof (struct strmap_entry), NULL);
+
 /*!
  * Creates a new hashmap with no elements and a bucket count of
  * @ref HASHMAP_INIT_BUCKETS.
@@ -65,9 +74,10 @@ hashmap_free (struct hashmap *hashmap, hashmap_free_t free_func)
 	  temp = bucket->next;
 	  if (free_func)
 	    free_func (bucket->value);
-	  free (bucket);
+	  kmem_cache_free (&hashmap_entry_cache, bucket);
 	}
     }
+  free (hashmap->buckets);
   free (hashmap);
 }
 
@@ -98,38 +108,18 @@ hashmap_insert (struct hashmap *hashmap, unsigned long key, void *value)
       size_t i;
       if (UNLIKELY (!buckets))
 	return -1;
+      /* Move the existing entries to their new buckets */
       for (i = 0; i < hashmap->bucket_count; i++)
 	{
 	  struct hashmap_entry *temp;
-	  for (bucket = hashmap->buckets[i]; bucket != NULL;
-	       bucket = bucket->next)
+	  for (bucket = hashmap->buckets[i]; bucket != NULL; bucket = temp)
 	    {
+	      temp = bucket->next;
 	      index =
 		siphash ((void *) &bucket->key, sizeof (unsigned long), 0) %
 		(hashmap->bucket_count * 2);
-	      temp = malloc (sizeof (struct hashmap_entry));
-	      if (UNLIKELY (!temp))
-		{
-		  free (buckets);
-		  return -1;
-		}
-	      temp->next = NULL;
-	      temp->key = bucket->key;
-	      temp->value = bucket->value;
-	      if (buckets[index])
-		{
-		  for (new_entry = buckets[index]; new_entry->next != NULL;
-		       new_entry = new_entry->next)
-		    ;
-		  new_entry->next = temp;
-		}
-	      else
-		buckets[index] = temp;
-	    }
-	  for (bucket = hashmap->buckets[i]; bucket != NULL; bucket = temp)
-	    {
-	      temp = bucket->next;
-	      free (bucket);
+	      bucket->next = buckets[index];
+	      buckets[index] = bucket;
 	    }
 	}
       free (hashmap->buckets);
@@ -150,7 +140,7 @@ hashmap_insert (struct hashmap *hashmap, unsigned long key, void *value)
     }
 
   /* Create and insert a new entry into the hashmap */
-  new_entry = malloc (sizeof (struct hashmap_entry));
+  new_entry = kmem_cache_alloc (&hashmap_entry_cache);
   if (UNLIKELY (!new_entry))
     return -1;
   index = siphash ((void *) &key, sizeof (unsigned long), 0) %
@@ -224,24 +214,23 @@ hashmap_iterate (struct hashmap *hashmap, hashmap_iter_t func, void *data)
 int
 hashmap_remove (struct hashmap *hashmap, unsigned long key)
 {
-  size_t i;
-  for (i = 0; i < hashmap->bucket_count; i++)
+  hash_t index = siphash ((void *) &key, sizeof (unsigned long), 0) %
+    hashmap->bucket_count;
+  struct hashmap_entry *prev = NULL;
+  struct hashmap_entry *bucket;
+  for (bucket = hashmap->buckets[index]; bucket != NULL; bucket = bucket->next)
     {
-      struct hashmap_entry *prev = NULL;
-      struct hashmap_entry *bucket;
-      for (bucket = hashmap->buckets[i]; bucket != NULL; bucket = bucket->next)
+      if (bucket->key == key)
 	{
-	  if (bucket->key == key)
-	    {
-	      if (prev)
-		prev->next = bucket->next;
-	      else
-		hashmap->buckets[i] = bucket->next;
-	      free (bucket);
-	      return 0;
-	    }
-	  prev = bucket;
+	  if (prev)
+	    prev->next = bucket->next;
+	  else
+	    hashmap->buckets[index] = bucket->next;
+	  kmem_cache_free (&hashmap_entry_cache, bucket);
+	  hashmap->object_count--;
+	  return 0;
 	}
+      prev = bucket;
     }
   return -1;
 }
@@ -292,9 +281,10 @@ strmap_free (struct strmap *strmap, hashmap_free_t free_func)
 	  if (free_func)
 	    free_func (bucket->value);
 	  free (bucket->key);
-	  free (bucket);
+	  kmem_cache_free (&strmap_entry_cache, bucket);
 	}
     }
+  free (strmap->buckets);
   free (strmap);
 }
 
@@ -325,37 +315,17 @@ strmap_insert (struct strmap *strmap, const char *key, void *value)
       size_t i;
       if (UNLIKELY (!buckets))
 	return -1;
+      /* Move the existing entries to their new buckets */
       for (i = 0; i < strmap->bucket_count; i++)
 	{
 	  struct strmap_entry *temp;
-	  for (bucket = strmap->buckets[i]; bucket != NULL;
-	       bucket = bucket->next)
-	    {
-	      index = siphash (bucket->key, strlen (bucket->key), 0) %
-		(strmap->bucket_count * 2);
-	      temp = malloc (sizeof (struct strmap_entry));
-	      if (UNLIKELY (!temp))
-		{
-		  free (buckets);
-		  return -1;
-		}
-	      temp->next = NULL;
-	      temp->key = bucket->key;
-	      temp->value = bucket->value;
-	      if (buckets[index])
-		{
-		  for (new_entry = buckets[index]; new_entry->next != NULL;
-		       new_entry = new_entry->next)
-		    ;
-		  new_entry->next = temp;
-		}
-	      else
-		buckets[index] = temp;
-	    }
 	  for (bucket = strmap->buckets[i]; bucket != NULL; bucket = temp)
 	    {
 	      temp = bucket->next;
-	      free (bucket);
+	      index = siphash (bucket->key, strlen (bucket->key), 0) %
+		(strmap->bucket_count * 2);
+	      bucket->next = buckets[index];
+	      buckets[index] = bucket;
 	    }
 	}
       free (strmap->buckets);
@@ -375,12 +345,16 @@ strmap_insert (struct strmap *strmap, const char *key, void *value)
     }
 
   /* Create and insert a new entry into the strmap */
-  new_entry = malloc (sizeof (struct strmap_entry));
+  new_entry = kmem_cache_alloc (&strmap_entry_cache);
   if (UNLIKELY (!new_entry))
     return -1;
-  index = siphash (key, strlen (key), 0) % strmap->bucket_count;
   new_entry->next = NULL;
   new_entry->key = strdup (key);
+  if (UNLIKELY (!new_entry->key))
+    {
+      kmem_cache_free (&strmap_entry_cache, new_entry);
+      return -1;
+    }
   new_entry->value = value;
   if (strmap->buckets[index])
     {
@@ -447,25 +421,23 @@ strmap_iterate (struct strmap *strmap, strmap_iter_t func, void *data)
 int
 strmap_remove (struct strmap *strmap, const char *key)
 {
-  size_t i;
-  for (i = 0; i < strmap->bucket_count; i++)
+  hash_t index = siphash (key, strlen (key), 0) % strmap->bucket_count;
+  struct strmap_entry *prev = NULL;
+  struct strmap_entry *bucket;
+  for (bucket = strmap->buckets[index]; bucket != NULL; bucket = bucket->next)
     {
-      struct strmap_entry *prev = NULL;
-      struct strmap_entry *bucket;
-      for (bucket = strmap->buckets[i]; bucket != NULL; bucket = bucket->next)
+      if (!strcmp (bucket->key, key))
 	{
-	  if (!strcmp (bucket->key, key))
-	    {
-	      if (prev)
-		prev->next = bucket->next;
-	      else
-		strmap->buckets[i] = bucket->next;
-	      return 0;
-	    }
+	  if (prev)
+	    prev->next = bucket->next;
+	  else
+	    strmap->buckets[index] = bucket->next;
 	  free (bucket->key);
-	  free (bucket);
-	  prev = bucket;
+	  kmem_cache_free (&strmap_entry_cache, bucket);
+	  strmap->object_count--;
+	  return 0;
 	}
+      prev = bucket;
     }
   return -1;
 }